@@ -17,9 +17,8 @@ func compress(str_to_compress string) []byte {
         clen := C.int(len(str_to_compress))
         //defer C.free(unsafe.Pointer(&clen)) // Not sure if clen to be freed
 
-	// Allocate sufficient buffer for holding compressed data
-	// should be a little larger than the input string for safety
-	ptr := C.malloc(C.sizeof_char * 1000)
+	// Allocate exactly the buffer needed for holding compressed data
+	ptr := C.malloc(C.sizeof_char * C.size_t(C.unishox2_compressed_size_simple(cstr, clen)))
 	defer C.free(unsafe.Pointer(ptr))
 
 	size := C.unishox2_compress_simple(cstr, clen, (*C.char)(ptr))
@@ -34,10 +33,10 @@ func decompress(compressed_bytes []byte) string {
         cbytes := C.CBytes(compressed_bytes)
         defer C.free(unsafe.Pointer(cbytes))
 
-        // Allocate sufficient buffer for receiving decompressed string
-        ptr := C.malloc(C.sizeof_char * 1000)
-        defer C.free(unsafe.Pointer(ptr))
         dlen := C.int(len(compressed_bytes))
+        // Allocate exactly the buffer needed for receiving decompressed string
+        ptr := C.malloc(C.sizeof_char * C.size_t(C.unishox2_decompressed_size_simple((*C.char)(cbytes), dlen) + 1))
+        defer C.free(unsafe.Pointer(ptr))
         // defer C.free(unsafe.Pointer(&dlen)) // Not sure if dlen to be freed
 
         str_size := C.unishox2_decompress_simple((*C.char)(cbytes), dlen, (*C.char) (ptr))
@@ -25,10 +25,17 @@
  * It also provides command line options for demonstration \n
  * of its features.
  */
+#if !defined(_MSC_VER) && !defined(_POSIX_C_SOURCE)
+/// for clock_gettime() used by -bench
+#define _POSIX_C_SOURCE 199309L
+#endif
+
 #include "unishox2.h"
 
 #ifdef _MSC_VER
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
 #else
 #include <sys/time.h>
 #endif
@@ -39,6 +46,7 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <limits.h>
 
 /// Internal function to call compress function in unishox2.c
 int unishox2_compress_preset_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen), int preset, struct us_lnk_lst *prev_lines) {
@@ -122,6 +130,59 @@ int unishox2_decompress_preset_lines(const char *in, int len, UNISHOX_API_OUT_AN
   return 0;
 }
 
+/// Writes unsigned 32 bit little endian number
+void write_u32le(uint8_t *buf, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    buf[i] = (uint8_t) (value >> (i * 8));
+}
+
+/// Builds a string table (see struct unishox2_table) of the given lines in a buffer allocated using malloc. \n
+/// Returns length of the table or 0 if it could not be built
+int build_string_table(const char *lines[], const int lens[], int count, int preset, char **table_p) {
+  int tot_len = 0;
+  int max_len = 0;
+  for (int i = 0; i < count; i++) {
+    tot_len += lens[i];
+    if (lens[i] > max_len)
+      max_len = lens[i];
+  }
+  const int offsets_len = (count + 1) * 4;
+  const int payload_cap = tot_len * 2 + count * 8 + 64;
+  char *table = (char *) malloc(UNISHOX_TABLE_HEADER_LEN + offsets_len + payload_cap);
+  int *offsets = (int *) malloc((count + 1) * sizeof(int));
+  struct unishox2_ctx ctx;
+  unishox2_init_preset_ctx(&ctx, preset);
+  char *payload = table + UNISHOX_TABLE_HEADER_LEN + offsets_len;
+  const int payload_len = unishox2_compress_batch(lines, lens, count, UNISHOX_API_OUT_AND_LEN(payload, payload_cap), offsets, &ctx);
+  if (payload_len > payload_cap) {
+    free(offsets);
+    free(table);
+    return 0;
+  }
+  uint8_t *header = (uint8_t *) table;
+  memcpy(header, UNISHOX_TABLE_MAGIC, 4);
+  header[4] = UNISHOX_TABLE_VERSION;
+  header[5] = (uint8_t) preset;
+  header[6] = header[7] = 0;
+  write_u32le(header + 8, count);
+  write_u32le(header + 12, max_len);
+  write_u32le(header + 16, payload_len);
+  for (int i = 0; i <= count; i++)
+    write_u32le(header + UNISHOX_TABLE_HEADER_LEN + i * 4, offsets[i]);
+  free(offsets);
+  *table_p = table;
+  return UNISHOX_TABLE_HEADER_LEN + offsets_len + payload_len;
+}
+
+/// Allocator for testing unishox2_decompress_alloc(). \n
+/// Counts calls in sizes[0] and records the last size in sizes[1]
+void *test_alloc(size_t size, void *alloc_ctx) {
+  size_t *sizes = (size_t *) alloc_ctx;
+  sizes[0]++;
+  sizes[1] = size;
+  return malloc(size);
+}
+
 int test_ushx_cd_with_len(char *input, int len, int preset) {
 
   char cbuf[200];
@@ -132,6 +193,25 @@ int test_ushx_cd_with_len(char *input, int len, int preset) {
     return 0;
   }
   printf("\n\n");
+  struct unishox2_ctx ctx;
+  unishox2_init_preset_ctx(&ctx, preset);
+  int bit_len;
+  const int clen_size = unishox2_compressed_size(input, len, &ctx, &bit_len);
+  if (clen_size != clen || (bit_len + 7) / 8 != clen) {
+    printf("Fail compressed size: %d, %d, %d bits\n", clen, clen_size, bit_len);
+    return 0;
+  }
+  char cbuf_ctx[sizeof cbuf];
+  const int clen_ctx = unishox2_compress_ctx(input, len, UNISHOX_API_OUT_AND_LEN(cbuf_ctx, sizeof cbuf_ctx), &ctx);
+  if (clen_ctx != clen || memcmp(cbuf, cbuf_ctx, clen)) {
+    printf("Fail compress ctx: %d, %d\n", clen, clen_ctx);
+    return 0;
+  }
+  const int dlen_size = unishox2_decompressed_size(cbuf, clen, &ctx);
+  if (dlen_size != len) {
+    printf("Fail decompressed size: %d, %d\n", len, dlen_size);
+    return 0;
+  }
   int dlen = unishox2_decompress_preset_lines(cbuf, clen, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), preset, NULL);
   if (dlen > (int)sizeof dbuf) {
     printf("Decompress Overflow\n");
@@ -345,6 +425,411 @@ int presetForUnicode(int preset) {
   return  1; // true
 }
 
+/// Position of each set in hcodes and hcode lengths
+enum {HCODE_ALPHA = 0, HCODE_SYM, HCODE_NUM, HCODE_DICT, HCODE_DELTA};
+
+/// Longest frequent sequence looked for by train_preset()
+#define TRAIN_MAX_SEQ_LEN 12
+/// Number of candidate sequences tried in each of the 6 places for frequent sequences
+#define TRAIN_CANDIDATES 40
+/// Strings are sampled from the corpus up to this many bytes, which are compressed for trying each candidate
+#define TRAIN_SAMPLE_LEN 65536
+/// Choosing sequences, hcodes and sets is repeated up to this many times while it gives a smaller size
+#define TRAIN_ROUNDS 3
+/// Number of the most frequent characters from U+0080 to U+00FF tried in place of the least frequent of each set
+#define TRAIN_LATIN1_CANDIDATES 16
+
+/// Parameters of a preset found by train_preset() from a corpus of strings
+struct train_preset {
+  uint8_t hcodes[5];
+  uint8_t hcode_lens[5];
+  char seqs[6][TRAIN_MAX_SEQ_LEN + 1];
+  const char *freq_seq[6];   ///< seqs, as passed to the API
+  uint8_t sets[3][28];       ///< characters of the sets, as passed to unishox2_init_ctx_sets()
+  int base_preset;           ///< fixed preset that compressed the sample best, from which training started
+  long bytes_in;             ///< length of the sample
+  long base_bytes_out;       ///< sample compressed using base_preset
+  long bytes_out;            ///< sample compressed using the trained parameters
+};
+
+/// A sequence of the sample and its estimated saving in bits, if coded as a frequent sequence
+struct train_candidate {
+  const char *seq;
+  int len;
+  int count;
+  long gain;
+};
+
+/// Sum of the compressed lengths of the strings using the given parameters
+static long train_size(const char *strs[], const int lens[], int count, const uint8_t hcodes[], const uint8_t hcode_lens[], const char *freq_seq[], const uint8_t sets[][28]) {
+  struct unishox2_ctx ctx;
+  unishox2_init_ctx_sets(&ctx, hcodes, hcode_lens, freq_seq, USX_TEMPLATES, sets);
+  long size = 0;
+  for (int i = 0; i < count; i++)
+    size += unishox2_compressed_size(strs[i], lens[i], &ctx, NULL);
+  return size;
+}
+
+/// Returns 1 if all strings come back the same after compressing and decompressing using ctx
+static int train_lossless(const char *strs[], const int lens[], int count, const struct unishox2_ctx *ctx) {
+  int buf_len = 0;
+  for (int i = 0; i < count; i++) {
+    if (lens[i] > buf_len)
+      buf_len = lens[i];
+  }
+  buf_len = buf_len * 2 + 16;
+  char *cbuf = (char *) malloc(buf_len);
+  char *dbuf = (char *) malloc(buf_len);
+  int ok = 1;
+  for (int i = 0; ok && i < count; i++) {
+    const int clen = unishox2_compress_ctx(strs[i], lens[i], UNISHOX_API_OUT_AND_LEN(cbuf, buf_len), ctx);
+    const int dlen = unishox2_decompress_ctx(cbuf, clen, UNISHOX_API_OUT_AND_LEN(dbuf, buf_len), ctx);
+    ok = (dlen == lens[i] && memcmp(strs[i], dbuf, dlen) == 0);
+  }
+  free(dbuf);
+  free(cbuf);
+  return ok;
+}
+
+static int train_cmp_seq(const void *a, const void *b) {
+  return strncmp(*(const char * const *) a, *(const char * const *) b, TRAIN_MAX_SEQ_LEN);
+}
+
+/// Rough bits taken by a character when not part of a frequent sequence
+static int train_char_bits(char c) {
+  if ((c >= 'a' && c <= 'z') || c == ' ')
+    return 5;
+  if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+    return 7;
+  return 9;
+}
+
+/// Adds a candidate to the list sorted by gain, keeping only the best max_count
+static void train_add_candidate(struct train_candidate *cands, int *count, int max_count, const struct train_candidate *cand) {
+  int pos = *count;
+  if (pos == max_count && cands[pos - 1].gain >= cand->gain)
+    return;
+  if (pos == max_count)
+    pos--;
+  while (pos > 0 && cands[pos - 1].gain < cand->gain) {
+    cands[pos] = cands[pos - 1];
+    pos--;
+  }
+  cands[pos] = *cand;
+  if (*count < max_count)
+    (*count)++;
+}
+
+/// Finds the printable ASCII sequences of 2 to TRAIN_MAX_SEQ_LEN bytes of text that would save the most bits \n
+/// as frequent sequences, by sorting the positions of text, whose strings are separated by '\0', so that \n
+/// the same sequences come together. Sequences found mostly within a better one are left out. \n
+/// Returns the number of candidates written to cands
+static int train_find_candidates(const char *text, long text_len, struct train_candidate *cands, int max_count) {
+  const char **pos = (const char **) malloc((text_len + 1) * sizeof(char *));
+  long pos_count = 0;
+  for (long i = 0; i + 1 < text_len; i++) {
+    if (text[i] >= ' ' && text[i] <= '~' && text[i + 1] >= ' ' && text[i + 1] <= '~')
+      pos[pos_count++] = text + i;
+  }
+  qsort((void *) pos, pos_count, sizeof(char *), train_cmp_seq);
+  const int top_max = max_count * 4;
+  struct train_candidate *top = (struct train_candidate *) malloc(top_max * sizeof(struct train_candidate));
+  int top_count = 0;
+  long run_start[TRAIN_MAX_SEQ_LEN + 1] = {0};
+  for (long i = 1; i <= pos_count; i++) {
+    // sequences of each length shared by positions from run_start up to i - 1
+    int common = 0;
+    if (i < pos_count) {
+      while (common < TRAIN_MAX_SEQ_LEN && pos[i][common] == pos[i - 1][common] && pos[i][common] >= ' ' && pos[i][common] <= '~')
+        common++;
+    }
+    for (int len = TRAIN_MAX_SEQ_LEN; len > common; len--) {
+      if (len >= 2 && i - run_start[len] > 1) {
+        const char *seq = pos[i - 1];
+        int bits = 0, j = 0;
+        while (j < len && seq[j] >= ' ' && seq[j] <= '~')
+          bits += train_char_bits(seq[j++]);
+        if (j == len) {
+          const struct train_candidate cand = {seq, len, (int) (i - run_start[len]), (i - run_start[len]) * (bits - 2 - 2 - 7)};
+          if (cand.gain > 0)
+            train_add_candidate(top, &top_count, top_max, &cand);
+        }
+      }
+      run_start[len] = i;
+    }
+  }
+  int count = 0;
+  for (int i = 0; i < top_count && count < max_count; i++) {
+    int within = 0;
+    for (int j = 0; j < count && !within; j++) {
+      for (int k = 0; !within && k + top[i].len <= cands[j].len; k++)
+        within = (memcmp(cands[j].seq + k, top[i].seq, top[i].len) == 0 && cands[j].count * 4 >= top[i].count * 3);
+    }
+    if (!within)
+      cands[count++] = top[i];
+  }
+  free(top);
+  free((void *) pos);
+  return count;
+}
+
+/// Chooses the frequent sequences of tp one place at a time, trying each candidate (and no sequence) in it \n
+/// and keeping the one giving the smallest size
+static void train_choose_seqs(const char *strs[], const int lens[], int count, struct train_preset *tp,
+      const struct train_candidate *cands, int cand_count) {
+  for (int i = 0; i < 6; i++)
+    tp->seqs[i][0] = 0;
+  for (int i = 0; i < 6; i++) {
+    long best_size = train_size(strs, lens, count, tp->hcodes, tp->hcode_lens, tp->freq_seq, tp->sets);
+    int best = -1;
+    for (int c = 0; c < cand_count; c++) {
+      int used = 0;
+      for (int j = 0; j < i && !used; j++)
+        used = ((int) strlen(tp->seqs[j]) == cands[c].len && memcmp(tp->seqs[j], cands[c].seq, cands[c].len) == 0);
+      if (used)
+        continue;
+      memcpy(tp->seqs[i], cands[c].seq, cands[c].len);
+      tp->seqs[i][cands[c].len] = 0;
+      const long size = train_size(strs, lens, count, tp->hcodes, tp->hcode_lens, tp->freq_seq, tp->sets);
+      if (size < best_size) {
+        best_size = size;
+        best = c;
+      }
+    }
+    if (best < 0) {
+      tp->seqs[i][0] = 0;
+      continue;
+    }
+    memcpy(tp->seqs[i], cands[best].seq, cands[best].len);
+    tp->seqs[i][cands[best].len] = 0;
+  }
+}
+
+/// Tries all complete prefix codes of up to 5 bits for the sets, in canonical order, and keeps the one \n
+/// giving the smallest size in tp. The dictionary set may be left out and so may the Unicode set if allowed. \n
+/// The alphabet, symbol and number sets are always kept since the terminator and most text need them.
+static void train_choose_hcodes(const char *strs[], const int lens[], int count, struct train_preset *tp, int can_drop_delta) {
+  long best_size = train_size(strs, lens, count, tp->hcodes, tp->hcode_lens, tp->freq_seq, tp->sets);
+  uint8_t try_lens[5];
+  for (int n = 0; n < 6 * 6 * 6 * 6 * 6; n++) {
+    int kraft = 0;
+    for (int i = 0, m = n; i < 5; i++, m /= 6) {
+      try_lens[i] = (uint8_t) (m % 6);
+      if (try_lens[i])
+        kraft += 32 >> try_lens[i];
+    }
+    if (kraft != 32 || !try_lens[HCODE_ALPHA] || !try_lens[HCODE_SYM] || !try_lens[HCODE_NUM] || (!try_lens[HCODE_DELTA] && !can_drop_delta))
+      continue;
+    // canonical codes, shorter first and in the order of the sets for the same length
+    uint8_t try_codes[5] = {0};
+    int code = 0, code_len = 0;
+    for (int len = 1; len <= 5; len++) {
+      for (int i = 0; i < 5; i++) {
+        if (try_lens[i] != len)
+          continue;
+        code <<= (len - code_len);
+        code_len = len;
+        try_codes[i] = (uint8_t) (code << (8 - len));
+        code++;
+      }
+    }
+    const long size = train_size(strs, lens, count, try_codes, try_lens, tp->freq_seq, tp->sets);
+    if (size < best_size) {
+      best_size = size;
+      memcpy(tp->hcodes, try_codes, 5);
+      memcpy(tp->hcode_lens, try_lens, 5);
+    }
+  }
+}
+
+/// Returns 1 if position v of set h is used by the format and so cannot be changed in the sets
+static int train_is_fixed(int h, int v) {
+  switch (h) {
+    case HCODE_ALPHA: return v < 2;
+    case HCODE_SYM: return v == 7 || v == 8 || v == 14 || v == 22 || v > 24;
+  }
+  return v == 0 || v == 17 || v > 22;
+}
+
+/// Sorts the characters of each set of tp by their count in freq, so that the more frequent get shorter codes
+static void train_sort_sets(struct train_preset *tp, const long freq[256]) {
+  for (int h = 0; h < 3; h++) {
+    for (int v = 0; v < 28; v++) {
+      if (train_is_fixed(h, v))
+        continue;
+      for (int w = v + 1; w < 28; w++) {
+        if (train_is_fixed(h, w))
+          continue;
+        const uint8_t a = tp->sets[h][v];
+        const uint8_t b = tp->sets[h][w];
+        if (b && (!a || freq[b] > freq[a])) {
+          tp->sets[h][v] = b;
+          tp->sets[h][w] = a;
+        }
+      }
+    }
+  }
+}
+
+/// Chooses the sets of tp, sorting them by how often their characters appear in the sample text \n
+/// and trying each of the most frequent characters from U+0080 to U+00FF in place of the least frequent \n
+/// character of each set, keeping those giving a smaller size. Characters left out are escaped as binary.
+static void train_choose_sets(const char *strs[], const int lens[], int count, struct train_preset *tp,
+      const char *text, long text_len) {
+  // counts by set character, capital letters counted with their small letter
+  long freq[256] = {0};
+  for (long i = 0; i < text_len; i++) {
+    uint8_t c = (uint8_t) text[i];
+    if ((c & 0xFE) == 0xC2 && i + 1 < text_len && (text[i + 1] & 0xC0) == 0x80) {
+      c = (uint8_t) (((c & 0x01) << 6 | (text[++i] & 0x3F)) + 0x80);
+      if (c >= 0xC0 && c <= 0xDE && c != 0xD7)
+        c += 0x20;
+    } else if (c >= 'A' && c <= 'Z')
+      c += 0x20;
+    else if (c == 0 || c >= 0x80)
+      continue;
+    freq[c]++;
+  }
+  long best_size = train_size(strs, lens, count, tp->hcodes, tp->hcode_lens, tp->freq_seq, tp->sets);
+  uint8_t best_sets[3][28];
+  memcpy(best_sets, tp->sets, sizeof(best_sets));
+  train_sort_sets(tp, freq);
+  long size = train_size(strs, lens, count, tp->hcodes, tp->hcode_lens, tp->freq_seq, tp->sets);
+  if (size < best_size) {
+    best_size = size;
+    memcpy(best_sets, tp->sets, sizeof(best_sets));
+  }
+  // counts of the characters not yet tried
+  long left[128];
+  memcpy(left, freq + 0x80, sizeof(left));
+  for (int n = 0; n < TRAIN_LATIN1_CANDIDATES; n++) {
+    int cand = 0;
+    for (int c = 0x80; c < 0x100; c++) {
+      if (left[c - 0x80] && (cand == 0 || left[c - 0x80] > left[cand - 0x80]))
+        cand = c;
+    }
+    if (cand == 0)
+      break;
+    const long cand_freq = freq[cand];
+    left[cand - 0x80] = 0;
+    int in_sets = 0;
+    for (int h = 0; h < 3; h++) {
+      for (int v = 0; v < 28; v++)
+        in_sets |= (best_sets[h][v] == cand);
+    }
+    if (in_sets)
+      continue;
+    uint8_t base_sets[3][28];
+    memcpy(base_sets, best_sets, sizeof(base_sets));
+    for (int h = 0; h < 3; h++) {
+      // in place of the least frequent character of the set, or an unused position
+      int least = -1;
+      for (int v = 0; v < 28; v++) {
+        if (!train_is_fixed(h, v) && (least < 0 || !base_sets[h][v]
+              || (base_sets[h][least] && freq[base_sets[h][v]] < freq[base_sets[h][least]])))
+          least = v;
+      }
+      if (base_sets[h][least] && freq[base_sets[h][least]] >= cand_freq)
+        continue;
+      memcpy(tp->sets, base_sets, sizeof(base_sets));
+      tp->sets[h][least] = (uint8_t) cand;
+      train_sort_sets(tp, freq);
+      size = train_size(strs, lens, count, tp->hcodes, tp->hcode_lens, tp->freq_seq, tp->sets);
+      if (size < best_size) {
+        best_size = size;
+        memcpy(best_sets, tp->sets, sizeof(best_sets));
+      }
+    }
+  }
+  memcpy(tp->sets, best_sets, sizeof(best_sets));
+}
+
+/// Finds hcodes, frequent sequences and sets that compress the given strings better than the fixed presets. \n
+/// The strings are sampled up to TRAIN_SAMPLE_LEN bytes. Training starts from the fixed preset \n
+/// that compresses the sample best among those that can encode all of it, and alternates between choosing \n
+/// the sequences, the hcodes and the sets while the size goes down. Returns 0 if all strings round trip \n
+/// using the trained parameters
+int train_preset(const char *all_strs[], const int all_lens[], int all_count, struct train_preset *tp) {
+  long total = 0;
+  for (int i = 0; i < all_count; i++)
+    total += all_lens[i];
+  if (total == 0)
+    return 1;
+  // every step-th string, copied with a '\0' after each for finding the candidates
+  const int step = (int) (total / TRAIN_SAMPLE_LEN + 1);
+  long text_size = 0;
+  for (int i = 0; i < all_count; i += step)
+    text_size += all_lens[i] + 1;
+  const char **strs = (const char **) malloc((all_count / step + 1) * sizeof(char *));
+  int *lens = (int *) malloc((all_count / step + 1) * sizeof(int));
+  char *text = (char *) malloc(text_size);
+  long text_len = 0;
+  int count = 0;
+  tp->bytes_in = 0;
+  for (int i = 0; i < all_count; i += step) {
+    memcpy(text + text_len, all_strs[i], all_lens[i]);
+    strs[count] = text + text_len;
+    lens[count++] = all_lens[i];
+    text_len += all_lens[i];
+    text[text_len++] = 0;
+    tp->bytes_in += all_lens[i];
+  }
+  // without the Unicode set, only printable ASCII, tab, CR and LF can be encoded
+  int can_drop_delta = 1;
+  for (int i = 0; i < all_count && can_drop_delta; i++) {
+    for (int j = 0; j < all_lens[i] && can_drop_delta; j++) {
+      const char c = all_strs[i][j];
+      can_drop_delta = ((c >= ' ' && c <= '~') || c == '\t' || c == '\r' || c == '\n');
+    }
+  }
+  // presets without the symbol or number sets are left out, as the trained one keeps them
+  struct unishox2_ctx ctx;
+  memcpy(tp->sets, USX_SETS_DFLT, sizeof(tp->sets));
+  tp->base_preset = -1;
+  for (int preset = 0; preset < UNISHOX_PRESET_COUNT; preset++) {
+    unishox2_init_preset_ctx(&ctx, preset);
+    if (!ctx.usx_hcode_lens[HCODE_ALPHA] || !ctx.usx_hcode_lens[HCODE_SYM] || !ctx.usx_hcode_lens[HCODE_NUM]
+          || (!ctx.usx_hcode_lens[HCODE_DELTA] && !can_drop_delta))
+      continue;
+    const long size = train_size(strs, lens, count, ctx.usx_hcodes, ctx.usx_hcode_lens, ctx.usx_freq_seq, USX_SETS_DFLT);
+    if (tp->base_preset < 0 || size < tp->base_bytes_out) {
+      tp->base_preset = preset;
+      tp->base_bytes_out = size;
+      memcpy(tp->hcodes, ctx.usx_hcodes, 5);
+      memcpy(tp->hcode_lens, ctx.usx_hcode_lens, 5);
+    }
+  }
+  for (int i = 0; i < 6; i++)
+    tp->freq_seq[i] = tp->seqs[i];
+  struct train_candidate cands[TRAIN_CANDIDATES];
+  const int cand_count = train_find_candidates(text, text_len, cands, TRAIN_CANDIDATES);
+  struct train_preset best = *tp;
+  best.bytes_out = -1;
+  for (int round = 0; round < TRAIN_ROUNDS; round++) {
+    train_choose_seqs(strs, lens, count, tp, cands, cand_count);
+    train_choose_hcodes(strs, lens, count, tp, can_drop_delta);
+    train_choose_sets(strs, lens, count, tp, text, text_len);
+    tp->bytes_out = train_size(strs, lens, count, tp->hcodes, tp->hcode_lens, tp->freq_seq, tp->sets);
+    if (best.bytes_out >= 0 && tp->bytes_out >= best.bytes_out)
+      break;
+    best = *tp;
+  }
+  // best still points to the sequences of tp
+  memcpy(tp->hcodes, best.hcodes, 5);
+  memcpy(tp->hcode_lens, best.hcode_lens, 5);
+  memcpy(tp->seqs, best.seqs, sizeof(tp->seqs));
+  memcpy(tp->sets, best.sets, sizeof(tp->sets));
+  tp->bytes_out = best.bytes_out;
+  unishox2_init_ctx_sets(&ctx, tp->hcodes, tp->hcode_lens, tp->freq_seq, USX_TEMPLATES, tp->sets);
+  const int ok = train_lossless(all_strs, all_lens, all_count, &ctx);
+  free(text);
+  free(lens);
+  free((void *) strs);
+  return ok ? 0 : 1;
+}
+
+int stream_chunk_end(const char *buf, int len, int at_eof);
+
 /// This is the unit-test function
 int run_unit_tests(int argc, char *argv[]) {
 
@@ -375,6 +860,446 @@ int run_unit_tests(int argc, char *argv[]) {
      }
    }
 
+   // check context api gives same output as passing the preset on each call
+   {
+     char cbuf[128];
+     char cbuf_ctx[128];
+     char dbuf[128];
+     const char *str = "Hello World 2020-12-31, https://siara.cc";
+     const int len = strlen(str);
+     struct unishox2_ctx ctx;
+     unishox2_init_ctx(&ctx, USX_PSET_DFLT);
+     const int clen = unishox2_compress(str, len, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), USX_PSET_DFLT);
+     const int clen_ctx = unishox2_compress_ctx(str, len, UNISHOX_API_OUT_AND_LEN(cbuf_ctx, sizeof cbuf_ctx), &ctx);
+     if (clen != clen_ctx || memcmp(cbuf, cbuf_ctx, clen)) {
+       printf("Fail compress (context): %d, %d\n", clen, clen_ctx);
+       return 1;
+     }
+     const int dlen = unishox2_decompress_ctx(cbuf_ctx, clen_ctx, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), &ctx);
+     if (dlen != len || strncmp(str, dbuf, len)) {
+       printf("Fail decompress (context): %d, %d\n", len, dlen);
+       return 1;
+     }
+   }
+
+   // check templates given at runtime are used by the context api
+   {
+     char cbuf[128];
+     char cbuf_dflt[128];
+     char dbuf[128];
+     const char *templates[] = {"FFFF-FFFF-FFFF", NULL, "tf:rf", NULL, NULL};
+     const char *str = "Key 1A2B-3C4D-5E6F at 23:59";
+     const int len = strlen(str);
+     struct unishox2_ctx ctx;
+     unishox2_init_ctx(&ctx, USX_HCODES_DFLT, USX_HCODE_LENS_DFLT, USX_FREQ_SEQ_DFLT, templates);
+     const int clen = unishox2_compress_ctx(str, len, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), &ctx);
+     const int clen_dflt = unishox2_compress(str, len, UNISHOX_API_OUT_AND_LEN(cbuf_dflt, sizeof cbuf_dflt), USX_PSET_DFLT);
+     if (clen >= clen_dflt) {
+       printf("Fail compress (runtime templates): %d, %d\n", clen, clen_dflt);
+       return 1;
+     }
+     const int dlen = unishox2_decompress_ctx(cbuf, clen, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), &ctx);
+     if (dlen != len || strncmp(str, dbuf, len)) {
+       printf("Fail decompress (runtime templates): %d, %d\n", len, dlen);
+       return 1;
+     }
+   }
+
+   // check frequent sequences given at runtime are used by the context api
+   {
+     char cbuf[128];
+     char cbuf_dflt[128];
+     char dbuf[128];
+     const char *freq_seq[] = {"Unishox", "\": \"", "</", "=\"", "\":\"", "://"};
+     const char *str = "I like Unishox";
+     const int len = strlen(str);
+     struct unishox2_ctx ctx;
+     unishox2_init_ctx(&ctx, USX_HCODES_DFLT, USX_HCODE_LENS_DFLT, freq_seq, USX_TEMPLATES);
+     const int clen = unishox2_compress_ctx(str, len, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), &ctx);
+     const int clen_dflt = unishox2_compress(str, len, UNISHOX_API_OUT_AND_LEN(cbuf_dflt, sizeof cbuf_dflt), USX_PSET_DFLT);
+     if (clen >= clen_dflt) {
+       printf("Fail compress (runtime freq seq): %d, %d\n", clen, clen_dflt);
+       return 1;
+     }
+     const int dlen = unishox2_decompress_ctx(cbuf, clen, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), &ctx);
+     if (dlen != len || strncmp(str, dbuf, len)) {
+       printf("Fail decompress (runtime freq seq): %d, %d\n", len, dlen);
+       return 1;
+     }
+   }
+
+   // check a template starting with a UTF-8 character is used wherever that character is found
+   {
+     char cbuf[128];
+     char cbuf_dflt[128];
+     char dbuf[128];
+     const char *templates[] = {"№ffff-ffff", NULL, NULL, NULL, NULL};
+     const char *str = "Order №1a2b-3c4d and №5e6f-7a8b";
+     const int len = strlen(str);
+     struct unishox2_ctx ctx;
+     struct unishox2_ctx ctx_dflt;
+     unishox2_init_ctx(&ctx, USX_HCODES_DFLT, USX_HCODE_LENS_DFLT, USX_FREQ_SEQ_DFLT, templates);
+     unishox2_init_ctx(&ctx_dflt, USX_PSET_DFLT);
+     const int clen = unishox2_compress_ctx(str, len, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), &ctx);
+     const int clen_dflt = unishox2_compress_ctx(str, len, UNISHOX_API_OUT_AND_LEN(cbuf_dflt, sizeof cbuf_dflt), &ctx_dflt);
+     if (clen >= clen_dflt) {
+       printf("Fail compress (runtime UTF-8 template): %d, %d\n", clen, clen_dflt);
+       return 1;
+     }
+     const int dlen = unishox2_decompress_ctx(cbuf, clen, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), &ctx);
+     if (dlen != len || strncmp(str, dbuf, len)) {
+       printf("Fail decompress (runtime UTF-8 template): %d, %d\n", len, dlen);
+       return 1;
+     }
+   }
+
+   // check frequent sequences and templates given at runtime are used even when starting with a UTF-8 character
+   {
+     char cbuf[128];
+     char cbuf_dflt[128];
+     char dbuf[128];
+     const char *freq_seq[] = {"€uro", "\": \"", "</", "=\"", "\":\"", "://"};
+     const char *templates[] = {"é€FF", NULL, NULL, NULL, NULL};
+     const char *str = "Price €uro €uro and é€AB";
+     const int len = strlen(str);
+     struct unishox2_ctx ctx;
+     unishox2_init_ctx(&ctx, USX_HCODES_DFLT, USX_HCODE_LENS_DFLT, freq_seq, templates);
+     const int clen = unishox2_compress_ctx(str, len, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), &ctx);
+     const int clen_dflt = unishox2_compress(str, len, UNISHOX_API_OUT_AND_LEN(cbuf_dflt, sizeof cbuf_dflt), USX_PSET_DFLT);
+     if (clen >= clen_dflt - 8) {
+       printf("Fail compress (runtime UTF-8 freq seq and template): %d, %d\n", clen, clen_dflt);
+       return 1;
+     }
+     const int dlen = unishox2_decompress_ctx(cbuf, clen, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), &ctx);
+     if (dlen != len || strncmp(str, dbuf, len)) {
+       printf("Fail decompress (runtime UTF-8 freq seq and template): %d, %d\n", len, dlen);
+       return 1;
+     }
+   }
+
+   // check sets given at runtime: the default sets give the same output, accented letters of USX_SETS_LATIN1
+   // are shorter, characters left out of the sets still decompress and sets changing the format are rejected
+   {
+     char cbuf[256];
+     char cbuf_dflt[256];
+     char dbuf[256];
+     const char *str = "Très élégant, où ça? À Zürich, Ärger über Straße, ¿Señor? Él está aquí.";
+     const char *strs[] = {str, "{\"key\": [1, 2]} a|b ~x `y` ^z", "ÉCOLE ÜBER À ÇA", "Ça 한국어 é😀ü\tfin\r\n", "\x01\xc3 x{é}"};
+     struct unishox2_ctx ctx;
+     if (unishox2_init_ctx_sets(&ctx, USX_PSET_DFLT, USX_SETS_DFLT) != 0) {
+       printf("Fail sets: default sets rejected\n");
+       return 1;
+     }
+     int clen = unishox2_compress_ctx(str, strlen(str), UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), &ctx);
+     const int clen_dflt = unishox2_compress(str, strlen(str), UNISHOX_API_OUT_AND_LEN(cbuf_dflt, sizeof cbuf_dflt), USX_PSET_DFLT);
+     if (clen != clen_dflt || memcmp(cbuf, cbuf_dflt, clen)) {
+       printf("Fail compress (default sets): %d, %d\n", clen, clen_dflt);
+       return 1;
+     }
+     if (unishox2_init_ctx_sets(&ctx, USX_PSET_DFLT, USX_SETS_LATIN1) != 0) {
+       printf("Fail sets: Latin-1 sets rejected\n");
+       return 1;
+     }
+     for (size_t i = 0; i < sizeof(strs) / sizeof(strs[0]); i++) {
+       const int len = strlen(strs[i]);
+       clen = unishox2_compress_ctx(strs[i], len, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), &ctx);
+       const int dlen = unishox2_decompress_ctx(cbuf, clen, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), &ctx);
+       if (dlen != len || strncmp(strs[i], dbuf, len)) {
+         printf("Fail decompress (sets): %s, %d, %d\n", strs[i], len, dlen);
+         return 1;
+       }
+       if (i == 0 && clen >= clen_dflt) {
+         printf("Fail compress (Latin-1 sets): %d, %d\n", clen, clen_dflt);
+         return 1;
+       }
+     }
+     unsigned char sets[3][28];
+     memcpy(sets, USX_SETS_DFLT, sizeof(sets));
+     sets[1][7] = '{';
+     if (unishox2_init_ctx_sets(&ctx, USX_PSET_DFLT, (const unsigned char (*)[28]) sets) != -1) {
+       printf("Fail sets: changed line feed accepted\n");
+       return 1;
+     }
+     memcpy(sets, USX_SETS_DFLT, sizeof(sets));
+     sets[0][27] = 'e';
+     if (unishox2_init_ctx_sets(&ctx, USX_PSET_DFLT, (const unsigned char (*)[28]) sets) != -1) {
+       printf("Fail sets: repeated character accepted\n");
+       return 1;
+     }
+   }
+
+   // check compression levels and optimal parsing give decodable output, higher levels being no longer
+   {
+     char cbuf[256];
+     char dbuf[256];
+     const char *str = "The quick brown fox jumps over the lazy dog and the quick brown dog jumps over the lazy fox";
+     const int len = strlen(str);
+     struct unishox2_ctx ctx;
+     unishox2_init_preset_ctx(&ctx, preset);
+     int prev_clen = INT_MAX;
+     for (int level = UNISHOX_LEVEL_FASTEST; level <= UNISHOX_LEVEL_MAX + 1; level++) {
+       // level after UNISHOX_LEVEL_MAX is for optimal parsing
+       struct unishox2_params params = {level, level > UNISHOX_LEVEL_MAX, NULL};
+       const int clen = unishox2_compress_params(str, len, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), &ctx, NULL, &params);
+       const int dlen = unishox2_decompress_ctx(cbuf, clen, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), &ctx);
+       if (clen > prev_clen || dlen != len || strncmp(str, dbuf, len)) {
+         printf("Fail compression level %d: %d, %d, %d\n", level, clen, prev_clen, dlen);
+         return 1;
+       }
+       prev_clen = clen;
+     }
+   }
+
+   // check low levels still find the repeats of strings too short for the match index
+   {
+     char cbuf[128];
+     const char *str = "abcdefgh12 ijklmn abcdefgh12 xyz abcdefgh12";
+     const int len = strlen(str);
+     struct unishox2_ctx ctx;
+     struct unishox2_params params = {UNISHOX_LEVEL_FASTEST + 1, 0, NULL};
+     unishox2_init_preset_ctx(&ctx, preset);
+     const int clen = unishox2_compress_params(str, len, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), &ctx, NULL, &params);
+     const int clen_dflt = unishox2_compress_ctx(str, len, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), &ctx);
+     if (ctx.usx_hcode_lens[HCODE_DICT] && clen != clen_dflt) {
+       printf("Fail short string level: %d, %d\n", clen, clen_dflt);
+       return 1;
+     }
+   }
+
+#if UNISHOX_STATS
+   // check the statistics add up to the output and count the UUID
+   {
+     char cbuf[256];
+     const char *str = "4d6f2c5e-9a3b-4c1d-8e7f-0a1b2c3d4e5f SENT TO Zoë on 2020-05-12";
+     const int len = strlen(str);
+     struct unishox2_ctx ctx;
+     struct unishox2_stats stats;
+     memset(&stats, 0, sizeof(stats));
+     struct unishox2_params params = {0, 0, &stats};
+     unishox2_init_preset_ctx(&ctx, preset);
+     const int clen = unishox2_compress_params(str, len, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), &ctx, NULL, &params);
+     unishox2_compressed_size(str, len, &ctx, NULL);
+     unsigned long path_bits = 0;
+     for (int i = 0; i < USX_STAT_COUNT; i++)
+       path_bits += stats.bits[i];
+     // numbers set is needed for UUIDs
+     if (stats.calls != 1 || stats.bytes_in != (unsigned long) len || stats.bits_out != (unsigned long) clen * 8
+           || path_bits + UNISHOX_MAGIC_BIT_LEN > stats.bits_out || stats.switch_bits > path_bits
+           || (ctx.usx_hcode_lens[2] && stats.hits[USX_STAT_UUID] != 1)) {
+       printf("Fail stats: %lu, %lu, %lu, %lu, %lu\n", stats.calls, stats.bytes_in, stats.bits_out, path_bits, stats.hits[USX_STAT_UUID]);
+       return 1;
+     }
+   }
+#endif
+
+   {
+     char cbuf[128];
+     const char *str = "Hello World Hello World";
+     const int len = strlen(str);
+     struct unishox2_ctx ctx;
+     unishox2_init_preset_ctx(&ctx, preset);
+     const int clen = unishox2_compress_ctx(str, len, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), &ctx);
+     size_t alloc_sizes[2] = {0, 0};
+     int dlen = 0;
+     char *dbuf = unishox2_decompress_alloc(cbuf, clen, &ctx, test_alloc, alloc_sizes, &dlen);
+     if (dbuf == NULL || alloc_sizes[0] != 1 || alloc_sizes[1] != (size_t) len + 1 || dlen != len || strcmp(str, dbuf)) {
+       printf("Fail decompress alloc: %d, %d\n", len, dlen);
+       return 1;
+     }
+     free(dbuf);
+   }
+
+   // check stream chunks are not cut inside a UTF-8 character, not looking at the byte after the chunk
+   {
+     char buf[16];
+     memcpy(buf, "a\xC3\xA9\xC3\xA9\xE2\x82\xACxx", 11);
+     const int lens[] = {3, 4, 5, 6, 7, 8};
+     const int ends[] = {3, 3, 5, 5, 5, 8};
+     for (int i = 0; i < 6; i++) {
+       const char next = buf[lens[i]];
+       buf[lens[i]] = 'x'; // not read yet, so not to be looked at
+       const int end = stream_chunk_end(buf, lens[i], 0);
+       buf[lens[i]] = next;
+       if (end != ends[i]) {
+         printf("Fail stream chunk end: %d, %d, %d\n", lens[i], end, ends[i]);
+         return 1;
+       }
+     }
+   }
+
+   // check the preset chosen automatically can encode the input and is recorded for decompression,
+   // strings shorter than 8 bytes always using preset 0
+   {
+     char cbuf[256];
+     char dbuf[256];
+     const char *strs[] = {"", "Hello World", "HELLO world 1234, 5678", "{\"name\": \"Zoë\", \"tags\": [\"a\", \"b\"]}",
+                           "<a href=\"https://example.com\">Link</a>\r\n", "Beauty is not in the face. Beauty is a light in the heart.",
+                           "美は顔にありません。", "Hello\x80\x83\xAE\xBC\xBD\xBE", "1234567", "A+B=C;"};
+     for (int i = 0; i < (int) (sizeof strs / sizeof strs[0]); i++) {
+       const int len = strlen(strs[i]);
+       const int clen = unishox2_compress_auto(strs[i], len, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf));
+       const int dlen = unishox2_decompress_auto(cbuf, clen, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf));
+       if (clen < 1 || clen > (int) sizeof cbuf || cbuf[0] != (len < 8 ? 0 : unishox2_select_preset(strs[i], len))
+             || dlen != len || strncmp(strs[i], dbuf, len)) {
+         printf("Fail auto preset: %s, %d, %d\n", strs[i], clen, dlen);
+         return 1;
+       }
+     }
+     cbuf[0] = UNISHOX_PRESET_COUNT;
+     if (unishox2_decompress_auto(cbuf, 1, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf)) != -1) {
+       printf("Fail auto preset: invalid preset accepted\n");
+       return 1;
+     }
+   }
+
+   // check a preset trained on product codes round trips them and compresses them no worse than the fixed presets
+   {
+     static const char *colors[] = {"BLK", "WHT", "RED", "NVY", "GRY"};
+     static const char *sizes[] = {"XS", "S", "M", "L", "XL"};
+     char arena[100][48];
+     const char *strs[100];
+     int lens[100];
+     struct train_preset tp;
+     for (int i = 0; i < 100; i++) {
+       lens[i] = sprintf(arena[i], "SKU-%05d-%s-%s Cotton T-Shirt", 10000 + i * 37, colors[i % 5], sizes[i / 5 % 5]);
+       strs[i] = arena[i];
+     }
+     if (train_preset(strs, lens, 100, &tp) || tp.bytes_out > tp.base_bytes_out || tp.hcode_lens[HCODE_DELTA]) {
+       printf("Fail train preset: %ld, %ld\n", tp.bytes_out, tp.base_bytes_out);
+       return 1;
+     }
+   }
+
+   // check batch api round trip and offsets
+   {
+     char cbuf[256];
+     char dbuf[256];
+     const char *strs[] = {"Hello", "", "Hello World", "HELLO WORLD HELLO WORLD"};
+     int lens[4];
+     int coffsets[5];
+     int doffsets[5];
+     struct unishox2_ctx ctx;
+     unishox2_init_preset_ctx(&ctx, preset);
+     for (int i = 0; i < 4; i++)
+       lens[i] = strlen(strs[i]);
+     const int clen = unishox2_compress_batch(strs, lens, 4, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), coffsets, &ctx);
+     const int dlen = unishox2_decompress_batch(cbuf, coffsets, 4, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), doffsets, &ctx);
+     if (coffsets[4] != clen || doffsets[4] != dlen) {
+       printf("Fail batch offsets: %d, %d\n", clen, dlen);
+       return 1;
+     }
+     for (int i = 0; i < 4; i++) {
+       if (doffsets[i + 1] - doffsets[i] != lens[i] || strncmp(strs[i], dbuf + doffsets[i], lens[i])) {
+         printf("Fail batch: %s\n", strs[i]);
+         return 1;
+       }
+     }
+#if UNISHOX_BATCH_THREADS
+     char cbuf_mt[256];
+     int coffsets_mt[5];
+     const int clen_mt = unishox2_compress_batch_mt(strs, lens, 4, UNISHOX_API_OUT_AND_LEN(cbuf_mt, sizeof cbuf_mt), coffsets_mt, &ctx, 3);
+     if (clen_mt != clen || memcmp(cbuf, cbuf_mt, clen) || memcmp(coffsets, coffsets_mt, sizeof coffsets)) {
+       printf("Fail batch (threads): %d, %d\n", clen, clen_mt);
+       return 1;
+     }
+     const int dlen_mt = unishox2_decompress_batch_mt(cbuf_mt, coffsets_mt, 4, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), doffsets, &ctx, 3);
+     if (dlen_mt != dlen || strncmp(strs[3], dbuf + doffsets[3], lens[3])) {
+       printf("Fail batch (threads): %d, %d\n", dlen, dlen_mt);
+       return 1;
+     }
+#endif
+   }
+
+   // check the match index and bitmaps reused over a batch of longer strings give the same output as compressing each
+   {
+     char cbuf[1024];
+     char cbuf_one[256];
+     int coffsets[5];
+     const char *strs[] = {"Repeat after me: the rain in Spain stays mainly in the plain, the rain in Spain stays mainly in the plain",
+       "0x1F2E3D4C5B6A7988 and 0xA1B2C3D4E5F60718 are not the same as 0x1F2E3D4C5B6A7988 or 0xa1b2c3d4e5f60718",
+       "Short one",
+       "The quick brown fox jumps over the lazy dog, then the quick brown fox jumps over the lazy dog again"};
+     int lens[4];
+     struct unishox2_ctx ctx;
+     unishox2_init_preset_ctx(&ctx, preset);
+     for (int i = 0; i < 4; i++)
+       lens[i] = strlen(strs[i]);
+     const int clen = unishox2_compress_batch(strs, lens, 4, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), coffsets, &ctx);
+     for (int i = 0; i < 4 && clen <= (int) sizeof cbuf; i++) {
+       const int clen_one = unishox2_compress_ctx(strs[i], lens[i], UNISHOX_API_OUT_AND_LEN(cbuf_one, sizeof cbuf_one), &ctx);
+       if (coffsets[i + 1] - coffsets[i] != clen_one || memcmp(cbuf + coffsets[i], cbuf_one, clen_one)) {
+         printf("Fail batch of longer strings: %s\n", strs[i]);
+         return 1;
+       }
+     }
+   }
+
+   // check line index gives same output as the linked list of previous lines
+   {
+     char cbuf[128];
+     char cbuf_idx[128];
+     char dbuf[128];
+     const char *strs[] = {"The quick brown fox", "jumped over the lazy dog", "The lazy dog jumped over the brown fox", "quick brown dog jumped"};
+     struct us_lnk_lst lines[4];
+     struct unishox2_ctx ctx;
+     struct unishox2_line_index idx;
+     unishox2_init_preset_ctx(&ctx, preset);
+     if (!unishox2_init_line_index(&idx)) {
+       printf("Fail line index init\n");
+       return 1;
+     }
+     for (int i = 0; i < 4; i++) {
+       const int len = strlen(strs[i]);
+       lines[i].data = (char *) strs[i];
+       lines[i].previous = (i ? &lines[i - 1] : NULL);
+       const int clen = unishox2_compress_preset_lines(strs[i], len, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), preset, &lines[i]);
+       const int clen_idx = unishox2_compress_lines_with_index(strs[i], len, UNISHOX_API_OUT_AND_LEN(cbuf_idx, sizeof cbuf_idx), &ctx, &idx);
+       if (clen != clen_idx || memcmp(cbuf, cbuf_idx, clen)) {
+         printf("Fail compress (line index): %s\n", strs[i]);
+         return 1;
+       }
+       const int dlen = unishox2_decompress_preset_lines(cbuf_idx, clen_idx, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), preset, &lines[i]);
+       if (dlen != len || strncmp(strs[i], dbuf, len)) {
+         printf("Fail decompress (line index): %s\n", strs[i]);
+         return 1;
+       }
+       unishox2_line_index_add(&idx, strs[i], len);
+     }
+     unishox2_free_line_index(&idx);
+   }
+
+   // check string table lookup of each line
+   {
+     char dbuf[128];
+     const char *strs[] = {"Hello", "Hello World", "", "HELLO WORLD HELLO WORLD"};
+     int lens[4];
+     char *table;
+     struct unishox2_table t;
+     struct unishox2_ctx ctx;
+     unishox2_init_preset_ctx(&ctx, preset);
+     for (int i = 0; i < 4; i++)
+       lens[i] = strlen(strs[i]);
+     const int table_len = build_string_table(strs, lens, 4, preset, &table);
+     if (!unishox2_table_open(&t, table, table_len) || t.line_count != 4 || t.max_len != lens[3]
+           || unishox2_table_open(&t, table, table_len - 1)) {
+       printf("Fail string table open\n");
+       return 1;
+     }
+     unishox2_table_open(&t, table, table_len);
+     for (int i = 3; i >= 0; i--) {
+       const int dlen = unishox2_table_get(&t, i, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), &ctx);
+       if (dlen != lens[i] || strncmp(strs[i], dbuf, dlen)) {
+         printf("Fail string table line %d\n", i);
+         return 1;
+       }
+     }
+     if (unishox2_table_get(&t, 4, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), &ctx) != -1) {
+       printf("Fail string table out of range\n");
+       return 1;
+     }
+     free(table);
+   }
+
     // Basic
     if (!test_ushx_cd("Hello", preset)) return 1;
     if (!test_ushx_cd("Hello World", preset)) return 1;
@@ -406,6 +1331,7 @@ int run_unit_tests(int argc, char *argv[]) {
     if (preset != 1 && preset != 2 && !test_ushx_cd("-----------------Hello World1111111111112222222abcdef12345abcde1234_////////Hello World///////", preset)) return 1;
     if (preset != 1 && !test_ushx_cd("-----------------///////////////", preset)) return 1;
     if (preset != 1 && !test_ushx_cd("------------------------------------", preset)) return 1;
+    if (preset != 1 && !test_ushx_cd("The quick brown fox jumped over the lazy dog. The quick brown fox jumped over the lazy cat. The lazy dog and the lazy cat.", preset)) return 1;
 
     // Nibbles
     if (preset != 1 && !test_ushx_cd("fa01b51e-7ecc-4e3e-be7b-918a4c2c891c", preset)) return 1;
@@ -612,6 +1538,1067 @@ int run_unit_tests(int argc, char *argv[]) {
     return 0;
 }
 
+/// Reads non-empty lines of the given file into an arena. \n
+/// Returns the number of lines read, or -1 if the file could not be read
+int read_lines(const char *file_name, char **arena_p, const char ***lines_p, int **lens_p) {
+  FILE *fp = fopen(file_name, "r");
+  if (fp == NULL) {
+    perror(file_name);
+    return -1;
+  }
+  fseek(fp, 0, SEEK_END);
+  long file_len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *arena = (char *) malloc(file_len + 1);
+  const char **lines = (const char **) malloc((file_len + 1) * sizeof(char *));
+  int *lens = (int *) malloc((file_len + 1) * sizeof(int));
+  int line_count = 0;
+  long pos = 0;
+  while (pos < file_len && fgets(arena + pos, file_len + 1 - pos, fp) != NULL) {
+    int len = (int)strlen(arena + pos);
+    while (len > 0 && (arena[pos + len - 1] == '\n' || arena[pos + len - 1] == '\r'))
+      len--;
+    arena[pos + len] = '\0';
+    if (len > 0 && !is_empty(arena + pos)) {
+      lines[line_count] = arena + pos;
+      lens[line_count++] = len;
+    }
+    pos += len + 1;
+  }
+  fclose(fp);
+  *arena_p = arena;
+  *lines_p = lines;
+  *lens_p = lens;
+  return line_count;
+}
+
+/// Compares time taken to compress and decompress each line of the given file \n
+/// using one unishox2_compress_ctx() / unishox2_decompress_ctx() call per line against the batch API
+int run_batch_bench(const char *file_name, int preset) {
+  char *arena;
+  const char **lines;
+  int *lens;
+  int line_count = read_lines(file_name, &arena, &lines, &lens);
+  if (line_count <= 0)
+    return 1;
+  int tot_len = 0;
+  for (int i = 0; i < line_count; i++)
+    tot_len += lens[i];
+  const int cbuf_len = tot_len * 2 + line_count * 8;
+  char *cbuf = (char *) malloc(cbuf_len);
+  char *cbuf_batch = (char *) malloc(cbuf_len);
+  char *dbuf = (char *) malloc(tot_len + 1);
+  int *coffsets = (int *) malloc((line_count + 1) * sizeof(int));
+  int *doffsets = (int *) malloc((line_count + 1) * sizeof(int));
+  const int rounds = 20;
+  struct unishox2_ctx ctx;
+  unishox2_init_preset_ctx(&ctx, preset);
+
+  int clen = 0;
+  uint32_t t0 = getTimeVal();
+  for (int r = 0; r < rounds; r++) {
+    clen = 0;
+    for (int i = 0; i < line_count; i++)
+      clen += unishox2_compress_ctx(lines[i], lens[i], UNISHOX_API_OUT_AND_LEN(cbuf + clen, cbuf_len - clen), &ctx);
+  }
+  double t_single = timedifference(t0, getTimeVal());
+  int clen_batch = 0;
+  t0 = getTimeVal();
+  for (int r = 0; r < rounds; r++)
+    clen_batch = unishox2_compress_batch(lines, lens, line_count, UNISHOX_API_OUT_AND_LEN(cbuf_batch, cbuf_len), coffsets, &ctx);
+  double t_batch = timedifference(t0, getTimeVal());
+  if (clen != clen_batch || memcmp(cbuf, cbuf_batch, clen)) {
+    printf("Fail: batch compressed output differs: %d, %d\n", clen, clen_batch);
+    return 1;
+  }
+  printf("Lines: %d, Bytes (Compressed/Original): %d/%d\n", line_count, clen, tot_len);
+  printf("Compress:   %8.1f ns/string (single), %8.1f ns/string (batch)\n",
+    t_single * 1000000 / rounds / line_count, t_batch * 1000000 / rounds / line_count);
+
+  int dlen = 0;
+  t0 = getTimeVal();
+  for (int r = 0; r < rounds; r++) {
+    dlen = 0;
+    for (int i = 0; i < line_count; i++)
+      dlen += unishox2_decompress_ctx(cbuf + coffsets[i], coffsets[i + 1] - coffsets[i], UNISHOX_API_OUT_AND_LEN(dbuf + dlen, tot_len + 1 - dlen), &ctx);
+  }
+  t_single = timedifference(t0, getTimeVal());
+  int dlen_batch = 0;
+  t0 = getTimeVal();
+  for (int r = 0; r < rounds; r++)
+    dlen_batch = unishox2_decompress_batch(cbuf_batch, coffsets, line_count, UNISHOX_API_OUT_AND_LEN(dbuf, tot_len + 1), doffsets, &ctx);
+  t_batch = timedifference(t0, getTimeVal());
+  for (int i = 0; i < line_count; i++) {
+    if (dlen != dlen_batch || doffsets[i + 1] - doffsets[i] != lens[i] || memcmp(dbuf + doffsets[i], lines[i], lens[i])) {
+      printf("Fail: batch decompressed output differs at line %d\n", i);
+      return 1;
+    }
+  }
+  printf("Decompress: %8.1f ns/string (single), %8.1f ns/string (batch)\n",
+    t_single * 1000000 / rounds / line_count, t_batch * 1000000 / rounds / line_count);
+
+  free(doffsets);
+  free(coffsets);
+  free(dbuf);
+  free(cbuf_batch);
+  free(cbuf);
+  free(lens);
+  free((void *) lines);
+  free(arena);
+  return 0;
+}
+
+/// Compresses the given file chunk_size bytes at a time at compression levels UNISHOX_LEVEL_FASTEST, \n
+/// UNISHOX_LEVEL_DEFAULT, UNISHOX_LEVEL_MAX and with optimal parsing, printing the ratio and speed of each. \n
+/// Fails if any output does not decompress to its chunk or if a higher level gives longer output
+int run_level_test(const char *file_name, int preset, int chunk_size) {
+  FILE *fp = fopen(file_name, "rb");
+  if (fp == NULL) {
+    perror(file_name);
+    return 1;
+  }
+  fseek(fp, 0, SEEK_END);
+  long file_len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *in = (char *) malloc(file_len + 1);
+  if (fread(in, 1, file_len, fp) != (size_t) file_len) {
+    perror(file_name);
+    fclose(fp);
+    free(in);
+    return 1;
+  }
+  fclose(fp);
+  char *cbuf = (char *) malloc(chunk_size * 2 + 16);
+  char *dbuf = (char *) malloc(chunk_size + 1);
+  struct unishox2_ctx ctx;
+  unishox2_init_preset_ctx(&ctx, preset);
+  const int levels[] = {UNISHOX_LEVEL_FASTEST, UNISHOX_LEVEL_DEFAULT, UNISHOX_LEVEL_MAX, UNISHOX_LEVEL_MAX};
+  const char *level_names[] = {"Level 1", "Level 6", "Level 9", "Optimal"};
+  long prev_ctot = 0;
+  int ret = 0;
+  for (int i = 0; i < 4 && ret == 0; i++) {
+    struct unishox2_params params = {levels[i], i == 3, NULL};
+    long ctot = 0;
+    double t_compress = 0;
+    for (long pos = 0; pos < file_len; pos += chunk_size) {
+      const int len = (int) (file_len - pos < chunk_size ? file_len - pos : chunk_size);
+      uint32_t t0 = getTimeVal();
+      const int clen = unishox2_compress_params(in + pos, len, UNISHOX_API_OUT_AND_LEN(cbuf, chunk_size * 2 + 16), &ctx, NULL, &params);
+      t_compress += timedifference(t0, getTimeVal());
+      const int dlen = unishox2_decompress_ctx(cbuf, clen, UNISHOX_API_OUT_AND_LEN(dbuf, chunk_size + 1), &ctx);
+      if (dlen != len || memcmp(in + pos, dbuf, len)) {
+        printf("Fail: %s output does not decompress at %ld\n", level_names[i], pos);
+        ret = 1;
+        break;
+      }
+      ctot += clen;
+    }
+    printf("%s: Bytes (Compressed/Original=Savings%%): %ld/%ld=%.2f%%, %.1f MB/s\n", level_names[i], ctot, file_len,
+      (float) (file_len - ctot) * 100 / file_len, t_compress > 0 ? file_len / t_compress / 1000 : 0);
+    if (i && ctot > prev_ctot) {
+      printf("Fail: %s gives longer output than %s\n", level_names[i], level_names[i - 1]);
+      ret = 1;
+    }
+    prev_ctot = ctot;
+  }
+  free(dbuf);
+  free(cbuf);
+  free(in);
+  return ret;
+}
+
+#if UNISHOX_STATS
+/// Compresses each line of the given file and prints how often each encoder path was taken \n
+/// and the bits it produced, to find out which paths a preset should favour
+int run_stats(const char *file_name, int preset) {
+  static const char *path_names[USX_STAT_COUNT] = {"Literal", "Dictionary", "Repeat", "UUID", "Hex",
+    "Template", "Freq seq", "Upper run", "Unicode", "Binary"};
+  char *arena;
+  const char **lines;
+  int *lens;
+  int line_count = read_lines(file_name, &arena, &lines, &lens);
+  if (line_count < 0)
+    return 1;
+  int max_len = 0;
+  for (int i = 0; i < line_count; i++) {
+    if (max_len < lens[i])
+      max_len = lens[i];
+  }
+  const int cbuf_len = max_len * 2 + 16;
+  char *cbuf = (char *) malloc(cbuf_len);
+  struct unishox2_ctx ctx;
+  struct unishox2_stats stats;
+  memset(&stats, 0, sizeof(stats));
+  struct unishox2_params params = {0, 0, &stats};
+  unishox2_init_preset_ctx(&ctx, preset);
+  for (int i = 0; i < line_count; i++)
+    unishox2_compress_params(lines[i], lens[i], UNISHOX_API_OUT_AND_LEN(cbuf, cbuf_len), &ctx, NULL, &params);
+  printf("Lines: %lu, Bytes (Compressed/Original): %lu/%lu, Bits per byte: %.3f\n", stats.calls,
+    (stats.bits_out + 7) / 8, stats.bytes_in, stats.bytes_in ? (double) stats.bits_out / stats.bytes_in : 0);
+  printf("Path             Hits          Bits   Bits%%  Bits/hit\n");
+  for (int i = 0; i < USX_STAT_COUNT; i++) {
+    printf("%-10s %10lu %13lu %7.2f %9.2f\n", path_names[i], stats.hits[i], stats.bits[i],
+      stats.bits_out ? (double) stats.bits[i] * 100 / stats.bits_out : 0, stats.hits[i] ? (double) stats.bits[i] / stats.hits[i] : 0);
+  }
+  printf("%-10s %10lu %13lu %7.2f %9.2f\n", "Switches", stats.switches, stats.switch_bits,
+    stats.bits_out ? (double) stats.switch_bits * 100 / stats.bits_out : 0, stats.switches ? (double) stats.switch_bits / stats.switches : 0);
+  free(cbuf);
+  free(lens);
+  free((void *) lines);
+  free(arena);
+  return 0;
+}
+#endif
+
+/**
+ * Stream format written by -c and read by -d:
+ *
+ *   header: magic "USX2", format version, preset number, flags, varint maximum chunk length
+ *           (preset number USX_STREAM_PRESET_AUTO means each chunk starts with its own preset byte,
+ *           as written by unishox2_compress_auto())
+ *   chunks: varint compressed length followed by the compressed chunk, repeated
+ *   end:    varint 0
+ *   index:  only if flags has USX_STREAM_FLAG_INDEX - varint chunk count, varint compressed
+ *           and original length of each chunk, then the 8 byte little endian file offset
+ *           of the index followed by "USXI", so that it can be found from the end of the file
+ *
+ * Chunks end at a line boundary, or failing that, at a UTF-8 character boundary
+ * so that each chunk can be decompressed on its own.
+ */
+#define USX_STREAM_MAGIC "USX2"
+#define USX_STREAM_INDEX_MAGIC "USXI"
+#define USX_STREAM_VERSION 1
+#define USX_STREAM_FLAG_INDEX 1
+#define USX_STREAM_DEFAULT_CHUNK 4096
+/// Unishox is meant for short strings and long chunks do not compress any better
+#define USX_STREAM_MAX_CHUNK 65536
+#define USX_STREAM_HEADER_LEN 7
+#define USX_STREAM_PRESET_AUTO 255
+
+/// Opens given file, or stdin / stdout if name is "-"
+FILE *open_file(const char *name, const char *mode) {
+  if (strcmp(name, "-") == 0) {
+    FILE *fp = (mode[0] == 'r' ? stdin : stdout);
+#ifdef _MSC_VER
+    _setmode(_fileno(fp), _O_BINARY);
+#endif
+    return fp;
+  }
+  FILE *fp = fopen(name, mode);
+  if (fp == NULL)
+    perror(name);
+  return fp;
+}
+
+/// Writes value as varint. Returns number of bytes written or 0 if it could not be written
+int write_varint(FILE *wfp, uint64_t value) {
+  uint8_t buf[10];
+  int len = encode_unsigned_varint(buf, value);
+  return (int)fwrite(buf, 1, len, wfp) == len ? len : 0;
+}
+
+/// Returns the number of bytes value takes as varint
+int write_varint_len(uint64_t value) {
+  int len = 1;
+  while (value >>= 7)
+    len++;
+  return len;
+}
+
+/// Reads a varint into value. Returns number of bytes read or 0 at end of file or if invalid
+int read_varint(FILE *fp, uint64_t *value) {
+  uint8_t buf[10];
+  int len = 0;
+  int c;
+  do {
+    if (len == sizeof(buf) || (c = fgetc(fp)) == EOF)
+      return 0;
+    buf[len++] = (uint8_t) c;
+  } while (c & 0x80);
+  *value = decode_unsigned_varint(buf, &len);
+  return len;
+}
+
+/// Returns where the chunk at the beginning of buf ends, given len bytes are available \n
+/// and more would follow unless at_eof is set
+int stream_chunk_end(const char *buf, int len, int at_eof) {
+  if (at_eof)
+    return len;
+  // last line ending, if it leaves the chunk at least half full
+  for (int i = len - 1; i >= len / 2; i--) {
+    if (buf[i] == '\n')
+      return i + 1;
+  }
+  // beginning of the last UTF-8 character if it is not whole, so that it goes to the next chunk whole
+  int lead = len - 1;
+  while (lead > 0 && lead > len - 4 && (((unsigned char) buf[lead]) >> 6) == 2)
+    lead--;
+  const unsigned char c = (unsigned char) buf[lead];
+  const int char_len = (c >= 0xF0 ? 4 : (c >= 0xE0 ? 3 : (c >= 0xC0 ? 2 : 1)));
+  return (lead > 0 && lead + char_len > len) ? lead : len;
+}
+
+/// Compresses fp to wfp in the stream format, chunk_size bytes at a time. \n
+/// Returns 0 if successful and adds original and compressed length to in_total and out_total
+int stream_compress(FILE *fp, FILE *wfp, int preset, int chunk_size, int with_index, long *in_total, long *out_total) {
+  const int cbuf_len = chunk_size * 2 + 64;
+  char *buf = (char *) malloc(chunk_size + 1);
+  char *cbuf = (char *) malloc(cbuf_len);
+  uint64_t *index = NULL;
+  int chunk_count = 0;
+  int index_cap = 0;
+  long ol = 0;
+  struct unishox2_ctx ctx;
+  unishox2_init_preset_ctx(&ctx, preset);
+  const int is_auto = (preset == USX_STREAM_PRESET_AUTO);
+  const uint8_t header[] = {USX_STREAM_MAGIC[0], USX_STREAM_MAGIC[1], USX_STREAM_MAGIC[2], USX_STREAM_MAGIC[3],
+                            USX_STREAM_VERSION, (uint8_t) preset, with_index ? USX_STREAM_FLAG_INDEX : 0};
+  if (fwrite(header, 1, USX_STREAM_HEADER_LEN, wfp) != USX_STREAM_HEADER_LEN)
+    return 1;
+  ol = USX_STREAM_HEADER_LEN + write_varint(wfp, chunk_size);
+  int avail = 0;
+  int at_eof = 0;
+  while (!at_eof || avail > 0) {
+    if (!at_eof) {
+      const int bytes_read = (int)fread(buf + avail, 1, chunk_size - avail, fp);
+      avail += bytes_read;
+      if (avail < chunk_size)
+        at_eof = 1;
+    }
+    if (avail == 0)
+      break;
+    const int len = stream_chunk_end(buf, avail, at_eof);
+    const int clen = is_auto ? unishox2_compress_auto(buf, len, UNISHOX_API_OUT_AND_LEN(cbuf, cbuf_len))
+                             : unishox2_compress_ctx(buf, len, UNISHOX_API_OUT_AND_LEN(cbuf, cbuf_len), &ctx);
+    if (clen <= 0 || clen > cbuf_len) {
+      fprintf(stderr, "Could not compress chunk %d\n", chunk_count);
+      return 1;
+    }
+    const int len_len = write_varint(wfp, clen);
+    if (len_len == 0 || clen != (int)fwrite(cbuf, 1, clen, wfp)) {
+      perror("fwrite");
+      return 1;
+    }
+    if (with_index) {
+      if (chunk_count * 2 + 2 > index_cap) {
+        index_cap = (index_cap ? index_cap * 2 : 256);
+        index = (uint64_t *) realloc(index, index_cap * sizeof(uint64_t));
+      }
+      index[chunk_count * 2] = clen;
+      index[chunk_count * 2 + 1] = len;
+    }
+    chunk_count++;
+    ol += len_len + clen;
+    *in_total += len;
+    memmove(buf, buf + len, avail - len);
+    avail -= len;
+  }
+  ol += write_varint(wfp, 0);
+  if (with_index) {
+    const long index_pos = ol;
+    ol += write_varint(wfp, chunk_count);
+    for (int i = 0; i < chunk_count * 2; i++)
+      ol += write_varint(wfp, index[i]);
+    uint8_t footer[12];
+    for (int i = 0; i < 8; i++)
+      footer[i] = (uint8_t) ((uint64_t) index_pos >> (i * 8));
+    memcpy(footer + 8, USX_STREAM_INDEX_MAGIC, 4);
+    if (fwrite(footer, 1, sizeof(footer), wfp) != sizeof(footer))
+      return 1;
+    ol += sizeof(footer);
+  }
+  *out_total += ol;
+  free(index);
+  free(cbuf);
+  free(buf);
+  return 0;
+}
+
+/// Decompresses fp written by earlier versions of -c, \n
+/// as 4096 byte chunks each preceded by 2 byte big endian length
+int stream_decompress_legacy(FILE *fp, FILE *wfp, int len_to_read, int preset) {
+  char cbuf[8192];
+  char dbuf[USX_STREAM_DEFAULT_CHUNK + 1];
+  struct unishox2_ctx ctx;
+  unishox2_init_preset_ctx(&ctx, preset);
+  while (len_to_read > 0) {
+    if (len_to_read > (int)sizeof(cbuf) || (int)fread(cbuf, 1, len_to_read, fp) != len_to_read) {
+      fprintf(stderr, "Invalid compressed file\n");
+      return 1;
+    }
+    const int dlen = unishox2_decompress_ctx(cbuf, len_to_read, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), &ctx);
+    if (dlen > 0 && dlen != (int)fwrite(dbuf, 1, dlen, wfp)) {
+      perror("fwrite");
+      return 1;
+    }
+    const int b0 = fgetc(fp);
+    const int b1 = fgetc(fp);
+    if (b0 == EOF || b1 == EOF)
+      break;
+    len_to_read = (b0 << 8) + b1;
+  }
+  return 0;
+}
+
+/// Reads and checks the rest of the stream header after the first 2 bytes. \n
+/// Returns the maximum chunk length, or -1 if invalid
+int stream_read_header(FILE *fp, const uint8_t first2[2], int *preset, int *flags, int *header_len) {
+  uint8_t header[USX_STREAM_HEADER_LEN];
+  uint64_t chunk_size;
+  memcpy(header, first2, 2);
+  if (fread(header + 2, 1, USX_STREAM_HEADER_LEN - 2, fp) != USX_STREAM_HEADER_LEN - 2
+      || memcmp(header, USX_STREAM_MAGIC, 4) != 0 || header[4] != USX_STREAM_VERSION
+      || (header[5] >= UNISHOX_PRESET_COUNT && header[5] != USX_STREAM_PRESET_AUTO)) {
+    fprintf(stderr, "Not a Unishox2 stream or unsupported version\n");
+    return -1;
+  }
+  *preset = header[5];
+  *flags = header[6];
+  const int len_len = read_varint(fp, &chunk_size);
+  if (len_len == 0 || chunk_size == 0 || chunk_size > USX_STREAM_MAX_CHUNK) {
+    fprintf(stderr, "Invalid chunk size\n");
+    return -1;
+  }
+  *header_len = USX_STREAM_HEADER_LEN + len_len;
+  return (int) chunk_size;
+}
+
+/// Decompresses a chunk of clen bytes from fp to wfp, using the preset byte of the chunk if ctx is NULL
+int stream_decompress_chunk(FILE *fp, FILE *wfp, int clen, char *cbuf, int cbuf_len, char *dbuf, int dbuf_len, const struct unishox2_ctx *ctx) {
+  if (clen > cbuf_len || (int)fread(cbuf, 1, clen, fp) != clen) {
+    fprintf(stderr, "Invalid chunk\n");
+    return 1;
+  }
+  const int dlen = ctx == NULL ? unishox2_decompress_auto(cbuf, clen, UNISHOX_API_OUT_AND_LEN(dbuf, dbuf_len))
+                               : unishox2_decompress_ctx(cbuf, clen, UNISHOX_API_OUT_AND_LEN(dbuf, dbuf_len), ctx);
+  if (dlen < 0 || dlen > dbuf_len) {
+    fprintf(stderr, "Invalid chunk\n");
+    return 1;
+  }
+  if (dlen > 0 && dlen != (int)fwrite(dbuf, 1, dlen, wfp)) {
+    perror("fwrite");
+    return 1;
+  }
+  return 0;
+}
+
+/// Decompresses fp to wfp. If chunk_no is not negative, only that chunk is \n
+/// decompressed using the trailing index, for which fp needs to be seekable. \n
+/// legacy_preset is used for files written by earlier versions, which do not have the preset.
+int stream_decompress(FILE *fp, FILE *wfp, int legacy_preset, long chunk_no) {
+  int preset, flags = 0, header_len;
+  uint8_t first2[2];
+  if (fread(first2, 1, 2, fp) != 2)
+    return 0;
+  // length of the first chunk in the earlier format cannot be as much as "US"
+  if (first2[0] != USX_STREAM_MAGIC[0] || first2[1] != USX_STREAM_MAGIC[1]) {
+    if (chunk_no >= 0) {
+      fprintf(stderr, "No chunk index\n");
+      return 1;
+    }
+    return stream_decompress_legacy(fp, wfp, (first2[0] << 8) + first2[1], legacy_preset);
+  }
+  const int chunk_size = stream_read_header(fp, first2, &preset, &flags, &header_len);
+  if (chunk_size < 0)
+    return 1;
+  const int cbuf_len = chunk_size * 2 + 64;
+  char *cbuf = (char *) malloc(cbuf_len);
+  char *dbuf = (char *) malloc(chunk_size + 1);
+  struct unishox2_ctx ctx;
+  unishox2_init_preset_ctx(&ctx, preset);
+  const struct unishox2_ctx *chunk_ctx = (preset == USX_STREAM_PRESET_AUTO ? NULL : &ctx);
+  int ret = 0;
+  if (chunk_no < 0) {
+    uint64_t clen;
+    while (ret == 0) {
+      if (read_varint(fp, &clen) == 0) {
+        fprintf(stderr, "Unexpected end of file\n");
+        ret = 1;
+      } else if (clen == 0)
+        break;
+      else
+        ret = stream_decompress_chunk(fp, wfp, clen > INT_MAX ? INT_MAX : (int) clen, cbuf, cbuf_len, dbuf, chunk_size + 1, chunk_ctx);
+    }
+  } else {
+    uint8_t footer[12];
+    uint64_t index_pos = 0, chunk_count = 0, clen = 0, len;
+    long pos = header_len;
+    if (!(flags & USX_STREAM_FLAG_INDEX) || fseek(fp, -12, SEEK_END) != 0 || fread(footer, 1, 12, fp) != 12
+          || memcmp(footer + 8, USX_STREAM_INDEX_MAGIC, 4) != 0) {
+      fprintf(stderr, "No chunk index\n");
+      ret = 1;
+    } else {
+      for (int i = 7; i >= 0; i--)
+        index_pos = (index_pos << 8) | footer[i];
+      if (fseek(fp, (long) index_pos, SEEK_SET) != 0 || read_varint(fp, &chunk_count) == 0 || chunk_no >= (long) chunk_count) {
+        fprintf(stderr, "Chunk %ld not found\n", chunk_no);
+        ret = 1;
+      }
+      for (long i = 0; ret == 0 && i <= chunk_no; i++) {
+        if (i)
+          pos += write_varint_len(clen) + clen;
+        if (read_varint(fp, &clen) == 0 || read_varint(fp, &len) == 0)
+          ret = 1;
+      }
+      if (ret == 0 && fseek(fp, pos + write_varint_len(clen), SEEK_SET) == 0)
+        ret = stream_decompress_chunk(fp, wfp, clen > INT_MAX ? INT_MAX : (int) clen, cbuf, cbuf_len, dbuf, chunk_size + 1, chunk_ctx);
+    }
+  }
+  free(dbuf);
+  free(cbuf);
+  return ret;
+}
+
+/// Writes the non-empty lines of in_file as a string table to out_file
+int write_string_table(const char *in_file, const char *out_file, int preset) {
+  char *arena;
+  const char **lines;
+  int *lens;
+  char *table;
+  const int line_count = read_lines(in_file, &arena, &lines, &lens);
+  if (line_count < 0)
+    return 1;
+  const int table_len = build_string_table(lines, lens, line_count, preset, &table);
+  if (table_len == 0) {
+    fprintf(stderr, "Could not build string table\n");
+    return 1;
+  }
+  FILE *wfp = fopen(out_file, "wb");
+  if (wfp == NULL) {
+    perror(out_file);
+    return 1;
+  }
+  if ((int)fwrite(table, 1, table_len, wfp) != table_len) {
+    perror("fwrite");
+    return 1;
+  }
+  fclose(wfp);
+  int tot_len = 0;
+  for (int i = 0; i < line_count; i++)
+    tot_len += lens[i];
+  printf("Lines: %d, Bytes (Table/Original): %d/%d\n", line_count, table_len, tot_len);
+  free(table);
+  free(lens);
+  free((void *) lines);
+  free(arena);
+  return 0;
+}
+
+/// Prints given line of a string table file
+int print_table_line(const char *table_file, int line_no) {
+  struct unishox2_table t;
+#if UNISHOX_TABLE_MMAP
+  if (!unishox2_table_map(&t, table_file)) {
+    fprintf(stderr, "%s: not a string table\n", table_file);
+    return 1;
+  }
+#else
+  char *data;
+  int data_len;
+  FILE *fp = fopen(table_file, "rb");
+  if (fp == NULL) {
+    perror(table_file);
+    return 1;
+  }
+  fseek(fp, 0, SEEK_END);
+  data_len = (int)ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  data = (char *) malloc(data_len);
+  if ((int)fread(data, 1, data_len, fp) != data_len || !unishox2_table_open(&t, data, data_len)) {
+    fprintf(stderr, "%s: not a string table\n", table_file);
+    return 1;
+  }
+  fclose(fp);
+#endif
+  struct unishox2_ctx ctx;
+  char *out = (char *) malloc(t.max_len + 1);
+  unishox2_init_preset_ctx(&ctx, t.preset);
+  const int len = unishox2_table_get(&t, line_no, UNISHOX_API_OUT_AND_LEN(out, t.max_len + 1), &ctx);
+  if (len < 0 || len > t.max_len) {
+    fprintf(stderr, "Line %d not found in %d lines\n", line_no, t.line_count);
+    return 1;
+  }
+  out[len] = 0;
+  printf("%s\n", out);
+  free(out);
+#if UNISHOX_TABLE_MMAP
+  unishox2_table_unmap(&t);
+#else
+  free(data);
+#endif
+  return 0;
+}
+
+/// Returns a monotonic time in nanoseconds, for timing single strings
+uint64_t getTimeNs() {
+#ifdef _MSC_VER
+    LARGE_INTEGER freq, count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (uint64_t) ((double) count.QuadPart * 1000000000 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/// Strings compressed one at a time by -bench
+struct bench_corpus {
+  const char *name;
+  char *arena;
+  const char **strs;
+  int *lens;
+  int count;
+};
+
+#define BENCH_ROUNDS 3
+#define BENCH_SYNTH_COUNT 1000
+#define BENCH_SYNTH_MAX_LEN 256
+
+/// Deterministic generator for the synthetic corpora, so that runs can be compared
+static uint32_t bench_rand(uint32_t *seed) {
+  *seed = *seed * 1103515245 + 12345;
+  return (*seed >> 16) & 0x7FFF;
+}
+
+static const char *bench_pick(uint32_t *seed, const char *list[], int count) {
+  return list[bench_rand(seed) % count];
+}
+
+/// Generates BENCH_SYNTH_COUNT short strings of the given kind into the corpus
+void bench_synthetic(struct bench_corpus *c, int kind) {
+  static const char *words[] = {"the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog", "and", "of",
+    "to", "in", "is", "that", "for", "it", "as", "was", "with", "be", "by", "on", "not", "he", "this",
+    "are", "or", "his", "from", "at", "which", "but", "have", "an", "had", "they", "you", "were", "their"};
+  static const char *uni_words[] = {"καλημέρα", "κόσμε", "привет", "мир", "日本語", "中文", "한국어",
+    "हिन्दी", "தமிழ்", "café", "über", "naïve", "😀", "👍", "🎉", "❤️"};
+  static const char *keys[] = {"id", "name", "email", "active", "count", "type", "url", "created"};
+  static const char *kind_names[] = {"synthetic:words", "synthetic:ids", "synthetic:json", "synthetic:utf8"};
+  uint32_t seed = 2020 + kind;
+  c->name = kind_names[kind];
+  c->arena = (char *) malloc(BENCH_SYNTH_COUNT * BENCH_SYNTH_MAX_LEN);
+  c->strs = (const char **) malloc(BENCH_SYNTH_COUNT * sizeof(char *));
+  c->lens = (int *) malloc(BENCH_SYNTH_COUNT * sizeof(int));
+  c->count = BENCH_SYNTH_COUNT;
+  for (int i = 0; i < BENCH_SYNTH_COUNT; i++) {
+    char *s = c->arena + i * BENCH_SYNTH_MAX_LEN;
+    const int max = BENCH_SYNTH_MAX_LEN - 32;
+    int len = 0;
+    switch (kind) {
+      case 0: {
+        int word_count = 2 + bench_rand(&seed) % 10;
+        for (int w = 0; w < word_count && len < max; w++)
+          len += sprintf(s + len, w ? " %s" : "%s", bench_pick(&seed, words, sizeof(words) / sizeof(words[0])));
+        if (bench_rand(&seed) % 2)
+          s[0] = (char) toupper((unsigned char) s[0]);
+        break;
+      }
+      case 1:
+        switch (bench_rand(&seed) % 3) {
+          case 0:
+            len = sprintf(s, "ORD-%04d-%06d", 2000 + (int) (bench_rand(&seed) % 30), (int) (bench_rand(&seed) * 31 % 1000000));
+            break;
+          case 1:
+            len = sprintf(s, "%04d-%02d-%02dT%02d:%02d:%02dZ", 2000 + (int) (bench_rand(&seed) % 30), 1 + (int) (bench_rand(&seed) % 12),
+              1 + (int) (bench_rand(&seed) % 28), (int) (bench_rand(&seed) % 24), (int) (bench_rand(&seed) % 60), (int) (bench_rand(&seed) % 60));
+            break;
+          default:
+            len = sprintf(s, "+1 (%03d) %03d-%04d", (int) (bench_rand(&seed) % 1000), (int) (bench_rand(&seed) % 1000), (int) (bench_rand(&seed) % 10000));
+        }
+        break;
+      case 2: {
+        int key_count = 1 + bench_rand(&seed) % 4;
+        len = sprintf(s, "{");
+        for (int k = 0; k < key_count && len < max; k++) {
+          const char *key = bench_pick(&seed, keys, sizeof(keys) / sizeof(keys[0]));
+          if (bench_rand(&seed) % 2)
+            len += sprintf(s + len, "%s\"%s\":%d", k ? "," : "", key, (int) bench_rand(&seed));
+          else
+            len += sprintf(s + len, "%s\"%s\":\"%s\"", k ? "," : "", key, bench_pick(&seed, words, sizeof(words) / sizeof(words[0])));
+        }
+        len += sprintf(s + len, "}");
+        break;
+      }
+      default: {
+        int word_count = 2 + bench_rand(&seed) % 8;
+        for (int w = 0; w < word_count && len < max; w++) {
+          const char *word = (bench_rand(&seed) % 3 ? bench_pick(&seed, uni_words, sizeof(uni_words) / sizeof(uni_words[0]))
+                                : bench_pick(&seed, words, sizeof(words) / sizeof(words[0])));
+          len += sprintf(s + len, w ? " %s" : "%s", word);
+        }
+      }
+    }
+    c->strs[i] = s;
+    c->lens[i] = len;
+  }
+}
+
+/// Reads the non-empty lines of the given file as a corpus, cutting lines longer than \n
+/// USX_STREAM_DEFAULT_CHUNK at UTF-8 character boundaries. Returns 0 if successful
+int bench_read_file(struct bench_corpus *c, const char *file_name) {
+  const char **lines;
+  int *lens;
+  int line_count = read_lines(file_name, &c->arena, &lines, &lens);
+  if (line_count < 0)
+    return 1;
+  int count = 0;
+  for (int i = 0; i < line_count; i++)
+    count += (lens[i] + USX_STREAM_DEFAULT_CHUNK - 1) / USX_STREAM_DEFAULT_CHUNK * 2;
+  c->name = file_name;
+  c->strs = (const char **) malloc((count + 1) * sizeof(char *));
+  c->lens = (int *) malloc((count + 1) * sizeof(int));
+  c->count = 0;
+  for (int i = 0; i < line_count; i++) {
+    for (int pos = 0; pos < lens[i]; ) {
+      int len = lens[i] - pos;
+      if (len > USX_STREAM_DEFAULT_CHUNK)
+        len = stream_chunk_end(lines[i] + pos, USX_STREAM_DEFAULT_CHUNK, 0);
+      c->strs[c->count] = lines[i] + pos;
+      c->lens[c->count++] = len;
+      pos += len;
+    }
+  }
+  free((void *) lines);
+  free(lens);
+  return 0;
+}
+
+static int bench_cmp_ns(const void *a, const void *b) {
+  const uint64_t x = *(const uint64_t *) a;
+  const uint64_t y = *(const uint64_t *) b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/// Sorts the latency samples and returns the given percentile
+static uint64_t bench_percentile(uint64_t *samples, int count, int percent) {
+  qsort(samples, count, sizeof(uint64_t), bench_cmp_ns);
+  return samples[(long) count * percent / 100];
+}
+
+/// Writes corpus name as a quoted CSV or JSON string
+static void bench_write_name(FILE *wfp, const char *name, int json) {
+  fputc('"', wfp);
+  for (const char *s = name; *s; s++) {
+    if (*s == '"')
+      fputc(json ? '\\' : '"', wfp);
+    else if (*s == '\\' && json)
+      fputc('\\', wfp);
+    fputc(*s, wfp);
+  }
+  fputc('"', wfp);
+}
+
+/// Returns 1 if the string has bytes other than printable ASCII, \n
+/// which presets without Unicode cannot encode
+static int bench_needs_unicode(const char *s, int len) {
+  for (int i = 0; i < len; i++) {
+    if (s[i] < ' ' || s[i] > '~')
+      return 1;
+  }
+  return 0;
+}
+
+/// Compresses and decompresses each string of the corpus one at a time with the given preset \n
+/// BENCH_ROUNDS times and writes a row of results. As in the unit tests, strings having Unicode \n
+/// or control characters are skipped for presets without Unicode. Strings with other characters that the preset \n
+/// drops do not round trip, which is reported as lossless = 0 rather than failing. \n
+/// Returns 1 if a row was written, 0 if all strings were skipped
+int bench_corpus_preset(const struct bench_corpus *corpus, int preset, FILE *wfp, int json, int row) {
+  struct bench_corpus c_preset = *corpus;
+  struct bench_corpus *c = &c_preset;
+  c->strs = (const char **) malloc((corpus->count + 1) * sizeof(char *));
+  c->lens = (int *) malloc((corpus->count + 1) * sizeof(int));
+  c->count = 0;
+  for (int i = 0; i < corpus->count; i++) {
+    if (presetForUnicode(preset) || !bench_needs_unicode(corpus->strs[i], corpus->lens[i])) {
+      c->strs[c->count] = corpus->strs[i];
+      c->lens[c->count++] = corpus->lens[i];
+    }
+  }
+  const int skipped = corpus->count - c->count;
+  if (c->count == 0) {
+    free(c->lens);
+    free((void *) c->strs);
+    return 0;
+  }
+  int tot_len = 0, max_len = 0;
+  for (int i = 0; i < c->count; i++) {
+    tot_len += c->lens[i];
+    if (max_len < c->lens[i])
+      max_len = c->lens[i];
+  }
+  const int cbuf_len = tot_len * 2 + c->count * 8 + 16;
+  const int dbuf_len = max_len * 2 + 16;
+  const int sample_count = c->count * BENCH_ROUNDS;
+  char *cbuf = (char *) malloc(cbuf_len);
+  char *dbuf = (char *) malloc(dbuf_len);
+  int *coffsets = (int *) malloc((c->count + 1) * sizeof(int));
+  uint64_t *c_ns = (uint64_t *) malloc((sample_count + 1) * sizeof(uint64_t));
+  uint64_t *d_ns = (uint64_t *) malloc((sample_count + 1) * sizeof(uint64_t));
+  uint64_t c_tot = 0, d_tot = 0;
+  int clen = 0, lossless = 1;
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    clen = 0;
+    for (int i = 0; i < c->count; i++) {
+      coffsets[i] = clen;
+      uint64_t t0 = getTimeNs();
+      clen += unishox2_compress_preset_lines(c->strs[i], c->lens[i], UNISHOX_API_OUT_AND_LEN(cbuf + clen, cbuf_len - clen), preset, NULL);
+      c_ns[r * c->count + i] = getTimeNs() - t0;
+      c_tot += c_ns[r * c->count + i];
+    }
+    coffsets[c->count] = clen;
+  }
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    for (int i = 0; i < c->count; i++) {
+      uint64_t t0 = getTimeNs();
+      int dlen = unishox2_decompress_preset_lines(cbuf + coffsets[i], coffsets[i + 1] - coffsets[i], UNISHOX_API_OUT_AND_LEN(dbuf, dbuf_len), preset, NULL);
+      d_ns[r * c->count + i] = getTimeNs() - t0;
+      d_tot += d_ns[r * c->count + i];
+      if (r == 0 && (dlen != c->lens[i] || memcmp(dbuf, c->strs[i], dlen)))
+        lossless = 0;
+    }
+  }
+  const double c_mbps = (double) tot_len * BENCH_ROUNDS * 1000 / (c_tot ? c_tot : 1);
+  const double d_mbps = (double) tot_len * BENCH_ROUNDS * 1000 / (d_tot ? d_tot : 1);
+  const double ratio = (double) tot_len / (clen ? clen : 1);
+  const uint64_t c_p50 = bench_percentile(c_ns, sample_count, 50);
+  const uint64_t c_p99 = bench_percentile(c_ns, sample_count, 99);
+  const uint64_t d_p50 = bench_percentile(d_ns, sample_count, 50);
+  const uint64_t d_p99 = bench_percentile(d_ns, sample_count, 99);
+  if (json) {
+    fprintf(wfp, "%s  {\"preset\": %d, \"corpus\": ", row ? ",\n" : "", preset);
+    bench_write_name(wfp, c->name, 1);
+    fprintf(wfp, ", \"strings\": %d, \"skipped\": %d, \"bytes_in\": %d, \"bytes_out\": %d, \"ratio\": %.4f, \"lossless\": %d, "
+      "\"compress_mbps\": %.2f, \"decompress_mbps\": %.2f, \"compress_ns_per_string\": %.1f, \"decompress_ns_per_string\": %.1f, "
+      "\"compress_p50_ns\": %llu, \"compress_p99_ns\": %llu, \"decompress_p50_ns\": %llu, \"decompress_p99_ns\": %llu}",
+      c->count, skipped, tot_len, clen, ratio, lossless, c_mbps, d_mbps, (double) c_tot / sample_count, (double) d_tot / sample_count,
+      (unsigned long long) c_p50, (unsigned long long) c_p99, (unsigned long long) d_p50, (unsigned long long) d_p99);
+  } else {
+    fprintf(wfp, "%d,", preset);
+    bench_write_name(wfp, c->name, 0);
+    fprintf(wfp, ",%d,%d,%d,%d,%.4f,%d,%.2f,%.2f,%.1f,%.1f,%llu,%llu,%llu,%llu\n",
+      c->count, skipped, tot_len, clen, ratio, lossless, c_mbps, d_mbps, (double) c_tot / sample_count, (double) d_tot / sample_count,
+      (unsigned long long) c_p50, (unsigned long long) c_p99, (unsigned long long) d_p50, (unsigned long long) d_p99);
+  }
+  free(d_ns);
+  free(c_ns);
+  free(coffsets);
+  free(dbuf);
+  free(cbuf);
+  free(c->lens);
+  free((void *) c->strs);
+  return 1;
+}
+
+/// Benchmarks all presets over the lines of the given files and the synthetic short string corpora, \n
+/// writing a CSV or JSON row for each preset and corpus to out_file
+int run_bench(const char *format, const char *out_file, int file_count, char *file_names[]) {
+  const int json = (strcmp(format, "json") == 0);
+  if (!json && strcmp(format, "csv") != 0) {
+    printf("invalid format: %s (csv or json)\n", format);
+    return 1;
+  }
+  const int corpus_count = file_count + 4;
+  struct bench_corpus *corpora = (struct bench_corpus *) calloc(corpus_count, sizeof(struct bench_corpus));
+  for (int i = 0; i < file_count; i++) {
+    if (bench_read_file(&corpora[i], file_names[i]))
+      return 1;
+  }
+  for (int kind = 0; kind < 4; kind++)
+    bench_synthetic(&corpora[file_count + kind], kind);
+  FILE *wfp = open_file(out_file, "w");
+  if (wfp == NULL)
+    return 1;
+  if (json)
+    fprintf(wfp, "[\n");
+  else
+    fprintf(wfp, "preset,corpus,strings,skipped,bytes_in,bytes_out,ratio,lossless,compress_mbps,decompress_mbps,"
+      "compress_ns_per_string,decompress_ns_per_string,compress_p50_ns,compress_p99_ns,decompress_p50_ns,decompress_p99_ns\n");
+  int row = 0;
+  for (int i = 0; i < corpus_count; i++) {
+    if (corpora[i].count == 0)
+      continue;
+    for (int preset = 0; preset <= 16; preset++)
+      row += bench_corpus_preset(&corpora[i], preset, wfp, json, row);
+  }
+  if (json)
+    fprintf(wfp, "\n]\n");
+  if (wfp != stdout)
+    fclose(wfp);
+  for (int i = 0; i < corpus_count; i++) {
+    free(corpora[i].lens);
+    free((void *) corpora[i].strs);
+    free(corpora[i].arena);
+  }
+  free(corpora);
+  return 0;
+}
+
+/// Writes character c of a set as a C character constant, or as a number if not printable ASCII
+static void train_write_set_char(FILE *wfp, uint8_t c) {
+  if (c == '\n' || c == '\t' || c == '\r')
+    fprintf(wfp, "'\\%c'", c == '\n' ? 'n' : (c == '\t' ? 't' : 'r'));
+  else if (c == '\'' || c == '\\')
+    fprintf(wfp, "'\\%c'", c);
+  else if (c >= ' ' && c <= '~')
+    fprintf(wfp, "'%c'", c);
+  else if (c)
+    fprintf(wfp, "0x%02X", c);
+  else
+    fputc('0', wfp);
+}
+
+/// Trains a preset on the lines of in_file using train_preset() and writes it to out_file as a header \n
+/// defining USX_HCODES_<name>, USX_HCODE_LENS_<name>, USX_FREQ_SEQ_<name>, USX_PSET_<name> and USX_SETS_<name>. \n
+/// Like the headers of -g, it defines USX_FREQ_SEQ_<name>, so it is to be included in one source file
+int run_train(const char *in_file, const char *out_file, const char *name) {
+  struct bench_corpus c;
+  struct train_preset tp;
+  if (bench_read_file(&c, in_file))
+    return 1;
+  if (c.count == 0 || train_preset(c.strs, c.lens, c.count, &tp)) {
+    fprintf(stderr, "Could not train on %s\n", in_file);
+    return 1;
+  }
+  FILE *wfp = open_file(out_file, "w");
+  if (wfp == NULL)
+    return 1;
+  fprintf(wfp, "#ifndef __USX_PSET_%s__\n#define __USX_PSET_%s__\n\n", name, name);
+  fprintf(wfp, "// Trained using test_unishox2 -train on %s, starting from preset %d\n", in_file, tp.base_preset);
+  fprintf(wfp, "// Sample of %ld bytes compressed to %ld bytes, against %ld bytes using preset %d\n\n",
+    tp.bytes_in, tp.bytes_out, tp.base_bytes_out, tp.base_preset);
+  fprintf(wfp, "#include \"unishox2.h\"\n\n");
+  fprintf(wfp, "/// Horizontal codes trained on %s\n#define USX_HCODES_%s (const unsigned char[]) {", in_file, name);
+  for (int i = 0; i < 5; i++)
+    fprintf(wfp, "%s0x%02X", i ? ", " : "", tp.hcodes[i]);
+  fprintf(wfp, "}\n/// Length of each hcode trained on %s", in_file);
+  if (!tp.hcode_lens[HCODE_DELTA])
+    fprintf(wfp, " (no Unicode, as none was found)");
+  fprintf(wfp, "\n#define USX_HCODE_LENS_%s (const unsigned char[]) {", name);
+  for (int i = 0; i < 5; i++)
+    fprintf(wfp, "%s%d", i ? ", " : "", tp.hcode_lens[i]);
+  fprintf(wfp, "}\n/// Frequent sequences trained on %s\nconst char *USX_FREQ_SEQ_%s[] = {", in_file, name);
+  for (int i = 0; i < 6; i++) {
+    fputs(i ? ", \"" : "\"", wfp);
+    for (const char *s = tp.seqs[i]; *s; s++) {
+      if (*s == '"' || *s == '\\')
+        fputc('\\', wfp);
+      fputc(*s, wfp);
+    }
+    fputc('"', wfp);
+  }
+  fprintf(wfp, "};\n/// Preset parameter set trained on %s\n", in_file);
+  fprintf(wfp, "#define USX_PSET_%s USX_HCODES_%s, USX_HCODE_LENS_%s, USX_FREQ_SEQ_%s, USX_TEMPLATES\n", name, name, name, name);
+  fprintf(wfp, "/// Sets trained on %s, for compressing and decompressing using a context built as \\n\n", in_file);
+  fprintf(wfp, "/// unishox2_init_ctx_sets(&ctx, USX_PSET_%s, USX_SETS_%s)\n#define USX_SETS_%s (const unsigned char[][28]) { \\\n", name, name, name);
+  for (int h = 0; h < 3; h++) {
+    for (int v = 0; v < 28; v++) {
+      fputs(v == 0 ? "  {" : (v == 14 ? ", \\\n   " : ", "), wfp);
+      train_write_set_char(wfp, tp.sets[h][v]);
+    }
+    fputs(h < 2 ? "}, \\\n" : "}}\n\n#endif\n", wfp);
+  }
+  if (wfp != stdout)
+    fclose(wfp);
+  fprintf(wfp == stdout ? stderr : stdout, "\nBytes (Compressed/Original=Savings%%): %ld/%ld=%.2f%% (preset %d: %ld/%ld=%.2f%%)\n", tp.bytes_out, tp.bytes_in,
+    (tp.bytes_in - tp.bytes_out) * 100.0 / tp.bytes_in, tp.base_preset, tp.base_bytes_out, tp.bytes_in,
+    (tp.bytes_in - tp.base_bytes_out) * 100.0 / tp.bytes_in);
+  free(c.lens);
+  free((void *) c.strs);
+  free(c.arena);
+  return 0;
+}
+
+#if UNISHOX_BATCH_THREADS
+/// Times the multi-threaded batch api over all lines of the given files using 1 to max_threads threads \n
+/// and checks that the output is the same as that of the single threaded batch api
+int run_mt_bench(int file_count, char *file_names[], int max_threads, int preset) {
+  const int max_files = 64;
+  char *arenas[64];
+  const char **lines = NULL;
+  int *lens = NULL;
+  int line_count = 0;
+  if (file_count > max_files)
+    file_count = max_files;
+  for (int f = 0; f < file_count; f++) {
+    const char **file_lines;
+    int *file_lens;
+    int file_line_count = read_lines(file_names[f], &arenas[f], &file_lines, &file_lens);
+    if (file_line_count < 0)
+      return 1;
+    lines = (const char **) realloc((void *) lines, (line_count + file_line_count) * sizeof(char *));
+    lens = (int *) realloc(lens, (line_count + file_line_count) * sizeof(int));
+    memcpy(lines + line_count, file_lines, file_line_count * sizeof(char *));
+    memcpy(lens + line_count, file_lens, file_line_count * sizeof(int));
+    line_count += file_line_count;
+    free((void *) file_lines);
+    free(file_lens);
+  }
+  if (line_count <= 0)
+    return 1;
+  int tot_len = 0;
+  for (int i = 0; i < line_count; i++)
+    tot_len += lens[i];
+  const int cbuf_len = tot_len * 2 + line_count * 8;
+  char *cbuf_ref = (char *) malloc(cbuf_len);
+  char *cbuf = (char *) malloc(cbuf_len);
+  char *dbuf = (char *) malloc(tot_len + 1);
+  int *coffsets_ref = (int *) malloc((line_count + 1) * sizeof(int));
+  int *coffsets = (int *) malloc((line_count + 1) * sizeof(int));
+  int *doffsets = (int *) malloc((line_count + 1) * sizeof(int));
+  const int rounds = 5;
+  struct unishox2_ctx ctx;
+  unishox2_init_preset_ctx(&ctx, preset);
+
+  const int clen_ref = unishox2_compress_batch(lines, lens, line_count, UNISHOX_API_OUT_AND_LEN(cbuf_ref, cbuf_len), coffsets_ref, &ctx);
+  printf("Files: %d, Lines: %d, Bytes (Compressed/Original): %d/%d\n", file_count, line_count, clen_ref, tot_len);
+  printf("Threads  Compress MB/s  Speedup  Decompress MB/s  Speedup\n");
+  double c_base = 0, d_base = 0;
+  for (int threads = 1; threads <= max_threads; threads++) {
+    int clen = 0;
+    uint32_t t0 = getTimeVal();
+    for (int r = 0; r < rounds; r++)
+      clen = unishox2_compress_batch_mt(lines, lens, line_count, UNISHOX_API_OUT_AND_LEN(cbuf, cbuf_len), coffsets, &ctx, threads);
+    double c_ms = timedifference(t0, getTimeVal());
+    if (clen != clen_ref || memcmp(cbuf, cbuf_ref, clen) || memcmp(coffsets, coffsets_ref, (line_count + 1) * sizeof(int))) {
+      printf("Fail: compressed output with %d threads differs from single threaded output\n", threads);
+      return 1;
+    }
+    int dlen = 0;
+    t0 = getTimeVal();
+    for (int r = 0; r < rounds; r++)
+      dlen = unishox2_decompress_batch_mt(cbuf, coffsets, line_count, UNISHOX_API_OUT_AND_LEN(dbuf, tot_len + 1), doffsets, &ctx, threads);
+    double d_ms = timedifference(t0, getTimeVal());
+    for (int i = 0; i < line_count; i++) {
+      if (dlen != tot_len || doffsets[i + 1] - doffsets[i] != lens[i] || memcmp(dbuf + doffsets[i], lines[i], lens[i])) {
+        printf("Fail: decompressed output with %d threads differs at line %d\n", threads, i);
+        return 1;
+      }
+    }
+    const double c_mbps = (double) tot_len * rounds / 1000 / (c_ms > 0 ? c_ms : 1);
+    const double d_mbps = (double) tot_len * rounds / 1000 / (d_ms > 0 ? d_ms : 1);
+    if (threads == 1) {
+      c_base = c_mbps;
+      d_base = d_mbps;
+    }
+    printf("%7d  %13.2f  %7.2f  %15.2f  %7.2f\n", threads, c_mbps, c_mbps / c_base, d_mbps, d_mbps / d_base);
+  }
+
+  free(doffsets);
+  free(coffsets);
+  free(coffsets_ref);
+  free(dbuf);
+  free(cbuf);
+  free(cbuf_ref);
+  free(lens);
+  free((void *) lines);
+  for (int f = 0; f < file_count; f++)
+    free(arenas[f]);
+  return 0;
+}
+#endif
+
 /**
  * <pre>
  * Usage: test_unishox2 \"string\" [preset_number]
@@ -620,10 +2607,44 @@ int run_unit_tests(int argc, char *argv[]) {
  *
  *          action:
  *          -t    run tests
- *          -c    compress
- *          -d    decompress
+ *          -c    compress (in_file and out_file can be - for stdin / stdout)
+ *          -ci   compress and append chunk index
+ *          -d    decompress (preset_number needed only for files from earlier versions)
  *          -g    generate C header file
  *          -G    generate C header file using additional compression (slower)
+ *          -gt   generate string table file for random access to each line (out_file is the table file)
+ *          -b    compare time taken by batch api against one call per line (no out_file)
+ *          -l    compare compression levels 1, 6, 9 and optimal parsing (no out_file)
+ *          -bench  benchmark all presets (see below)
+ *
+ *        test_unishox2 -c|-ci in_file out_file [preset_number|auto] [chunk_size]
+ *          compress chunk_size (default 4096) bytes at a time
+ *          (auto chooses the preset for each chunk and records it, so -d needs no preset_number)
+ *
+ *        test_unishox2 -l in_file [preset_number] [chunk_size]
+ *          compress chunk_size (default 4096) bytes at a time at each level
+ *
+ *        test_unishox2 -bench csv|json out_file [in_file ...]
+ *          compress and decompress each line of the files and of synthetic short strings with each preset,
+ *          writing ratio (original/compressed), MB/s, ns per string and p50/p99 latency (out_file can be -)
+ *
+ *        test_unishox2 -train in_file out_file [name]
+ *          find hcodes and frequent sequences for the lines of in_file and write them
+ *          as preset USX_PSET_<name> (default TRAINED) to header out_file (can be -)
+ *
+ *        test_unishox2 -dx in_file out_file chunk_number
+ *          decompress only given chunk using chunk index
+ *
+ *        test_unishox2 -r table_file line_number
+ *          print given line of string table generated using -gt
+ *
+ *        test_unishox2 -m max_threads preset_number in_file [in_file ...]
+ *          time the multi-threaded batch api with 1 to max_threads threads
+ *          (needs UNISHOX_BATCH_THREADS)
+ *
+ *        test_unishox2 -stats in_file [preset_number]
+ *          compress each line and print hits and bits of each encoder path
+ *          (needs UNISHOX_STATS)
  *
  *          preset_number:
  *          0    Optimum - favors all including JSON, XML, URL and HTML (default)
@@ -653,83 +2674,53 @@ long len, tot_len, clen, ctot=0;
 size_t dlen;
 float perc=0.F;
 FILE *fp, *wfp;
-int bytes_read;
 uint32_t tStart;
+int out_is_stdout = 0;
 
 tStart = getTimeVal();
 
-if (argc >= 4 && strcmp(argv[1], "-c") == 0) {
+if (argc >= 4 && (strcmp(argv[1], "-c") == 0 || strcmp(argv[1], "-ci") == 0)) {
    int preset = 0;
+   int chunk_size = USX_STREAM_DEFAULT_CHUNK;
    if (argc > 4)
-     preset = atoi(argv[4]);
+     preset = (strcmp(argv[4], "auto") == 0 ? USX_STREAM_PRESET_AUTO : atoi(argv[4]));
+   if (argc > 5)
+     chunk_size = atoi(argv[5]);
+   if (preset < 0 || (UNISHOX_PRESET_COUNT <= preset && preset != USX_STREAM_PRESET_AUTO) || chunk_size < 16 || USX_STREAM_MAX_CHUNK < chunk_size) {
+     fprintf(stderr, "invalid preset %d or chunk size %d (16 to %d)\n", preset, chunk_size, USX_STREAM_MAX_CHUNK);
+     return 1;
+   }
    tot_len = 0;
-   fp = fopen(argv[2], "rb");
-   if (fp == NULL) {
-      perror(argv[2]);
+   fp = open_file(argv[2], "rb");
+   if (fp == NULL)
       return 1;
-   }
-   wfp = fopen(argv[3], "wb");
-   if (wfp == NULL) {
-      perror(argv[3]);
+   wfp = open_file(argv[3], "wb");
+   if (wfp == NULL)
       return 1;
-   }
-   do {
-     bytes_read = (int)fread(cbuf, 1, sizeof(cbuf), fp);
-     if (bytes_read > 0) {
-        clen = unishox2_compress_preset_lines(cbuf, bytes_read, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), preset, NULL);
-        ctot += clen;
-        tot_len += bytes_read;
-        if (clen > 0) {
-           fputc(clen >> 8, wfp);
-           fputc(clen & 0xFF, wfp);
-           if (clen != (long)fwrite(dbuf, 1, clen, wfp)) {
-              perror("fwrite");
-              return 1;
-           }
-        }
-     }
-   } while (bytes_read > 0);
+   out_is_stdout = (wfp == stdout);
+   if (stream_compress(fp, wfp, preset, chunk_size, strcmp(argv[1], "-ci") == 0, &tot_len, &ctot))
+     return 1;
    perc = (float)(tot_len-ctot);
    perc /= tot_len;
    perc *= 100;
-   printf("\nBytes (Compressed/Original=Savings%%): %ld/%ld=", ctot, tot_len);
-   printf("%.2f%%\n", perc);
+   fprintf(out_is_stdout ? stderr : stdout, "\nBytes (Compressed/Original=Savings%%): %ld/%ld=%.2f%%\n", ctot, tot_len, perc);
 } else
-if (argc >= 4 && strcmp(argv[1], "-d") == 0) {
+if (argc >= 4 && (strcmp(argv[1], "-d") == 0 || (argc >= 5 && strcmp(argv[1], "-dx") == 0))) {
    int preset = 0;
-   if (argc > 4)
+   long chunk_no = -1;
+   if (strcmp(argv[1], "-dx") == 0)
+     chunk_no = atol(argv[4]);
+   else if (argc > 4)
      preset = atoi(argv[4]);
-   fp = fopen(argv[2], "rb");
-   if (fp == NULL) {
-      perror(argv[2]);
+   fp = open_file(argv[2], "rb");
+   if (fp == NULL)
       return 1;
-   }
-   wfp = fopen(argv[3], "wb");
-   if (wfp == NULL) {
-      perror(argv[3]);
+   wfp = open_file(argv[3], "wb");
+   if (wfp == NULL)
       return 1;
-   }
-   do {
-     //memset(dbuf, 0, sizeof(dbuf));
-     if (feof(fp))
-       break;
-     int len_to_read = fgetc(fp) << 8;
-     if (feof(fp))
-       break;
-     len_to_read += fgetc(fp);
-     if (feof(fp))
-       break;
-     bytes_read = (int)fread(dbuf, 1, len_to_read, fp);
-     if (bytes_read > 0) {
-        dlen = unishox2_decompress_preset_lines(dbuf, bytes_read, UNISHOX_API_OUT_AND_LEN(cbuf, sizeof cbuf), preset, NULL);
-        if (dlen > 0) {
-           if (dlen != fwrite(cbuf, 1, dlen, wfp)) {
-              perror("fwrite");
-              return 1;
-           }
-        }
-     }
-   } while (bytes_read > 0);
+   out_is_stdout = (wfp == stdout);
+   if (stream_decompress(fp, wfp, preset, chunk_no))
+     return 1;
 } else
 if (argc >= 4 && (strcmp(argv[1], "-g") == 0 || 
       strcmp(argv[1], "-G") == 0 ||
@@ -753,6 +2744,13 @@ if (argc >= 4 && (strcmp(argv[1], "-g") == 0 ||
    tot_len = 0;
    ctot = 0;
    struct us_lnk_lst *cur_line = NULL;
+   struct unishox2_ctx ctx;
+   struct unishox2_line_index line_idx;
+   unishox2_init_preset_ctx(&ctx, preset);
+   if (!unishox2_init_line_index(&line_idx)) {
+      perror("line index");
+      return 1;
+   }
    if (strcmp(argv[1], "-gb") != 0) {
      fputs("#ifndef __", wfp);
      fputs(argv[3], wfp);
@@ -780,9 +2778,11 @@ if (argc >= 4 && (strcmp(argv[1], "-g") == 0 ||
         ll = cur_line;
         cur_line = (struct us_lnk_lst *) malloc(sizeof(struct us_lnk_lst));
         cur_line->data = (char *) malloc(len + 1);
-        strncpy(cur_line->data, cbuf, len);
+        memcpy(cur_line->data, cbuf, len);
+        cur_line->data[len] = 0;
         cur_line->previous = ll;
-        clen = unishox2_compress_preset_lines(cbuf, len, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), preset, cur_line);
+        clen = unishox2_compress_lines_with_index(cbuf, len, UNISHOX_API_OUT_AND_LEN(dbuf, sizeof dbuf), &ctx, &line_idx);
+        unishox2_line_index_add(&line_idx, cur_line->data, len);
         if (clen > 0) {
             perc = (float)(len-clen);
             perc /= len;
@@ -849,7 +2849,73 @@ if (argc >= 4 && (strcmp(argv[1], "-g") == 0 ||
      fputs("#endif\n", wfp);
    }
    free(short_buf);
+   unishox2_free_line_index(&line_idx);
+} else
+if (argc >= 4 && strcmp(argv[1], "-gt") == 0) {
+  int preset = 0;
+  if (argc > 4)
+    preset = atoi(argv[4]);
+  if (preset < 0 || 16 < preset) {
+    printf("invalid preset %d\n", preset);
+    return 1;
+  }
+  if (write_string_table(argv[2], argv[3], preset))
+    return 1;
+} else
+if (argc >= 4 && strcmp(argv[1], "-r") == 0) {
+  if (print_table_line(argv[2], atoi(argv[3])))
+    return 1;
+} else
+if (argc >= 3 && strcmp(argv[1], "-l") == 0) {
+  int preset = 0;
+  int chunk_size = USX_STREAM_DEFAULT_CHUNK;
+  if (argc > 3)
+    preset = atoi(argv[3]);
+  if (argc > 4)
+    chunk_size = atoi(argv[4]);
+  if (preset < 0 || 16 < preset || chunk_size <= 0) {
+    printf("invalid preset or chunk size\n");
+    return 1;
+  }
+  if (run_level_test(argv[2], preset, chunk_size))
+    return 1;
+} else
+if (argc >= 4 && strcmp(argv[1], "-bench") == 0) {
+  out_is_stdout = (strcmp(argv[3], "-") == 0);
+  if (run_bench(argv[2], argv[3], argc - 4, argv + 4))
+    return 1;
+} else
+if (argc >= 4 && strcmp(argv[1], "-train") == 0) {
+  out_is_stdout = (strcmp(argv[3], "-") == 0);
+  if (run_train(argv[2], argv[3], argc > 4 ? argv[4] : "TRAINED"))
+    return 1;
+} else
+if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+  int preset = 0;
+  if (argc > 3)
+    preset = atoi(argv[3]);
+  if (run_batch_bench(argv[2], preset))
+    return 1;
+} else
+#if UNISHOX_BATCH_THREADS
+if (argc >= 5 && strcmp(argv[1], "-m") == 0) {
+  if (run_mt_bench(argc - 4, argv + 4, atoi(argv[2]), atoi(argv[3])))
+    return 1;
 } else
+#endif
+#if UNISHOX_STATS
+if (argc >= 3 && strcmp(argv[1], "-stats") == 0) {
+  int preset = 0;
+  if (argc > 3)
+    preset = atoi(argv[3]);
+  if (preset < 0 || 16 < preset) {
+    printf("invalid preset\n");
+    return 1;
+  }
+  if (run_stats(argv[2], preset))
+    return 1;
+} else
+#endif
 if (argc >= 2 && strcmp(argv[1], "-t") == 0) {
   return run_unit_tests(argc, argv);
 } else
@@ -895,10 +2961,46 @@ if (argc == 2 || (argc == 3 && atoi(argv[2]) > 0)) {
    printf("\n");
    printf("         [action]:\n");
    printf("         -t    run tests\n");
-   printf("         -c    compress\n");
-   printf("         -d    decompress\n");
+   printf("         -c    compress (in_file and out_file can be - for stdin / stdout)\n");
+   printf("         -ci   compress and append chunk index\n");
+   printf("         -d    decompress (preset_number needed only for files from earlier versions)\n");
    printf("         -g    generate C header file\n");
    printf("         -G    generate C header file using additional compression (slower)\n");
+   printf("         -gt   generate string table file for random access to each line (out_file is the table file)\n");
+   printf("         -b    compare time taken by batch api against one call per line (no out_file)\n");
+   printf("         -l    compare compression levels 1, 6, 9 and optimal parsing (no out_file)\n");
+   printf("         -bench  benchmark all presets (see below)\n");
+   printf("\n");
+   printf("       unishox2 -c|-ci in_file out_file [preset_number|auto] [chunk_size]\n");
+   printf("         compress chunk_size (default 4096) bytes at a time\n");
+   printf("         (auto chooses the preset for each chunk and records it, so -d needs no preset_number)\n");
+   printf("\n");
+   printf("       unishox2 -l in_file [preset_number] [chunk_size]\n");
+   printf("         compress chunk_size (default 4096) bytes at a time at each level\n");
+   printf("\n");
+   printf("       unishox2 -bench csv|json out_file [in_file ...]\n");
+   printf("         compress and decompress each line of the files and of synthetic short strings with each preset,\n");
+   printf("         writing ratio (original/compressed), MB/s, ns per string and p50/p99 latency (out_file can be -)\n");
+   printf("\n");
+   printf("       unishox2 -train in_file out_file [name]\n");
+   printf("         find hcodes and frequent sequences for the lines of in_file and write them\n");
+   printf("         as preset USX_PSET_<name> (default TRAINED) to header out_file (can be -)\n");
+   printf("\n");
+   printf("       unishox2 -dx in_file out_file chunk_number\n");
+   printf("         decompress only given chunk using chunk index\n");
+   printf("\n");
+   printf("       unishox2 -r table_file line_number\n");
+   printf("         print given line of string table generated using -gt\n");
+#if UNISHOX_BATCH_THREADS
+   printf("\n");
+   printf("       unishox2 -m max_threads preset_number in_file [in_file ...]\n");
+   printf("         time the multi-threaded batch api with 1 to max_threads threads\n");
+#endif
+#if UNISHOX_STATS
+   printf("\n");
+   printf("       unishox2 -stats in_file [preset_number]\n");
+   printf("         compress each line and print hits and bits of each encoder path\n");
+#endif
    printf("\n");
    printf("         [preset_number]:\n");
    printf("         0    Optimum - favors all including JSON, XML, URL and HTML (default)\n");
@@ -921,7 +3023,7 @@ if (argc == 2 || (argc == 3 && atoi(argv[2]) > 0)) {
    return 1;
 }
 
-printf("\nElapsed: %0.3lf ms\n", timedifference(tStart, getTimeVal()));
+fprintf(out_is_stdout ? stderr : stdout, "\nElapsed: %0.3lf ms\n", timedifference(tStart, getTimeVal()));
 
 return 0;
 
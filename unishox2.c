@@ -30,9 +30,23 @@
 #include <ctype.h>
 #include <stdint.h>
 #include <limits.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 #include "unishox2.h"
 
+#if UNISHOX_BATCH_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#if UNISHOX_TABLE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 /// uint8_t is unsigned char
 typedef unsigned char uint8_t;
 
@@ -58,7 +72,7 @@ const char * USX_TEMPLATES[] = {"tfff-of-tfTtf:rf:rf.fffZ", "tfff-of-tf", "(fff)
 enum {USX_ALPHA = 0, USX_SYM, USX_NUM, USX_DICT, USX_DELTA, USX_NUM_TEMP};
 
 /// This 2D array has the characters for the sets USX_ALPHA, USX_SYM and USX_NUM. Where a character cannot fit into a uint8_t, 0 is used and handled in code.
-uint8_t usx_sets[][28] = {{  0, ' ', 'e', 't', 'a', 'o', 'i', 'n',
+const uint8_t usx_sets[][28] = {{  0, ' ', 'e', 't', 'a', 'o', 'i', 'n',
                         's', 'r', 'l', 'c', 'd', 'h', 'u', 'p', 'm', 'b',
                         'g', 'w', 'f', 'y', 'v', 'k', 'q', 'j', 'x', 'z'},
                        {'"', '{', '}', '_', '<', '>', ':', '\n',
@@ -68,25 +82,44 @@ uint8_t usx_sets[][28] = {{  0, ' ', 'e', 't', 'a', 'o', 'i', 'n',
                         '/', '3', '4', '6', '7', '8', '(', ')', ' ',
                         '=', '+', '$', '%', '#', 0, 0, 0, 0, 0}};
 
-/// Stores position of letter in usx_sets.
-/// First 3 bits - position in usx_hcodes
+/// Flag in the codes of usx_code_94 for digits of the set USX_NUM, after which the state is USX_NUM
+#define USX_CODE_DIGIT 0x80
+/// Code of characters that are not in any of the sets
+#define USX_NO_CODE 0xFF
+
+/// Stores position of letter in usx_sets for the 94 printable characters starting from '!'. \n
+/// Upper case letters have the same position as lower case letters.
+/// First bit    - USX_CODE_DIGIT for digits in the set USX_NUM
+/// Next  2 bits - position in usx_hcodes
 /// Next  5 bits - position in usx_vcodes
-uint8_t usx_code_94[94];
+const uint8_t usx_code_94[94] = {
+  0x33, 0x20, 0x56, 0x54, 0x55, 0x31, 0x2D, 0x4F, 0x50, 0x30, 0x53, 0x41, 0x48, 0x42, 0x49, 0xC3,
+  0xC4, 0xC6, 0xCA, 0xCB, 0xC7, 0xCC, 0xCD, 0xCE, 0xC5, 0x26, 0x2C, 0x24, 0x52, 0x25, 0x32, 0x2F,
+  0x04, 0x11, 0x0B, 0x0C, 0x02, 0x14, 0x12, 0x0D, 0x06, 0x19, 0x17, 0x0A, 0x10, 0x07, 0x05, 0x0F,
+  0x18, 0x09, 0x08, 0x03, 0x0E, 0x16, 0x13, 0x1A, 0x15, 0x1B, 0x29, 0x2B, 0x2A, 0x34, 0x23, 0x38,
+  0x04, 0x11, 0x0B, 0x0C, 0x02, 0x14, 0x12, 0x0D, 0x06, 0x19, 0x17, 0x0A, 0x10, 0x07, 0x05, 0x0F,
+  0x18, 0x09, 0x08, 0x03, 0x0E, 0x16, 0x13, 0x1A, 0x15, 0x1B, 0x21, 0x35, 0x22, 0x37
+};
 
 /// Vertical codes starting from the MSB
-uint8_t usx_vcodes[]   = { 0x00, 0x40, 0x60, 0x80, 0x90, 0xA0, 0xB0,
+const uint8_t usx_vcodes[]   = { 0x00, 0x40, 0x60, 0x80, 0x90, 0xA0, 0xB0,
                         0xC0, 0xD0, 0xD8, 0xE0, 0xE4, 0xE8, 0xEC,
                         0xEE, 0xF0, 0xF2, 0xF4, 0xF6, 0xF7, 0xF8,
                         0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF };
 
 /// Length of each veritical code
-uint8_t usx_vcode_lens[] = {  2,    3,    3,    4,    4,    4,    4,
+const uint8_t usx_vcode_lens[] = {  2,    3,    3,    4,    4,    4,    4,
                            4,    5,    5,    6,    6,    6,    7,
                            7,    7,    7,    7,    8,    8,    8,
                            8,    8,    8,    8,    8,    8,    8 };
 
+/// Positions of the sets used by the format (set << 5 | vertical code), which cannot be changed by unishox2_init_ctx_sets()
+const uint8_t usx_fixed_codes[] = {0, 1, (1 << 5) + 7, (1 << 5) + 8, (1 << 5) + 14, (1 << 5) + 22, (1 << 5) + 25,
+                        (1 << 5) + 26, (1 << 5) + 27, (2 << 5), (2 << 5) + 17, (2 << 5) + 23, (2 << 5) + 24,
+                        (2 << 5) + 25, (2 << 5) + 26, (2 << 5) + 27};
+
 /// Vertical Codes and Set number for frequent sequences in sets USX_SYM and USX_NUM. First 3 bits indicate set (USX_SYM/USX_NUM) and rest are vcode positions
-uint8_t usx_freq_codes[] = {(1 << 5) + 25, (1 << 5) + 26, (1 << 5) + 27, (2 << 5) + 23, (2 << 5) + 24, (2 << 5) + 25};
+const uint8_t usx_freq_codes[] = {(1 << 5) + 25, (1 << 5) + 26, (1 << 5) + 27, (2 << 5) + 23, (2 << 5) + 24, (2 << 5) + 25};
 
 /// Not used
 const int UTF8_MASK[] = {0xE0, 0xF0, 0xF8};
@@ -134,62 +167,256 @@ const int UTF8_PREFIX[] = {0xC0, 0xE0, 0xF0};
 /// Offset at which usx_code_94 starts
 #define USX_OFFSET_94 33
 
-/// global to indicate whether initialization is complete or not
-uint8_t is_inited = 0;
-
-/// Fills the usx_code_94 94 letter array based on sets of characters at usx_sets \n
-/// For each element in usx_code_94, first 3 msb bits is set (USX_ALPHA / USX_SYM / USX_NUM) \n
-/// and the rest 5 bits indicate the vertical position in the corresponding set
-void init_coder() {
-  if (is_inited)
-    return;
-  memset(usx_code_94, '\0', sizeof(usx_code_94));
-  for (int i = 0; i < 3; i++) {
-    for (int j = 0; j < 28; j++) {
-      uint8_t c = usx_sets[i][j];
-      if (c > 32) {
-        usx_code_94[c - USX_OFFSET_94] = (i << 5) + j;
-        if (c >= 'a' && c <= 'z')
-          usx_code_94[c - USX_OFFSET_94 - ('a' - 'A')] = (i << 5) + j;
+/// Returns the classes of nibbles ch belongs to as bits, \n
+/// 1 for '0' to '1', 2 for '2' to '3', 4 for '4' to '7', 8 for '8' to '9', \n
+/// 0x10 for 'a' to 'f', 0x20 for 'A' to 'F' and 0 otherwise
+static inline uint8_t usx_nibble_classes(char ch) {
+  if (ch >= '0' && ch <= '9')
+    return ch < '2' ? 0x01 : (ch < '4' ? 0x02 : (ch < '8' ? 0x04 : 0x08));
+  if (ch >= 'a' && ch <= 'f')
+    return 0x10;
+  if (ch >= 'A' && ch <= 'F')
+    return 0x20;
+  return 0;
+}
+
+/// Returns the nibble classes (see usx_nibble_classes()) matched by template character c_t, \n
+/// 'f' and 'F' for hex digits, 'r' for '0' to '7', 't' for '0' to '3', 'o' for '0' to '1', \n
+/// or 0 if c_t only matches itself
+static inline uint8_t usx_template_classes(char c_t) {
+  switch (c_t) {
+    case 'f': return 0x1F;
+    case 'F': return 0x2F;
+    case 'r': return 0x07;
+    case 't': return 0x03;
+    case 'o': return 0x01;
+  }
+  return 0;
+}
+
+/// Returns whether c_in is matched by template character c_t
+static inline int usx_template_char_matches(char c_t, char c_in) {
+  const uint8_t classes = usx_template_classes(c_t);
+  return classes ? (usx_nibble_classes(c_in) & classes) != 0 : c_t == c_in;
+}
+
+/// Finds the length of each template of the context, the minimum number of its characters \n
+/// to be matched for using it and the characters that can start a template, \n
+/// so that the encoder need not go through the templates at every position
+void usx_compile_templates(struct unishox2_ctx *ctx) {
+  memset(ctx->usx_template_starts, 0, sizeof(ctx->usx_template_starts));
+  for (int i = 0; i < 5; i++) {
+    const char *tmpl = (ctx->usx_templates ? ctx->usx_templates[i] : NULL);
+    size_t tlen = (tmpl ? strlen(tmpl) : 0);
+    if (tlen > USHRT_MAX)
+      tlen = 0;
+    ctx->usx_template_lens[i] = (unsigned short) tlen;
+    ctx->usx_template_min_lens[i] = 0;
+    if (tlen == 0)
+      continue;
+    // Template is used if more than 66% of it matches
+    int min_len = 1;
+    while (((float)min_len / tlen) <= 0.66)
+      min_len++;
+    ctx->usx_template_min_lens[i] = (unsigned short) min_len;
+    const uint8_t c_t = (uint8_t) tmpl[0];
+    if (usx_template_classes(c_t)) {
+      for (const char *c = "0123456789abcdefABCDEF"; *c; c++) {
+        if (usx_template_char_matches(c_t, *c))
+          ctx->usx_template_starts[*c >> 3] |= (1 << (*c & 7));
       }
+    } else
+      ctx->usx_template_starts[c_t >> 3] |= (1 << (c_t & 7));
+  }
+}
+
+/// Finds the length of each frequent sequence of the context that can be encoded \n
+/// and the characters that start them, so that the encoder looks for them \n
+/// only at positions having one of those characters
+void usx_compile_freq_seq(struct unishox2_ctx *ctx) {
+  memset(ctx->usx_freq_seq_starts, 0, sizeof(ctx->usx_freq_seq_starts));
+  for (int i = 0; i < 6; i++) {
+    const char *seq = (ctx->usx_freq_seq ? ctx->usx_freq_seq[i] : NULL);
+    size_t seq_len = (seq ? strlen(seq) : 0);
+    if (seq_len > USHRT_MAX || !ctx->usx_hcode_lens[usx_freq_codes[i] >> 5])
+      seq_len = 0;
+    ctx->usx_freq_seq_lens[i] = (unsigned short) seq_len;
+    if (seq_len)
+      ctx->usx_freq_seq_starts[(uint8_t) seq[0] >> 3] |= (1 << (seq[0] & 7));
+  }
+}
+
+/// Checks the given sets and derives from them the code of each character for the encoder. \n
+/// Returns -1 if a position used by the format is changed or a character is not valid or appears twice
+int usx_compile_sets(struct unishox2_ctx *ctx, const uint8_t sets[][28]) {
+  uint8_t is_fixed[3][28];
+  memset(is_fixed, 0, sizeof(is_fixed));
+  for (size_t i = 0; i < sizeof(usx_fixed_codes); i++) {
+    const uint8_t h = usx_fixed_codes[i] >> 5;
+    const uint8_t v = usx_fixed_codes[i] & 0x1F;
+    if (sets[h][v] != usx_sets[h][v])
+      return -1;
+    is_fixed[h][v] = 1;
+  }
+  memset(ctx->usx_code_94, USX_NO_CODE, sizeof(ctx->usx_code_94));
+  memset(ctx->usx_code_latin1, USX_NO_CODE, sizeof(ctx->usx_code_latin1));
+  for (int h = 0; h < 3; h++) {
+    for (int v = 0; v < 28; v++) {
+      const uint8_t c = sets[h][v];
+      if (is_fixed[h][v] || c == 0)
+        continue;
+      uint8_t *code = NULL;
+      if (c >= 0x80)
+        code = &ctx->usx_code_latin1[c - 0x80];
+      else if (c > ' ' && c < 0x7F && (c < 'A' || c > 'Z'))
+        code = &ctx->usx_code_94[c - USX_OFFSET_94];
+      if (code == NULL || *code != USX_NO_CODE)
+        return -1;
+      *code = (h << 5) | v | (h == USX_NUM && c >= '0' && c <= '9' ? USX_CODE_DIGIT : 0);
     }
   }
-  is_inited = 1;
+  // upper case letters are encoded as the small letter after a switch to USX_ALPHA, so only for those in USX_ALPHA
+  for (int c = 'a'; c <= 'z'; c++) {
+    if ((ctx->usx_code_94[c - USX_OFFSET_94] >> 5) == USX_ALPHA)
+      ctx->usx_code_94[c - 32 - USX_OFFSET_94] = ctx->usx_code_94[c - USX_OFFSET_94];
+  }
+  memcpy(ctx->usx_sets, sets, sizeof(ctx->usx_sets));
+  return 0;
 }
 
-/// Mask for retrieving each code to be encoded according to its length
-unsigned int usx_mask[] = {0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE, 0xFF};
+/// Returns the code in the sets of the context of the character from U+0080 to U+00FF at in[l], \n
+/// or of its small letter, setting is_upper, if it is a capital letter and the small letter is in USX_ALPHA. \n
+/// Returns USX_NO_CODE for characters not in the sets
+static inline uint8_t usx_latin1_code(const char *in, int len, int l, const struct unishox2_ctx *ctx, uint8_t *is_upper) {
+  if (((uint8_t) in[l] & 0xFE) != 0xC2 || l + 1 >= len || (in[l + 1] & 0xC0) != 0x80)
+    return USX_NO_CODE;
+  const int c = ((in[l] & 0x01) << 6) | (in[l + 1] & 0x3F); // code point - 0x80
+  uint8_t code = ctx->usx_code_latin1[c];
+  if (code == USX_NO_CODE && c >= 0x40 && c < 0x5F && c != 0x57) { // U+00C0 to U+00DE except U+00D7
+    code = ctx->usx_code_latin1[c + 0x20];
+    if ((code >> 5) != USX_ALPHA)
+      return USX_NO_CODE;
+    *is_upper = 1;
+  }
+  return code;
+}
 
-/// Appends specified number of bits to the output (out) \n
-/// If maximum limit (olen) is reached, -1 is returned \n
-/// Otherwise clen bits in code are appended to out starting with MSB
-int append_bits(char *out, int olen, int ol, uint8_t code, int clen) {
+/// Sets the parameters of the context without building the lookup tables derived from them. \n
+/// Used by the API functions that are passed the parameters on every call
+void usx_set_ctx_params(struct unishox2_ctx *ctx, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[], const char *usx_freq_seq[], const char *usx_templates[]) {
+  memcpy(ctx->usx_hcodes, usx_hcodes, sizeof(ctx->usx_hcodes));
+  memcpy(ctx->usx_hcode_lens, usx_hcode_lens, sizeof(ctx->usx_hcode_lens));
+  ctx->usx_freq_seq = usx_freq_seq;
+  ctx->usx_templates = usx_templates;
+  ctx->has_custom_sets = 0;
+  usx_compile_templates(ctx);
+  usx_compile_freq_seq(ctx);
+#if UNISHOX_DECODE_LOOKUP_TABLES
+  ctx->has_hcode_lookup = 0;
+#endif
+#if UNISHOX_ENCODE_LOOKUP_TABLES
+  ctx->has_emit_table = 0;
+#endif
+}
 
+/// Bit writer used by the encoder. Bits are collected MSB first in a 64-bit \n
+/// accumulator and written to out as whole bytes only when the accumulator is full, \n
+/// so that the output length is checked once per flush and not once per code. \n
+/// If out is NULL, bits are only counted and nothing is written
+struct usx_bit_writer {
+  char *out;      ///< output buffer, NULL for counting only
+  int olen;       ///< length of output buffer in bytes
+  int ol;         ///< number of bits appended so far, -1 once olen is exceeded
+  int flushed;    ///< number of bytes of out already written from acc
+  uint64_t acc;   ///< pending bits starting at byte 'flushed', MSB aligned
+#if UNISHOX_STATS
+  struct unishox2_stats *stats; ///< counters of the caller updated while writing to out, or NULL
+#endif
+};
 
-  //printf("%d,%x,%d,%d\n", ol, code, clen, state);
+/// Initializes the bit writer to write to out, not exceeding olen bytes
+void usx_bw_init(struct usx_bit_writer *bw, char *out, int olen) {
+  bw->out = out;
+  bw->olen = olen;
+  bw->ol = 0;
+  bw->flushed = 0;
+  bw->acc = 0;
+#if UNISHOX_STATS
+  bw->stats = NULL;
+#endif
+}
 
-  while (clen > 0) {
-    int oidx;
-    unsigned char a_byte;
+/// Writes complete bytes pending in the accumulator to out. \n
+/// If partial is non-zero, the last incomplete byte is also written, \n
+/// but is retained in the accumulator so that more bits can be appended to it. \n
+/// If maximum limit (olen) is reached, bytes that fit are written and -1 is returned
+int usx_bw_flush(struct usx_bit_writer *bw, int partial) {
+  int pending = bw->ol - (bw->flushed << 3);
+  int nbytes = pending >> 3;
+  int ret = bw->ol;
+  partial = (partial && (pending & 7));
+  if (bw->flushed + nbytes + partial > bw->olen) {
+    partial = 0;
+    if (nbytes > bw->olen - bw->flushed)
+      nbytes = (bw->olen > bw->flushed ? bw->olen - bw->flushed : 0);
+    ret = bw->ol = -1;
+  }
+  uint64_t acc = bw->acc;
+  if (bw->out == NULL) {
+    acc = (nbytes < 8 ? acc << (nbytes << 3) : 0);
+  } else {
+    char *o = bw->out + bw->flushed;
+    for (int i = 0; i < nbytes; i++) {
+      o[i] = (char) (acc >> 56);
+      acc <<= 8;
+    }
+    if (partial)
+      o[nbytes] = (char) (acc >> 56);
+  }
+  bw->flushed += nbytes;
+  bw->acc = acc;
+  return ret;
+}
 
-    uint8_t cur_bit = ol % 8;
-    uint8_t blen = clen;
-    a_byte = code & usx_mask[blen - 1];
-    a_byte >>= cur_bit;
-    if (blen + cur_bit > 8)
-      blen = (8 - cur_bit);
-    oidx = ol / 8;
-    if (oidx < 0 || olen <= oidx)
+/// Appends the lower len bits of val to the output, MSB first. len should not exceed 32 \n
+/// If maximum limit (olen) is reached when flushing, -1 is returned \n
+/// Otherwise the number of bits written so far is returned
+int usx_bw_put(struct usx_bit_writer *bw, uint32_t val, int len) {
+  if (len <= 0)
+    return bw->ol;
+  int pending = bw->ol - (bw->flushed << 3);
+  if (pending + len > 64) {
+    if (usx_bw_flush(bw, 0) < 0)
       return -1;
-    if (cur_bit == 0)
-      out[oidx] = a_byte;
-    else
-      out[oidx] |= a_byte;
-    code <<= blen;
-    ol += blen;
-    clen -= blen;
+    pending &= 7;
   }
-  return ol;
+  bw->acc |= ((uint64_t) val) << (64 - pending - len);
+  bw->ol += len;
+  return bw->ol;
+}
+
+/// Moves the write position back to bit position pos, discarding what was written after it. \n
+/// As with the writes that follow, the bits of the byte at pos are left as is and \n
+/// new bits are OR'ed into it, while subsequent bytes are overwritten.
+int usx_bw_seek(struct usx_bit_writer *bw, int pos) {
+  if (pos < (bw->flushed << 3)) {
+    if (usx_bw_flush(bw, 1) < 0)
+      return -1;
+    bw->flushed = pos >> 3;
+    bw->acc = ((pos & 7) && bw->out) ? ((uint64_t) (uint8_t) bw->out[bw->flushed]) << 56 : 0;
+  } else {
+    int keep = ((pos - (bw->flushed << 3)) + 7) >> 3;
+    bw->acc = keep ? bw->acc & (~(uint64_t) 0 << (64 - (keep << 3))) : 0;
+  }
+  bw->ol = pos;
+  return pos;
+}
+
+/// Appends specified number of bits to the output (out) \n
+/// If maximum limit (olen) is reached, -1 is returned \n
+/// Otherwise clen bits in code are appended to out starting with MSB
+int append_bits(struct usx_bit_writer *bw, uint8_t code, int clen) {
+  return usx_bw_put(bw, code >> (8 - clen), clen);
 }
 
 /// This is a safe call to append_bits() making sure it does not write past olen
@@ -198,45 +425,102 @@ int append_bits(char *out, int olen, int ol, uint8_t code, int clen) {
   if (newidx < 0) return newidx; \
 } while (0)
 
+#if UNISHOX_STATS
+/// Adds the bits written since bit position *from to the given path of the caller's counters \n
+/// and moves *from to the current position. \n
+/// Nothing is counted if only the length is being found (out is NULL)
+static inline void usx_stat_add(const struct usx_bit_writer *bw, int path, int hit, int *from) {
+  if (bw->stats && bw->out && bw->ol >= 0) {
+    bw->stats->hits[path] += hit;
+    bw->stats->bits[path] += bw->ol - *from;
+  }
+  *from = bw->ol;
+}
+/// Counts a string compressed to out
+static inline void usx_stat_string(const struct usx_bit_writer *bw, int len, int bits) {
+  if (bw->stats && bw->out) {
+    bw->stats->calls++;
+    bw->stats->bytes_in += len;
+    bw->stats->bits_out += bits;
+  }
+}
+#define USX_STAT_MARK(bw) (stat_ol = (bw).ol)
+#define USX_STAT_ADD(bw, path, hit) usx_stat_add(&(bw), (path), (hit), &stat_ol)
+#else
+#define USX_STAT_MARK(bw) ((void) 0)
+#define USX_STAT_ADD(bw, path, hit) ((void) 0)
+#endif
+
 /// Appends switch code to out depending on the state (USX_DELTA or other)
-int append_switch_code(char *out, int olen, int ol, uint8_t state) {
+int append_switch_code(struct usx_bit_writer *bw, uint8_t state) {
   if (state == USX_DELTA) {
-    SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, UNI_STATE_SPL_CODE, UNI_STATE_SPL_CODE_LEN));
-    SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, UNI_STATE_SW_CODE, UNI_STATE_SW_CODE_LEN));
+    SAFE_APPEND_BITS(append_bits(bw, UNI_STATE_SPL_CODE, UNI_STATE_SPL_CODE_LEN));
+    SAFE_APPEND_BITS(append_bits(bw, UNI_STATE_SW_CODE, UNI_STATE_SW_CODE_LEN));
   } else
-    SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, SW_CODE, SW_CODE_LEN));
-  return ol;
+    SAFE_APPEND_BITS(append_bits(bw, SW_CODE, SW_CODE_LEN));
+#if UNISHOX_STATS
+  if (bw->stats && bw->out) {
+    bw->stats->switches++;
+    bw->stats->switch_bits += (state == USX_DELTA ? UNI_STATE_SPL_CODE_LEN + UNI_STATE_SW_CODE_LEN : SW_CODE_LEN);
+  }
+#endif
+  return bw->ol;
 }
 
 /// Appends given horizontal and veritical code bits to out
-int append_code(char *out, int olen, int ol, uint8_t code, uint8_t *state, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[]) {
-  uint8_t hcode = code >> 5;
+int append_code(struct usx_bit_writer *bw, uint8_t code, uint8_t *state, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[]) {
+  uint8_t hcode = (code >> 5) & 0x03;
   uint8_t vcode = code & 0x1F;
   if (!usx_hcode_lens[hcode] && hcode != USX_ALPHA)
-    return ol;
+    return bw->ol;
   switch (hcode) {
     case USX_ALPHA:
       if (*state != USX_ALPHA) {
-        SAFE_APPEND_BITS(ol = append_switch_code(out, olen, ol, *state));
-        SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
+        SAFE_APPEND_BITS(append_switch_code(bw, *state));
+        SAFE_APPEND_BITS(append_bits(bw, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
         *state = USX_ALPHA;
       }
       break;
     case USX_SYM:
-      SAFE_APPEND_BITS(ol = append_switch_code(out, olen, ol, *state));
-      SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, usx_hcodes[USX_SYM], usx_hcode_lens[USX_SYM]));
+      SAFE_APPEND_BITS(append_switch_code(bw, *state));
+      SAFE_APPEND_BITS(append_bits(bw, usx_hcodes[USX_SYM], usx_hcode_lens[USX_SYM]));
       break;
     case USX_NUM:
       if (*state != USX_NUM) {
-        SAFE_APPEND_BITS(ol = append_switch_code(out, olen, ol, *state));
-        SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, usx_hcodes[USX_NUM], usx_hcode_lens[USX_NUM]));
-        if (usx_sets[hcode][vcode] >= '0' && usx_sets[hcode][vcode] <= '9')
+        SAFE_APPEND_BITS(append_switch_code(bw, *state));
+        SAFE_APPEND_BITS(append_bits(bw, usx_hcodes[USX_NUM], usx_hcode_lens[USX_NUM]));
+        if (code & USX_CODE_DIGIT)
           *state = USX_NUM;
       }
   }
-  SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, usx_vcodes[vcode], usx_vcode_lens[vcode]));
-  return ol;
+  return append_bits(bw, usx_vcodes[vcode], usx_vcode_lens[vcode]);
+}
+
+#if UNISHOX_ENCODE_LOOKUP_TABLES
+/// Builds the emission table of the context, having for each state in which literals are encoded \n
+/// (USX_ALPHA, USX_NUM, USX_DELTA) and each printable character (c - 32) the bits appended for it \n
+/// by append_code() including any switch code, as code << 8 | length << 3 | next state
+void usx_build_emit_table(struct unishox2_ctx *ctx) {
+  const uint8_t *code_94 = ctx->has_custom_sets ? ctx->usx_code_94 : usx_code_94;
+  struct usx_bit_writer bw;
+  for (int s = 0; s < 3; s++) {
+    for (int c = 0; c < 95; c++) {
+      uint8_t state = s << 1;
+      usx_bw_init(&bw, NULL, INT_MAX);
+      if (c == 0) {
+        if (state == USX_NUM)
+          append_bits(&bw, usx_vcodes[NUM_SPC_CODE & 0x1F], usx_vcode_lens[NUM_SPC_CODE & 0x1F]);
+        else
+          append_bits(&bw, usx_vcodes[1], usx_vcode_lens[1]);
+      } else if (code_94[c - 1] != USX_NO_CODE)
+        append_code(&bw, code_94[c - 1], &state, ctx->usx_hcodes, ctx->usx_hcode_lens);
+      const uint32_t code = bw.ol ? (uint32_t) (bw.acc >> (64 - bw.ol)) : 0;
+      ctx->emit_table[s][c] = (code << 8) | (bw.ol << 3) | state;
+    }
+  }
+  ctx->has_emit_table = 1;
 }
+#endif
 
 /// Length of bits used to represent count for each level
 const uint8_t count_bit_lens[5] = {2, 4, 7, 11, 16};
@@ -245,21 +529,26 @@ const int32_t count_adder[5] = {4, 20, 148, 2196, 67732};
 /// Codes used to specify the level that the count belongs to
 const uint8_t count_codes[] = {0x01, 0x82, 0xC3, 0xE4, 0xF4};
 /// Encodes given count to out
-int encodeCount(char *out, int olen, int ol, int count) {
+int encodeCount(struct usx_bit_writer *bw, int count) {
   // First five bits are code and Last three bits of codes represent length
   for (int i = 0; i < 5; i++) {
     if (count < count_adder[i]) {
-      SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, (count_codes[i] & 0xF8), count_codes[i] & 0x07));
-      uint16_t count16 = (count - (i ? count_adder[i - 1] : 0)) << (16 - count_bit_lens[i]);
-      if (count_bit_lens[i] > 8) {
-        SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, count16 >> 8, 8));
-        SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, count16 & 0xFF, count_bit_lens[i] - 8));
-      } else
-        SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, count16 >> 8, count_bit_lens[i]));
-      return ol;
+      const int code_len = count_codes[i] & 0x07;
+      uint32_t val = (uint32_t) (count_codes[i] >> (8 - code_len)) << count_bit_lens[i];
+      val |= (count - (i ? count_adder[i - 1] : 0)) & ((1 << count_bit_lens[i]) - 1);
+      return usx_bw_put(bw, val, code_len + count_bit_lens[i]);
     }
   }
-  return ol;
+  return bw->ol;
+}
+
+/// Returns the number of bits used by encodeCount() for count, 0 if it cannot be encoded
+int usx_count_bits(int count) {
+  for (int i = 0; i < 5; i++) {
+    if (count < count_adder[i])
+      return (count_codes[i] & 0x07) + count_bit_lens[i];
+  }
+  return 0;
 }
 
 /// Length of bits used to represent delta code for each level
@@ -268,7 +557,7 @@ const uint8_t uni_bit_len[5] = {6, 12, 14, 16, 21};
 const int32_t uni_adder[5] = {0, 64, 4160, 20544, 86080};
 
 /// Encodes the unicode code point given by code to out. prev_code is used to calculate the delta
-int encodeUnicode(char *out, int olen, int ol, int32_t code, int32_t prev_code) {
+int encodeUnicode(struct usx_bit_writer *bw, int32_t code, int32_t prev_code) {
   // First five bits are code and Last three bits of codes represent length
   //const uint8_t codes[8] = {0x00, 0x42, 0x83, 0xA3, 0xC3, 0xE4, 0xF5, 0xFD};
   const uint8_t codes[6] = {0x01, 0x82, 0xC3, 0xE4, 0xF5, 0xFD};
@@ -281,29 +570,17 @@ int encodeUnicode(char *out, int olen, int ol, int32_t code, int32_t prev_code)
   for (int i = 0; i < 5; i++) {
     till += (1 << uni_bit_len[i]);
     if (diff < till) {
-      SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, (codes[i] & 0xF8), codes[i] & 0x07));
-      //if (diff) {
-        SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, prev_code > code ? 0x80 : 0, 1));
-        int32_t val = diff - uni_adder[i];
-        //printf("Val: %d\n", val);
-        if (uni_bit_len[i] > 16) {
-          val <<= (24 - uni_bit_len[i]);
-          SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, val >> 16, 8));
-          SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, (val >> 8) & 0xFF, 8));
-          SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, val & 0xFF, uni_bit_len[i] - 16));
-        } else
-        if (uni_bit_len[i] > 8) {
-          val <<= (16 - uni_bit_len[i]);
-          SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, val >> 8, 8));
-          SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, val & 0xFF, uni_bit_len[i] - 8));
-        } else {
-          val <<= (8 - uni_bit_len[i]);
-          SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, val & 0xFF, uni_bit_len[i]));
-        }
-      return ol;
+      // step code, sign bit and delta are appended together
+      const int code_len = codes[i] & 0x07;
+      uint32_t val = (uint32_t) (codes[i] >> (8 - code_len)) << 1;
+      val |= (prev_code > code ? 1 : 0);
+      val <<= uni_bit_len[i];
+      val |= (uint32_t) (diff - uni_adder[i]) & ((1 << uni_bit_len[i]) - 1);
+      //printf("Val: %d\n", diff - uni_adder[i]);
+      return usx_bw_put(bw, val, code_len + 1 + uni_bit_len[i]);
     }
   }
-  return ol;
+  return bw->ol;
 }
 
 /// Reads UTF-8 character from in. Also returns the number of bytes occupied by the UTF-8 character in utf8len
@@ -344,20 +621,127 @@ int32_t readUTF8(const char *in, int len, int l, int *utf8len) {
   return ret;
 }
 
-/// Finds the longest matching sequence from the beginning of the string. \n
-/// If a match is found and it is longer than NICE_LEN, it is encoded as a repeating sequence to out \n
-/// This is also used for Unicode strings \n
-/// This is a crude implementation that is not optimized.  Assuming only short strings \n
-/// are encoded, this is not much of an issue.
-int matchOccurance(const char *in, int len, int l, char *out, int olen, int *ol, uint8_t *state, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[]) {
+/// Strings shorter than this are searched for repeats by scanning back from each position
+#define USX_MATCH_INDEX_MIN_LEN 64
+/// Number of bits of the hash of NICE_LEN bytes used to index the match finder head table
+#define USX_MATCH_HASH_BITS 12
+
+/// Hash chain index of the positions of the input string, used to find repeats in longer strings. \n
+/// head has the latest position plus base for each hash of the NICE_LEN bytes at that position \n
+/// and prev has the position before each position having the same hash, or a negative number. \n
+/// Positions of earlier strings indexed are below base, so the index can be reused without clearing head
+struct usx_match_index {
+  int *head;
+  int *prev;
+  int next_pos;
+  int base;
+};
+
+/// 32 bit hash of the NICE_LEN bytes at given position. The upper bits are the best mixed
+static inline uint32_t usx_nice_len_hash(const char *in) {
+  uint32_t h = (uint8_t) in[0] | ((uint8_t) in[1] << 8) | ((uint8_t) in[2] << 16) | ((uint32_t) (uint8_t) in[3] << 24);
+  return (h ^ ((uint8_t) in[4] * 0x9E3779B1u)) * 0x85EBCA6Bu;
+}
+
+/// Hash of the NICE_LEN bytes at given position
+static inline int usx_match_hash(const char *in) {
+  return (int) (usx_nice_len_hash(in) >> (32 - USX_MATCH_HASH_BITS));
+}
+
+/// Allocates the index for strings of length upto len. Returns 0 if there is not enough memory
+int usx_match_index_init(struct usx_match_index *mi, int len) {
+  const int head_size = 1 << USX_MATCH_HASH_BITS;
+  mi->head = (int *) malloc((head_size + (size_t) len) * sizeof(int));
+  if (mi->head == NULL)
+    return 0;
+  mi->prev = mi->head + head_size;
+  for (int i = 0; i < head_size; i++)
+    mi->head[i] = -1;
+  mi->next_pos = 0;
+  mi->base = 0;
+  return 1;
+}
+
+/// Empties the index for the next string, by moving base past the positions added so far. \n
+/// head is cleared only when base would grow too large
+void usx_match_index_reset(struct usx_match_index *mi) {
+  if (mi->base > INT_MAX / 2 - mi->next_pos) {
+    for (int i = 0; i < (1 << USX_MATCH_HASH_BITS); i++)
+      mi->head[i] = -1;
+    mi->base = 0;
+  } else
+    mi->base += mi->next_pos;
+  mi->next_pos = 0;
+}
+
+/// Latest position added having the same hash as the NICE_LEN bytes at in, or a negative number
+static inline int usx_match_head(const struct usx_match_index *mi, const char *in) {
+  return mi->head[usx_match_hash(in)] - mi->base;
+}
+
+/// Adds positions upto and including last to the index
+void usx_match_index_add(struct usx_match_index *mi, const char *in, int last) {
+  for (int j = mi->next_pos; j <= last; j++) {
+    const int h = usx_match_hash(in + j);
+    mi->prev[j] = mi->head[h] - mi->base;
+    mi->head[h] = mi->base + j;
+  }
+  if (mi->next_pos <= last)
+    mi->next_pos = last + 1;
+}
+
+/// Appends a repeat of the sequence at distance dist + NICE_LEN - 1 having length len + NICE_LEN
+int append_repeat(struct usx_bit_writer *bw, uint8_t state, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[], int len, int dist) {
+  SAFE_APPEND_BITS(append_switch_code(bw, state));
+  SAFE_APPEND_BITS(append_bits(bw, usx_hcodes[USX_DICT], usx_hcode_lens[USX_DICT]));
+  SAFE_APPEND_BITS(encodeCount(bw, len));
+  return encodeCount(bw, dist);
+}
+
+/// Effort spent by the encoder for finding repeats at a compression level
+struct usx_effort {
+  int chain_depth;  ///< earlier positions tried for each repeat, 0 for no limit, -1 for not finding repeats
+  int max_lines;    ///< previous lines searched for each repeat by matchLine(), 0 for no limit
+  int lazy;         ///< whether a repeat is deferred if the one at the next position is longer
+};
+
+/// Effort for each compression level from UNISHOX_LEVEL_FASTEST to UNISHOX_LEVEL_MAX
+static const struct usx_effort usx_efforts[] = {
+  {-1, 0, 0}, {1, 1, 0}, {4, 2, 0}, {16, 4, 0}, {64, 8, 0},
+  {UNISHOX_MATCH_CHAIN_DEPTH, 0, 0}, {0, 0, 0}, {0, 0, 0}, {0, 0, 1}
+};
+
+/// Returns the effort for the compression level in params, the default if params is NULL
+static inline const struct usx_effort *usx_get_effort(const struct unishox2_params *params) {
+  int level = (params && params->level ? params->level : UNISHOX_LEVEL_DEFAULT);
+  if (level < UNISHOX_LEVEL_FASTEST)
+    level = UNISHOX_LEVEL_FASTEST;
+  if (level > UNISHOX_LEVEL_MAX)
+    level = UNISHOX_LEVEL_MAX;
+  return &usx_efforts[level - 1];
+}
+
+/// Finds the longest sequence at l repeating an earlier one, trying upto chain_depth earlier positions \n
+/// (no limit if 0). Without mi, only the positions starting with the same NICE_LEN bytes are counted as tries, \n
+/// as the index would have only those, so that short strings also find their repeats at low levels. \n
+/// Returns its length less NICE_LEN, 0 if not longer than NICE_LEN, and sets dist to its distance
+int usx_find_repeat(const char *in, int len, int l, struct usx_match_index *mi, int chain_depth, int *dist) {
   int j, k;
   int longest_dist = 0;
   int longest_len = 0;
-  for (j = l - NICE_LEN; j >= 0; j--) {
+  int tries = 0;
+  if (mi) {
+    usx_match_index_add(mi, in, l - NICE_LEN);
+    j = (l < NICE_LEN ? -1 : usx_match_head(mi, in + l));
+  } else
+    j = l - NICE_LEN;
+  for (; j >= 0; j = (mi ? mi->prev[j] : j - 1)) {
     for (k = l; k < len && j + k - l < l; k++) {
       if (in[k] != in[j + k - l])
         break;
     }
+    const int reached_end = (k == len);
+    const int is_try = (mi || k - l >= NICE_LEN);
     while ((((unsigned char) in[k]) >> 6) == 2)
       k--; // Skip partial UTF-8 matches
     //if ((in[k - 1] >> 3) == 0x1E || (in[k - 1] >> 4) == 0x0E || (in[k - 1] >> 5) == 0x06)
@@ -370,13 +754,34 @@ int matchOccurance(const char *in, int len, int l, char *out, int olen, int *ol,
           longest_dist = match_dist;
       }
     }
+    if (reached_end)
+      break; // positions further back cannot give a longer match
+    if (chain_depth && is_try && ++tries >= chain_depth)
+      break;
+  }
+  *dist = longest_dist;
+  return longest_len;
+}
+
+/// Finds the longest matching sequence from the beginning of the string. \n
+/// If a match is found and it is longer than NICE_LEN, it is encoded as a repeating sequence to out \n
+/// This is also used for Unicode strings \n
+/// If mi is NULL, every earlier position is tried, which is fine for short strings. \n
+/// Otherwise only earlier positions having the same hash are tried, nearest first as in the scan, \n
+/// so the match found is the same unless the chain depth of the effort limits the number of tries. \n
+/// If the effort is lazy, the repeat is not used if a longer one starts at the next position.
+int matchOccurance(const char *in, int len, int l, struct usx_bit_writer *bw, uint8_t *state, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[], struct usx_match_index *mi, const struct usx_effort *effort) {
+  int longest_dist;
+  const int longest_len = usx_find_repeat(in, len, l, mi, effort->chain_depth, &longest_dist);
+  if (longest_len && effort->lazy && l + 1 < len - NICE_LEN + 1) {
+    int next_dist;
+    // leave for the next position, having the character at l as literal
+    if (usx_find_repeat(in, len, l + 1, mi, effort->chain_depth, &next_dist) > longest_len)
+      return -l;
   }
   if (longest_len) {
-    SAFE_APPEND_BITS(*ol = append_switch_code(out, olen, *ol, *state));
-    SAFE_APPEND_BITS(*ol = append_bits(out, olen, *ol, usx_hcodes[USX_DICT], usx_hcode_lens[USX_DICT]));
     //printf("Len:%d / Dist:%d/%.*s\n", longest_len, longest_dist, longest_len + NICE_LEN, in + l - longest_dist - NICE_LEN + 1);
-    SAFE_APPEND_BITS(*ol = encodeCount(out, olen, *ol, longest_len));
-    SAFE_APPEND_BITS(*ol = encodeCount(out, olen, *ol, longest_dist));
+    SAFE_APPEND_BITS(append_repeat(bw, *state, usx_hcodes, usx_hcode_lens, longest_len, longest_dist));
     l += (longest_len + NICE_LEN);
     l--;
     return l;
@@ -384,14 +789,125 @@ int matchOccurance(const char *in, int len, int l, char *out, int olen, int *ol,
   return -l;
 }
 
+/// Repeats chosen beforehand for the encoder by usx_plan_repeats()
+struct usx_plan {
+  int *rep_len;     ///< length less NICE_LEN of the repeat to be used at each position, -1 for none
+  int *rep_dist;    ///< distance code of the repeat to be used at each position
+  int *pos_bits;    ///< if not NULL, set to the number of bits written before each position encoded, -1 for others
+};
+
+/// Maximum number of earlier positions tried at each position when planning repeats
+#define USX_PLAN_CHAIN_DEPTH 256
+/// Lengths upto this are all tried for each repeat when planning, longer repeats are tried only at full length
+#define USX_PLAN_ALL_LENS 64
+/// Costs are planned in units of 1/16 bit, so that bits spread over a sequence need no floating point
+#define USX_PLAN_COST_SCALE 16
+
+/// Chooses the repeats of in having the least total bits, from the bits of each position \n
+/// when encoded without repeats (pos_bits, as set by the encoder for plan->pos_bits) \n
+/// and the exact bits of the codes of each repeat. \n
+/// Going forward from the start, the least bits for reaching each position is found by \n
+/// either encoding the character before it or a repeat ending at it, \n
+/// and then the repeats are taken going back from the end. \n
+/// Returns 0 if there is not enough memory or the costs of in would not fit in 32 bits
+int usx_plan_repeats(const char *in, int len, const int *pos_bits, int dict_bits, struct usx_plan *plan) {
+  if (pos_bits[len] > INT32_MAX / USX_PLAN_COST_SCALE / 2)
+    return 0;
+  int32_t *cost = (int32_t *) malloc((len + 1) * (sizeof(int32_t) * 2 + sizeof(int) * 2));
+  if (cost == NULL)
+    return 0;
+  int32_t *lit_bits = cost + len + 1;
+  int *from = (int *) (lit_bits + len + 1);
+  int *from_dist = from + len + 1;
+  struct usx_match_index mi;
+  struct usx_match_index *mip = NULL;
+  if (len >= USX_MATCH_INDEX_MIN_LEN && usx_match_index_init(&mi, len))
+    mip = &mi;
+  // bits of positions not encoded separately are spread evenly over the sequence having them
+  for (int l = 0; l <= len; ) {
+    int next = l + 1;
+    while (next < len && pos_bits[next] < 0)
+      next++;
+    for (int k = l + 1; k <= next && k <= len; k++)
+      lit_bits[k] = (int32_t) pos_bits[l] * USX_PLAN_COST_SCALE
+                  + (int32_t) ((int64_t) (pos_bits[next] - pos_bits[l]) * USX_PLAN_COST_SCALE * (k - l) / (next - l));
+    lit_bits[l] = (int32_t) pos_bits[l] * USX_PLAN_COST_SCALE;
+    l = next;
+  }
+  cost[0] = 0;
+  for (int l = 1; l <= len; l++)
+    cost[l] = INT32_MAX;
+  for (int l = 0; l < len; l++) {
+    if (cost[l] + lit_bits[l + 1] - lit_bits[l] < cost[l + 1]) {
+      cost[l + 1] = cost[l] + lit_bits[l + 1] - lit_bits[l];
+      from[l + 1] = l;
+      from_dist[l + 1] = -1;
+    }
+    if (l > len - NICE_LEN || (((unsigned char) in[l]) >> 6) == 2)
+      continue;
+    // positions are tried nearest first, so each length is taken from the nearest position having it
+    int covered = NICE_LEN - 1;
+    int tries = 0;
+    int j;
+    if (mip) {
+      usx_match_index_add(mip, in, l - NICE_LEN);
+      j = (l < NICE_LEN ? -1 : usx_match_head(mip, in + l));
+    } else
+      j = l - NICE_LEN;
+    for (; j >= 0 && ++tries <= USX_PLAN_CHAIN_DEPTH; j = (mip ? mip->prev[j] : j - 1)) {
+      int k;
+      for (k = l; k < len && j + k - l < l; k++) {
+        if (in[k] != in[j + k - l])
+          break;
+      }
+      const int reached_end = (k == len);
+      while (k < len && (((unsigned char) in[k]) >> 6) == 2)
+        k--; // Skip partial UTF-8 matches
+      const int match_len = k - l;
+      if (match_len > covered) {
+        const int dist = l - j - NICE_LEN + 1;
+        const int dist_bits = usx_count_bits(dist);
+        for (int rlen = covered + 1; dist_bits && rlen <= match_len; rlen++) {
+          if (rlen > USX_PLAN_ALL_LENS && rlen < match_len)
+            rlen = match_len;
+          if (l + rlen < len && (((unsigned char) in[l + rlen]) >> 6) == 2)
+            continue;
+          const int len_bits = usx_count_bits(rlen - NICE_LEN);
+          const int32_t rcost = cost[l] + (int32_t) (dict_bits + len_bits + dist_bits) * USX_PLAN_COST_SCALE;
+          if (len_bits && rcost < cost[l + rlen]) {
+            cost[l + rlen] = rcost;
+            from[l + rlen] = l;
+            from_dist[l + rlen] = dist;
+          }
+        }
+        covered = match_len;
+      }
+      if (reached_end)
+        break;
+    }
+  }
+  for (int l = 0; l < len; l++)
+    plan->rep_len[l] = -1;
+  for (int l = len; l > 0; l = from[l]) {
+    if (from_dist[l] >= 0) {
+      plan->rep_len[from[l]] = l - from[l] - NICE_LEN;
+      plan->rep_dist[from[l]] = from_dist[l];
+    }
+  }
+  if (mip)
+    free(mi.head);
+  free(cost);
+  return 1;
+}
+
 /// This is used only when encoding a string array
 /// Finds the longest matching sequence from the previous array element to the beginning of the string array. \n
 /// If a match is found and it is longer than NICE_LEN, it is encoded as a repeating sequence to out \n
 /// This is also used for Unicode strings \n
 /// This is a crude implementation that is not optimized.  Assuming only short strings \n
-/// are encoded, this is not much of an issue.
-int matchLine(const char *in, int len, int l, char *out, int olen, int *ol, struct us_lnk_lst *prev_lines, uint8_t *state, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[]) {
-  int last_ol = *ol;
+/// are encoded, this is not much of an issue. Only max_lines lines are searched, if not 0.
+int matchLine(const char *in, int len, int l, struct usx_bit_writer *bw, struct us_lnk_lst *prev_lines, uint8_t *state, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[], int max_lines) {
+  int last_ol = bw->ol;
   int last_len = 0;
   int last_dist = 0;
   int last_ctx = 0;
@@ -417,20 +933,20 @@ int matchLine(const char *in, int len, int l, char *out, int olen, int *ol, stru
           //  //printf("No savng: %d\n", saving);
           //  continue;
           //}
-          *ol = last_ol;
+          SAFE_APPEND_BITS(usx_bw_seek(bw, last_ol));
         }
         last_len = (k - j);
         last_dist = j;
         last_ctx = line_ctr;
-        SAFE_APPEND_BITS(*ol = append_switch_code(out, olen, *ol, *state));
-        SAFE_APPEND_BITS(*ol = append_bits(out, olen, *ol, usx_hcodes[USX_DICT], usx_hcode_lens[USX_DICT]));
-        SAFE_APPEND_BITS(*ol = encodeCount(out, olen, *ol, last_len - NICE_LEN));
-        SAFE_APPEND_BITS(*ol = encodeCount(out, olen, *ol, last_dist));
-        SAFE_APPEND_BITS(*ol = encodeCount(out, olen, *ol, last_ctx));
+        SAFE_APPEND_BITS(append_switch_code(bw, *state));
+        SAFE_APPEND_BITS(append_bits(bw, usx_hcodes[USX_DICT], usx_hcode_lens[USX_DICT]));
+        SAFE_APPEND_BITS(encodeCount(bw, last_len - NICE_LEN));
+        SAFE_APPEND_BITS(encodeCount(bw, last_dist));
+        SAFE_APPEND_BITS(encodeCount(bw, last_ctx));
         /*
-        if ((*ol - last_ol) > (last_len * 4)) {
+        if ((bw->ol - last_ol) > (last_len * 4)) {
           last_len = 0;
-          *ol = last_ol;
+          usx_bw_seek(bw, last_ol);
         }*/
         //printf("Len: %d, Dist: %d, Line: %d\n", last_len, last_dist, last_ctx);
         j += last_len;
@@ -438,7 +954,7 @@ int matchLine(const char *in, int len, int l, char *out, int olen, int *ol, stru
     }
     line_ctr++;
     prev_lines = prev_lines->previous;
-  } while (prev_lines && prev_lines->data != NULL);
+  } while (prev_lines && prev_lines->data != NULL && (max_lines == 0 || line_ctr < max_lines));
   if (last_len) {
     l += last_len;
     l--;
@@ -447,6 +963,177 @@ int matchLine(const char *in, int len, int l, char *out, int olen, int *ol, stru
   return -l;
 }
 
+/// Number of bits of the hash of NICE_LEN bytes used to index the line index head table
+#define USX_LINE_HASH_BITS 16
+
+/// Hash of the NICE_LEN bytes at given position for the line index
+static inline int usx_line_hash(const char *in) {
+  return (int) (usx_nice_len_hash(in) >> (32 - USX_LINE_HASH_BITS));
+}
+
+// Line index API function. See unishox2.h for documentation
+int unishox2_init_line_index(struct unishox2_line_index *idx) {
+  memset(idx, 0, sizeof(*idx));
+  idx->head = (int *) malloc((1 << USX_LINE_HASH_BITS) * sizeof(int));
+  if (idx->head == NULL)
+    return 0;
+  for (int i = 0; i < (1 << USX_LINE_HASH_BITS); i++)
+    idx->head[i] = -1;
+  return 1;
+}
+
+// Line index API function. See unishox2.h for documentation
+void unishox2_free_line_index(struct unishox2_line_index *idx) {
+  free(idx->head);
+  free((void *) idx->lines);
+  free(idx->line_lens);
+  free(idx->longer_lines);
+  free(idx->entries);
+  memset(idx, 0, sizeof(*idx));
+}
+
+/// Grows the array at *arr having *cap elements of elem_size each to hold at least need elements
+int usx_grow_array(void **arr, int *cap, int need, size_t elem_size) {
+  if (need <= *cap)
+    return 1;
+  int new_cap = (*cap ? *cap * 2 : 64);
+  while (new_cap < need)
+    new_cap *= 2;
+  void *new_arr = realloc(*arr, new_cap * elem_size);
+  if (new_arr == NULL)
+    return 0;
+  *arr = new_arr;
+  *cap = new_cap;
+  return 1;
+}
+
+// Line index API function. See unishox2.h for documentation
+int unishox2_line_index_add(struct unishox2_line_index *idx, const char *line, int len) {
+  const int line_no = idx->line_count;
+  const int positions = (len >= NICE_LEN ? len - NICE_LEN + 1 : 0);
+  int line_cap = idx->line_cap;
+  if (!usx_grow_array((void **) &idx->line_lens, &line_cap, line_no + 1, sizeof(int)))
+    return 0;
+  line_cap = idx->line_cap;
+  if (!usx_grow_array((void **) &idx->longer_lines, &line_cap, line_no + 1, sizeof(int)))
+    return 0;
+  if (!usx_grow_array((void **) &idx->lines, &idx->line_cap, line_no + 1, sizeof(char *)))
+    return 0;
+  if (!usx_grow_array((void **) &idx->entries, &idx->entry_cap, idx->entry_count + positions, sizeof(struct usx_line_entry)))
+    return 0;
+  idx->lines[line_no] = line;
+  idx->line_lens[line_no] = len;
+  // keep only lines longer than every line added after them
+  while (idx->longer_line_count && idx->line_lens[idx->longer_lines[idx->longer_line_count - 1]] <= len)
+    idx->longer_line_count--;
+  idx->longer_lines[idx->longer_line_count++] = line_no;
+  for (int j = 0; j < positions; j++) {
+    const int h = usx_line_hash(line + j);
+    struct usx_line_entry *entry = &idx->entries[idx->entry_count];
+    entry->line = line_no;
+    entry->pos = j;
+    entry->prev = idx->head[h];
+    idx->head[h] = idx->entry_count++;
+  }
+  idx->line_count++;
+  return 1;
+}
+
+/// Returns the length of the longest line added after given line, 0 if none
+int usx_longest_line_after(const struct unishox2_line_index *idx, int line_no) {
+  int lo = 0;
+  int hi = idx->longer_line_count;
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    if (idx->longer_lines[mid] > line_no)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return lo < idx->longer_line_count ? idx->line_lens[idx->longer_lines[lo]] : 0;
+}
+
+/// Returns the length of the match between data at j and in at l, \n
+/// not counting any partial UTF-8 character at the end
+static inline int usx_line_match_len(const char *data, int data_len, int j, const char *in, int len, int l) {
+  int i, k;
+  for (i = l, k = j; k < data_len && i < len; k++, i++) {
+    if (data[k] != in[i])
+      break;
+  }
+  while (k > j && k < data_len && (((unsigned char) data[k]) >> 6) == 2)
+    k--; // Skip partial UTF-8 matches
+  return k - j;
+}
+
+/// Same as matchLine(), but looks up the lines added to idx instead of going through each of them. \n
+/// The match chosen is the same as that of matchLine(), which takes the first match found \n
+/// going through the lines from the latest, and within each line from the first position \n
+/// at or after the end of the positions tried in the lines before it. \n
+/// mi, if not NULL, has the positions of the string being compressed.
+int matchIndexedLine(const char *in, int len, int l, struct usx_bit_writer *bw, const struct unishox2_line_index *idx, struct usx_match_index *mi, uint8_t *state, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[]) {
+  int match_len = 0;
+  int match_dist = 0;
+  int match_ctx = 0;
+  // the string itself is the line at ctx 0
+  if (mi) {
+    usx_match_index_add(mi, in, l - 1);
+    for (int j = usx_match_head(mi, in + l); j >= 0; j = mi->prev[j]) {
+      const int jlen = usx_line_match_len(in, len, j, in, len, l);
+      if (jlen >= NICE_LEN) {
+        match_len = jlen;
+        match_dist = j;
+      }
+    }
+  } else {
+    for (int j = 0; j < l; j++) {
+      const int jlen = usx_line_match_len(in, len, j, in, len, l);
+      if (jlen >= NICE_LEN) {
+        match_len = jlen;
+        match_dist = j;
+        break;
+      }
+    }
+  }
+  if (match_len == 0) {
+    int entry_no = idx->head[usx_line_hash(in + l)];
+    while (entry_no >= 0) {
+      // entries are in order of latest line first and then last position first
+      const int line_no = idx->entries[entry_no].line;
+      const char *data = idx->lines[line_no];
+      const int data_len = idx->line_lens[line_no];
+      int start = usx_longest_line_after(idx, line_no);
+      if (start < l)
+        start = l;
+      for (; entry_no >= 0 && idx->entries[entry_no].line == line_no; entry_no = idx->entries[entry_no].prev) {
+        const int j = idx->entries[entry_no].pos;
+        if (j < start)
+          continue;
+        const int jlen = usx_line_match_len(data, data_len, j, in, len, l);
+        if (jlen >= NICE_LEN) {
+          match_len = jlen;
+          match_dist = j;
+        }
+      }
+      if (match_len) {
+        match_ctx = idx->line_count - line_no;
+        break;
+      }
+    }
+  }
+  if (match_len) {
+    SAFE_APPEND_BITS(append_switch_code(bw, *state));
+    SAFE_APPEND_BITS(append_bits(bw, usx_hcodes[USX_DICT], usx_hcode_lens[USX_DICT]));
+    SAFE_APPEND_BITS(encodeCount(bw, match_len - NICE_LEN));
+    SAFE_APPEND_BITS(encodeCount(bw, match_dist));
+    SAFE_APPEND_BITS(encodeCount(bw, match_ctx));
+    l += match_len;
+    l--;
+    return l;
+  }
+  return -l;
+}
+
 /// Returns 4 bit code assuming ch falls between '0' to '9', \n
 /// 'A' to 'F' or 'a' to 'f'
 uint8_t getBaseCode(char ch) {
@@ -475,12 +1162,30 @@ char getNibbleType(char ch) {
   return USX_NIB_NOT;
 }
 
+/// Returns the number of trailing zero bits of x, which should not be 0 \n
+/// Uses the count trailing zeros instruction of the compiler where available
+static inline int usx_ctz64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(x);
+#elif defined(_MSC_VER) && defined(_M_X64)
+  unsigned long lsb;
+  _BitScanForward64(&lsb, x);
+  return (int) lsb;
+#else
+  int n = 0;
+  while (!(x & 1)) {
+    x >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
 /// Starts coding of nibble sets
-int append_nibble_escape(char *out, int olen, int ol, uint8_t state, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[]) {
-  SAFE_APPEND_BITS(ol = append_switch_code(out, olen, ol, state));
-  SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, usx_hcodes[USX_NUM], usx_hcode_lens[USX_NUM]));
-  SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, 0, 2));
-  return ol;
+int append_nibble_escape(struct usx_bit_writer *bw, uint8_t state, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[]) {
+  SAFE_APPEND_BITS(append_switch_code(bw, state));
+  SAFE_APPEND_BITS(append_bits(bw, usx_hcodes[USX_NUM], usx_hcode_lens[USX_NUM]));
+  return append_bits(bw, 0, 2);
 }
 
 /// Returns minimum value of two longs
@@ -489,25 +1194,27 @@ long min_of(long c, long i) {
 }
 
 /// Appends the terminator code depending on the state, preset and whether full terminator needs to be encoded to out or not \n
-int append_final_bits(char *const out, const int olen, int ol, const uint8_t state, const uint8_t is_all_upper, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[]) {
+int append_final_bits(struct usx_bit_writer *bw, const uint8_t state, const uint8_t is_all_upper, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[]) {
   if (usx_hcode_lens[USX_ALPHA]) {
     if (USX_NUM != state) {
       // for num state, append TERM_CODE directly
       // for other state, switch to Num Set first
-      SAFE_APPEND_BITS(ol = append_switch_code(out, olen, ol, state));
-      SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, usx_hcodes[USX_NUM], usx_hcode_lens[USX_NUM]));
+      SAFE_APPEND_BITS(append_switch_code(bw, state));
+      SAFE_APPEND_BITS(append_bits(bw, usx_hcodes[USX_NUM], usx_hcode_lens[USX_NUM]));
     }
-    SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, usx_vcodes[TERM_CODE & 0x1F], usx_vcode_lens[TERM_CODE & 0x1F]));
+    SAFE_APPEND_BITS(append_bits(bw, usx_vcodes[TERM_CODE & 0x1F], usx_vcode_lens[TERM_CODE & 0x1F]));
   } else {
     // preset 1, terminate at 2 or 3 SW_CODE, i.e., 4 or 6 continuous 0 bits
     // see discussion: https://github.com/siara-cc/Unishox/issues/19#issuecomment-922435580
-    SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, TERM_BYTE_PRESET_1, is_all_upper ? TERM_BYTE_PRESET_1_LEN_UPPER : TERM_BYTE_PRESET_1_LEN_LOWER));
+    SAFE_APPEND_BITS(append_bits(bw, TERM_BYTE_PRESET_1, is_all_upper ? TERM_BYTE_PRESET_1_LEN_UPPER : TERM_BYTE_PRESET_1_LEN_LOWER));
   }
 
   // fill uint8_t with the last bit
-  SAFE_APPEND_BITS(ol = append_bits(out, olen, ol, (ol == 0 || out[(ol-1)/8] << ((ol-1)&7) >= 0) ? 0 : 0xFF, (8 - ol % 8) & 7));
+  SAFE_APPEND_BITS(usx_bw_flush(bw, 1));
+  const int ol = bw->ol;
+  SAFE_APPEND_BITS(append_bits(bw, (ol == 0 || bw->out == NULL || bw->out[(ol-1)/8] << ((ol-1)&7) >= 0) ? 0 : 0xFF, (8 - ol % 8) & 7));
 
-  return ol;
+  return usx_bw_flush(bw, 1);
 }
 
 /// Macro used in the main compress function so that if the output len exceeds given maximum length (olen) it can exit
@@ -517,50 +1224,82 @@ int append_final_bits(char *const out, const int olen, int ol, const uint8_t sta
   if (newidx < 0) return __olen >= 0 ? __olen + 1 : (1 - __olen) * 4; \
 } while (0)
 
-// Main API function. See unishox2.h for documentation
-int unishox2_compress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen), const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[], const char *usx_freq_seq[], const char *usx_templates[], struct us_lnk_lst *prev_lines) {
-
+/// Compresses in to out, looking for repeats in prev_lines, or in the lines of line_idx if not NULL. \n
+/// mi, if not NULL, is used to find repeats within in. \n
+/// If out is NULL, nothing is written but the same length is returned. \n
+/// If bit_len is not NULL, it is set to the number of bits before the terminator. \n
+/// effort has the effort to be spent on finding repeats, as for the compression level. \n
+/// If plan is not NULL, its repeats are used instead of looking for them. \n
+/// The paths taken are counted in stats if not NULL and built with UNISHOX_STATS
+int usx_compress_lines_impl(const char *in, int len, char *out, int olen, const struct unishox2_ctx *ctx, struct us_lnk_lst *prev_lines, const struct unishox2_line_index *line_idx, struct usx_match_index *mi, const struct usx_effort *effort, struct usx_plan *plan, struct unishox2_stats *stats, int *bit_len) {
+
+  const uint8_t *usx_hcodes = ctx->usx_hcodes;
+  const uint8_t *usx_hcode_lens = ctx->usx_hcode_lens;
+  const char **usx_freq_seq = ctx->usx_freq_seq;
+  const char **usx_templates = ctx->usx_templates;
+  const uint8_t *code_94 = ctx->has_custom_sets ? ctx->usx_code_94 : usx_code_94;
   uint8_t state;
 
   int l, ll, ol;
+  struct usx_bit_writer bw;
   char c_in, c_next;
   int prev_uni;
+  int32_t uni_ahead = 0;   // code point decoded ahead at uni_ahead_pos, so it is not decoded again
+  int uni_ahead_pos = -1;
+  int uni_ahead_len = 0;
   uint8_t is_upper, is_all_upper;
-#if (UNISHOX_API_OUT_AND_LEN(0,1)) == 0
-  const int olen = INT_MAX - 1;
-  const int rawolen = olen;
-  const uint8_t need_full_term_codes = 0;
-#else
   const int rawolen = olen;
   uint8_t need_full_term_codes = 0;
+#if UNISHOX_STATS
+  int stat_ol = 0;   // bit position up to which the output has been counted in stats
+#else
+  (void) stats;
+#endif
   if (olen < 0) {
     need_full_term_codes = 1;
     olen *= -1;
   }
-#endif
 
-  init_coder();
-  ol = 0;
+  usx_bw_init(&bw, out, olen);
+#if UNISHOX_STATS
+  bw.stats = stats;
+#endif
   prev_uni = 0;
   state = USX_ALPHA;
   is_all_upper = 0;
-  SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, UNISHOX_MAGIC_BITS, UNISHOX_MAGIC_BIT_LEN)); // magic bit(s)
+  SAFE_APPEND_BITS2(rawolen, append_bits(&bw, UNISHOX_MAGIC_BITS, UNISHOX_MAGIC_BIT_LEN)); // magic bit(s)
   for (l=0; l<len; l++) {
 
-    if (usx_hcode_lens[USX_DICT] && l < (len - NICE_LEN + 1)) {
-      if (prev_lines) {
-        l = matchLine(in, len, l, out, olen, &ol, prev_lines, &state, usx_hcodes, usx_hcode_lens);
+    USX_STAT_MARK(bw);
+    if (plan && plan->pos_bits)
+      plan->pos_bits[l] = bw.ol;
+    if (plan && plan->rep_len) {
+      if (plan->rep_len[l] >= 0) {
+        SAFE_APPEND_BITS2(rawolen, append_repeat(&bw, state, usx_hcodes, usx_hcode_lens, plan->rep_len[l], plan->rep_dist[l]));
+        USX_STAT_ADD(bw, USX_STAT_DICT, 1);
+        l += plan->rep_len[l] + NICE_LEN - 1;
+        continue;
+      }
+    } else
+    if (usx_hcode_lens[USX_DICT] && effort->chain_depth >= 0 && l < (len - NICE_LEN + 1)) {
+      if (prev_lines || line_idx) {
+        if (line_idx)
+          l = matchIndexedLine(in, len, l, &bw, line_idx, mi, &state, usx_hcodes, usx_hcode_lens);
+        else
+          l = matchLine(in, len, l, &bw, prev_lines, &state, usx_hcodes, usx_hcode_lens, effort->max_lines);
         if (l > 0) {
+          USX_STAT_ADD(bw, USX_STAT_DICT, 1);
           continue;
-        } else if (l < 0 && ol < 0) {
+        } else if (l < 0 && bw.ol < 0) {
           return olen + 1;
         }
         l = -l;
       } else {
-          l = matchOccurance(in, len, l, out, olen, &ol, &state, usx_hcodes, usx_hcode_lens);
+          l = matchOccurance(in, len, l, &bw, &state, usx_hcodes, usx_hcode_lens, mi, effort);
           if (l > 0) {
+            USX_STAT_ADD(bw, USX_STAT_DICT, 1);
             continue;
-          } else if (l < 0 && ol < 0) {
+          } else if (l < 0 && bw.ol < 0) {
             return olen + 1;
           }
           l = -l;
@@ -568,21 +1307,24 @@ int unishox2_compress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(cha
     }
 
     c_in = in[l];
+    // hex and uuid are all ASCII, so are not looked for at other bytes
+    const int is_ascii = ((uint8_t) c_in < 0x80);
     if (l && len > 4 && l < (len - 4) && usx_hcode_lens[USX_NUM]) {
       if (c_in == in[l - 1] && c_in == in[l + 1] && c_in == in[l + 2] && c_in == in[l + 3]) {
         int rpt_count = l + 4;
         while (rpt_count < len && in[rpt_count] == c_in)
           rpt_count++;
         rpt_count -= l;
-        SAFE_APPEND_BITS2(rawolen, ol = append_code(out, olen, ol, RPT_CODE, &state, usx_hcodes, usx_hcode_lens));
-        SAFE_APPEND_BITS2(rawolen, ol = encodeCount(out, olen, ol, rpt_count - 4));
+        SAFE_APPEND_BITS2(rawolen, append_code(&bw, RPT_CODE, &state, usx_hcodes, usx_hcode_lens));
+        SAFE_APPEND_BITS2(rawolen, encodeCount(&bw, rpt_count - 4));
+        USX_STAT_ADD(bw, USX_STAT_REPEAT, 1);
         l += rpt_count;
         l--;
         continue;
       }
     }
 
-    if (l <= (len - 36) && usx_hcode_lens[USX_NUM]) {
+    if (is_ascii && l <= (len - 36) && usx_hcode_lens[USX_NUM]) {
       if (in[l + 8] == '-' && in[l + 13] == '-' && in[l + 18] == '-' && in[l + 23] == '-') {
         char hex_type = USX_NIB_NUM;
         int uid_pos = l;
@@ -600,22 +1342,23 @@ int unishox2_compress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(cha
           }
         }
         if (uid_pos == l + 36) {
-          SAFE_APPEND_BITS2(rawolen, ol = append_nibble_escape(out, olen, ol, state, usx_hcodes, usx_hcode_lens));
-          SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, (hex_type == USX_NIB_HEX_LOWER ? 0xC0 : 0xF0),
+          SAFE_APPEND_BITS2(rawolen, append_nibble_escape(&bw, state, usx_hcodes, usx_hcode_lens));
+          SAFE_APPEND_BITS2(rawolen, append_bits(&bw, (hex_type == USX_NIB_HEX_LOWER ? 0xC0 : 0xF0),
                  (hex_type == USX_NIB_HEX_LOWER ? 3 : 5)));
           for (uid_pos = l; uid_pos < l + 36; uid_pos++) {
             char c_uid = in[uid_pos];
             if (c_uid != '-')
-              SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, getBaseCode(c_uid), 4));
+              SAFE_APPEND_BITS2(rawolen, append_bits(&bw, getBaseCode(c_uid), 4));
           }
           //printf("GUID:\n");
+          USX_STAT_ADD(bw, USX_STAT_UUID, 1);
           l += 35;
           continue;
         }
       }
     }
 
-    if (l < (len - 5) && usx_hcode_lens[USX_NUM]) {
+    if (is_ascii && l < (len - 5) && usx_hcode_lens[USX_NUM]) {
       char hex_type = USX_NIB_NUM;
       int hex_len = 0;
       do {
@@ -632,55 +1375,46 @@ int unishox2_compress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(cha
       if (hex_len > 10 && hex_type == USX_NIB_NUM)
         hex_type = USX_NIB_HEX_LOWER;
       if ((hex_type == USX_NIB_HEX_LOWER || hex_type == USX_NIB_HEX_UPPER) && hex_len > 3) {
-        SAFE_APPEND_BITS2(rawolen, ol = append_nibble_escape(out, olen, ol, state, usx_hcodes, usx_hcode_lens));
-        SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, (hex_type == USX_NIB_HEX_LOWER ? 0x80 : 0xE0), (hex_type == USX_NIB_HEX_LOWER ? 2 : 4)));
-        SAFE_APPEND_BITS2(rawolen, ol = encodeCount(out, olen, ol, hex_len));
+        SAFE_APPEND_BITS2(rawolen, append_nibble_escape(&bw, state, usx_hcodes, usx_hcode_lens));
+        SAFE_APPEND_BITS2(rawolen, append_bits(&bw, (hex_type == USX_NIB_HEX_LOWER ? 0x80 : 0xE0), (hex_type == USX_NIB_HEX_LOWER ? 2 : 4)));
+        SAFE_APPEND_BITS2(rawolen, encodeCount(&bw, hex_len));
         do {
-          SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, getBaseCode(in[l++]), 4));
+          SAFE_APPEND_BITS2(rawolen, append_bits(&bw, getBaseCode(in[l++]), 4));
         } while (--hex_len);
+        USX_STAT_ADD(bw, USX_STAT_HEX, 1);
         l--;
         continue;
       }
     }
 
-    if (usx_templates != NULL) {
+    if (ctx->usx_template_starts[(uint8_t) c_in >> 3] & (1 << (c_in & 7))) {
       int i;
       for (i = 0; i < 5; i++) {
-        if (usx_templates[i]) {
-          int rem = (int)strlen(usx_templates[i]);
+        int rem = ctx->usx_template_lens[i];
+        if (rem) {
+          const char *tmpl = usx_templates[i];
           int j = 0;
           for (; j < rem && l + j < len; j++) {
-            char c_t = usx_templates[i][j];
-            c_in = in[l + j];
-            if (c_t == 'f' || c_t == 'F') {
-              if (getNibbleType(c_in) != (c_t == 'f' ? USX_NIB_HEX_LOWER : USX_NIB_HEX_UPPER)
-                       && getNibbleType(c_in) != USX_NIB_NUM) {
-                break;
-              }
-            } else
-            if (c_t == 'r' || c_t == 't' || c_t == 'o') {
-              if (c_in < '0' || c_in > (c_t == 'r' ? '7' : (c_t == 't' ? '3' : '1')))
-                break;
-            } else
-            if (c_t != c_in)
+            if (!usx_template_char_matches(tmpl[j], in[l + j]))
               break;
           }
-          if (((float)j / rem) > 0.66) {
-            //printf("%s\n", usx_templates[i]);
+          if (j >= ctx->usx_template_min_lens[i]) {
+            //printf("%s\n", tmpl);
             rem = rem - j;
-            SAFE_APPEND_BITS2(rawolen, ol = append_nibble_escape(out, olen, ol, state, usx_hcodes, usx_hcode_lens));
-            SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, 0, 1));
-            SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, (count_codes[i] & 0xF8), count_codes[i] & 0x07));
-            SAFE_APPEND_BITS2(rawolen, ol = encodeCount(out, olen, ol, rem));
+            SAFE_APPEND_BITS2(rawolen, append_nibble_escape(&bw, state, usx_hcodes, usx_hcode_lens));
+            SAFE_APPEND_BITS2(rawolen, append_bits(&bw, 0, 1));
+            SAFE_APPEND_BITS2(rawolen, append_bits(&bw, (count_codes[i] & 0xF8), count_codes[i] & 0x07));
+            SAFE_APPEND_BITS2(rawolen, encodeCount(&bw, rem));
             for (int k = 0; k < j; k++) {
-              char c_t = usx_templates[i][k];
+              char c_t = tmpl[k];
               if (c_t == 'f' || c_t == 'F')
-                SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, getBaseCode(in[l + k]), 4));
+                SAFE_APPEND_BITS2(rawolen, append_bits(&bw, getBaseCode(in[l + k]), 4));
               else if (c_t == 'r' || c_t == 't' || c_t == 'o') {
                 c_t = (c_t == 'r' ? 3 : (c_t == 't' ? 2 : 1));
-                SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, (in[l + k] - '0') << (8 - c_t), c_t));
+                SAFE_APPEND_BITS2(rawolen, append_bits(&bw, (in[l + k] - '0') << (8 - c_t), c_t));
               }
             }
+            USX_STAT_ADD(bw, USX_STAT_TEMPLATE, 1);
             l += j;
             l--;
             break;
@@ -691,17 +1425,17 @@ int unishox2_compress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(cha
         continue;
     }
 
-    if (usx_freq_seq != NULL) {
+    if (ctx->usx_freq_seq_starts[(uint8_t) c_in >> 3] & (1 << (c_in & 7))) {
       int i;
       for (i = 0; i < 6; i++) {
-        int seq_len = (int)strlen(usx_freq_seq[i]);
-        if (len - seq_len >= 0 && l <= len - seq_len) {
-          if (memcmp(usx_freq_seq[i], in + l, seq_len) == 0 && usx_hcode_lens[usx_freq_codes[i] >> 5]) {
-            SAFE_APPEND_BITS2(rawolen, ol = append_code(out, olen, ol, usx_freq_codes[i], &state, usx_hcodes, usx_hcode_lens));
-            l += seq_len;
-            l--;
-            break;
-          }
+        const int seq_len = ctx->usx_freq_seq_lens[i];
+        if (seq_len && usx_freq_seq[i][0] == c_in && l <= len - seq_len
+            && memcmp(usx_freq_seq[i], in + l, seq_len) == 0) {
+          SAFE_APPEND_BITS2(rawolen, append_code(&bw, usx_freq_codes[i], &state, usx_hcodes, usx_hcode_lens));
+          USX_STAT_ADD(bw, USX_STAT_FREQ_SEQ, 1);
+          l += seq_len;
+          l--;
+          break;
         }
       }
       if (i < 6)
@@ -711,145 +1445,344 @@ int unishox2_compress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(cha
     c_in = in[l];
 
     is_upper = 0;
+    uint8_t latin1_code = USX_NO_CODE;
     if (c_in >= 'A' && c_in <= 'Z')
-      is_upper = 1;
-    else {
+      is_upper = (code_94[c_in - USX_OFFSET_94] != USX_NO_CODE);
+    else if (ctx->has_custom_sets && ((uint8_t) c_in & 0xFE) == 0xC2)
+      latin1_code = usx_latin1_code(in, len, l, ctx, &is_upper);
+    if (!is_upper) {
       if (is_all_upper) {
         is_all_upper = 0;
-        SAFE_APPEND_BITS2(rawolen, ol = append_switch_code(out, olen, ol, state));
-        SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
+        SAFE_APPEND_BITS2(rawolen, append_switch_code(&bw, state));
+        SAFE_APPEND_BITS2(rawolen, append_bits(&bw, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
+        USX_STAT_ADD(bw, USX_STAT_UPPER_RUN, 0);
         state = USX_ALPHA;
       }
     }
     if (is_upper && !is_all_upper) {
       if (state == USX_NUM) {
-        SAFE_APPEND_BITS2(rawolen, ol = append_switch_code(out, olen, ol, state));
-        SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
+        SAFE_APPEND_BITS2(rawolen, append_switch_code(&bw, state));
+        SAFE_APPEND_BITS2(rawolen, append_bits(&bw, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
         state = USX_ALPHA;
       }
-      SAFE_APPEND_BITS2(rawolen, ol = append_switch_code(out, olen, ol, state));
-      SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
+      SAFE_APPEND_BITS2(rawolen, append_switch_code(&bw, state));
+      SAFE_APPEND_BITS2(rawolen, append_bits(&bw, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
       if (state == USX_DELTA) {
         state = USX_ALPHA;
-        SAFE_APPEND_BITS2(rawolen, ol = append_switch_code(out, olen, ol, state));
-        SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
+        SAFE_APPEND_BITS2(rawolen, append_switch_code(&bw, state));
+        SAFE_APPEND_BITS2(rawolen, append_bits(&bw, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
       }
     }
     c_next = 0;
     if (l+1 < len)
       c_next = in[l+1];
 
-    if (c_in >= 32 && c_in <= 126) {
+    if (latin1_code != USX_NO_CODE) {
+      SAFE_APPEND_BITS2(rawolen, append_code(&bw, latin1_code, &state, usx_hcodes, usx_hcode_lens));
+      USX_STAT_ADD(bw, USX_STAT_LITERAL, 1);
+      l++;
+    } else
+    if (c_in >= 32 && c_in <= 126 && (c_in == ' ' || code_94[c_in - USX_OFFSET_94] != USX_NO_CODE)) {
       if (is_upper && !is_all_upper) {
         for (ll=l+4; ll>=l && ll<len; ll--) {
           if (in[ll] < 'A' || in[ll] > 'Z')
             break;
         }
         if (ll == l-1) {
-          SAFE_APPEND_BITS2(rawolen, ol = append_switch_code(out, olen, ol, state));
-          SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
+          SAFE_APPEND_BITS2(rawolen, append_switch_code(&bw, state));
+          SAFE_APPEND_BITS2(rawolen, append_bits(&bw, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
           state = USX_ALPHA;
           is_all_upper = 1;
+          USX_STAT_ADD(bw, USX_STAT_UPPER_RUN, 1);
         }
       }
       if (state == USX_DELTA && (c_in == ' ' || c_in == '.' || c_in == ',')) {
         uint8_t spl_code = (c_in == ',' ? 0xC0 : (c_in == '.' ? 0xE0 : (c_in == ' ' ? 0 : 0xFF)));
         if (spl_code != 0xFF) {
           uint8_t spl_code_len = (c_in == ',' ? 3 : (c_in == '.' ? 4 : (c_in == ' ' ? 1 : 4)));
-          SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, UNI_STATE_SPL_CODE, UNI_STATE_SPL_CODE_LEN));
-          SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, spl_code, spl_code_len));
+          SAFE_APPEND_BITS2(rawolen, append_bits(&bw, UNI_STATE_SPL_CODE, UNI_STATE_SPL_CODE_LEN));
+          SAFE_APPEND_BITS2(rawolen, append_bits(&bw, spl_code, spl_code_len));
+          USX_STAT_ADD(bw, USX_STAT_UNICODE, 1);
           continue;
         }
       }
       c_in -= 32;
       if (is_all_upper && is_upper)
         c_in += 32;
+#if UNISHOX_ENCODE_LOOKUP_TABLES && !UNISHOX_STATS
+      // not used for statistics as the switch codes in the table are not counted
+      if (ctx->has_emit_table) {
+        const uint32_t emit = (uint32_t) ctx->emit_table[state >> 1][(int)c_in];
+        SAFE_APPEND_BITS2(rawolen, usx_bw_put(&bw, emit >> 8, (emit >> 3) & 0x1F));
+        state = emit & 0x07;
+      } else
+#endif
       if (c_in == 0) {
         if (state == USX_NUM)
-          SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, usx_vcodes[NUM_SPC_CODE & 0x1F], usx_vcode_lens[NUM_SPC_CODE & 0x1F]));
+          SAFE_APPEND_BITS2(rawolen, append_bits(&bw, usx_vcodes[NUM_SPC_CODE & 0x1F], usx_vcode_lens[NUM_SPC_CODE & 0x1F]));
         else
-          SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, usx_vcodes[1], usx_vcode_lens[1]));
+          SAFE_APPEND_BITS2(rawolen, append_bits(&bw, usx_vcodes[1], usx_vcode_lens[1]));
       } else {
         c_in--;
-        SAFE_APPEND_BITS2(rawolen, ol = append_code(out, olen, ol, usx_code_94[(int)c_in], &state, usx_hcodes, usx_hcode_lens));
+        SAFE_APPEND_BITS2(rawolen, append_code(&bw, code_94[(int)c_in], &state, usx_hcodes, usx_hcode_lens));
       }
+      USX_STAT_ADD(bw, USX_STAT_LITERAL, 1);
     } else
     if (c_in == 13 && c_next == 10) {
-      SAFE_APPEND_BITS2(rawolen, ol = append_code(out, olen, ol, CRLF_CODE, &state, usx_hcodes, usx_hcode_lens));
+      SAFE_APPEND_BITS2(rawolen, append_code(&bw, CRLF_CODE, &state, usx_hcodes, usx_hcode_lens));
+      USX_STAT_ADD(bw, USX_STAT_LITERAL, 1);
       l++;
     } else
     if (c_in == 10) {
       if (state == USX_DELTA) {
-        SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, UNI_STATE_SPL_CODE, UNI_STATE_SPL_CODE_LEN));
-        SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, 0xF0, 4));
+        SAFE_APPEND_BITS2(rawolen, append_bits(&bw, UNI_STATE_SPL_CODE, UNI_STATE_SPL_CODE_LEN));
+        SAFE_APPEND_BITS2(rawolen, append_bits(&bw, 0xF0, 4));
       } else
-        SAFE_APPEND_BITS2(rawolen, ol = append_code(out, olen, ol, LF_CODE, &state, usx_hcodes, usx_hcode_lens));
+        SAFE_APPEND_BITS2(rawolen, append_code(&bw, LF_CODE, &state, usx_hcodes, usx_hcode_lens));
+      USX_STAT_ADD(bw, USX_STAT_LITERAL, 1);
     } else
     if (c_in == 13) {
-      SAFE_APPEND_BITS2(rawolen, ol = append_code(out, olen, ol, CR_CODE, &state, usx_hcodes, usx_hcode_lens));
+      SAFE_APPEND_BITS2(rawolen, append_code(&bw, CR_CODE, &state, usx_hcodes, usx_hcode_lens));
+      USX_STAT_ADD(bw, USX_STAT_LITERAL, 1);
     } else
     if (c_in == '\t') {
-      SAFE_APPEND_BITS2(rawolen, ol = append_code(out, olen, ol, TAB_CODE, &state, usx_hcodes, usx_hcode_lens));
+      SAFE_APPEND_BITS2(rawolen, append_code(&bw, TAB_CODE, &state, usx_hcodes, usx_hcode_lens));
+      USX_STAT_ADD(bw, USX_STAT_LITERAL, 1);
     } else {
-      int utf8len;
-      int32_t uni = readUTF8(in, len, l, &utf8len);
+      int utf8len = 0;
+      int32_t uni;
+      if (l == uni_ahead_pos) {
+        uni = uni_ahead;
+        utf8len = uni_ahead_len;
+      } else
+        uni = readUTF8(in, len, l, &utf8len);
       if (uni) {
         l += utf8len;
         if (state != USX_DELTA) {
           int32_t uni2 = readUTF8(in, len, l, &utf8len);
+          uni_ahead = uni2;
+          uni_ahead_pos = l;
+          uni_ahead_len = (uni2 ? utf8len : 0);
+          uint8_t uni2_upper;
+          if (uni2 < 0x100 && ctx->has_custom_sets && usx_latin1_code(in, len, l, ctx, &uni2_upper) != USX_NO_CODE)
+            uni2 = 0; // encoded using its code in the sets
           if (uni2) {
             if (state != USX_ALPHA) {
-              SAFE_APPEND_BITS2(rawolen, ol = append_switch_code(out, olen, ol, state));
-              SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
+              SAFE_APPEND_BITS2(rawolen, append_switch_code(&bw, state));
+              SAFE_APPEND_BITS2(rawolen, append_bits(&bw, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
             }
-            SAFE_APPEND_BITS2(rawolen, ol = append_switch_code(out, olen, ol, state));
-            SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
-            SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, usx_vcodes[1], usx_vcode_lens[1])); // code for space (' ')
+            SAFE_APPEND_BITS2(rawolen, append_switch_code(&bw, state));
+            SAFE_APPEND_BITS2(rawolen, append_bits(&bw, usx_hcodes[USX_ALPHA], usx_hcode_lens[USX_ALPHA]));
+            SAFE_APPEND_BITS2(rawolen, append_bits(&bw, usx_vcodes[1], usx_vcode_lens[1])); // code for space (' ')
             state = USX_DELTA;
           } else {
-            SAFE_APPEND_BITS2(rawolen, ol = append_switch_code(out, olen, ol, state));
-            SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, usx_hcodes[USX_DELTA], usx_hcode_lens[USX_DELTA]));
+            SAFE_APPEND_BITS2(rawolen, append_switch_code(&bw, state));
+            SAFE_APPEND_BITS2(rawolen, append_bits(&bw, usx_hcodes[USX_DELTA], usx_hcode_lens[USX_DELTA]));
           }
         }
-        SAFE_APPEND_BITS2(rawolen, ol = encodeUnicode(out, olen, ol, uni, prev_uni));
+        SAFE_APPEND_BITS2(rawolen, encodeUnicode(&bw, uni, prev_uni));
+        USX_STAT_ADD(bw, USX_STAT_UNICODE, 1);
         //printf("%d:%d:%d\n", l, utf8len, uni);
         prev_uni = uni;
         l--;
       } else {
         int bin_count = 1;
+        // printable characters not in the sets are escaped only up to the next character that is
+        const int is_printable = (c_in >= 32 && c_in <= 126);
         for (int bi = l + 1; bi < len; bi++) {
           char c_bi = in[bi];
+          if (is_printable && (c_bi <= 32 || c_bi > 126 || code_94[c_bi - USX_OFFSET_94] != USX_NO_CODE))
+            break;
           //if (c_bi > 0x1F && c_bi != 0x7F)
           //  break;
-          if (readUTF8(in, len, bi, &utf8len))
+          const int32_t uni_bi = readUTF8(in, len, bi, &utf8len);
+          if (uni_bi) {
+            uni_ahead = uni_bi;
+            uni_ahead_pos = bi;
+            uni_ahead_len = utf8len;
             break;
+          }
           if (bi < (len - 4) && c_bi == in[bi - 1] && c_bi == in[bi + 1] && c_bi == in[bi + 2] && c_bi == in[bi + 3])
             break;
           bin_count++;
         }
         //printf("Bin:%d:%d:%x:%d\n", l, (unsigned char) c_in, (unsigned char) c_in, bin_count);
-        SAFE_APPEND_BITS2(rawolen, ol = append_nibble_escape(out, olen, ol, state, usx_hcodes, usx_hcode_lens));
-        SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, 0xF8, 5));
-        SAFE_APPEND_BITS2(rawolen, ol = encodeCount(out, olen, ol, bin_count));
+        SAFE_APPEND_BITS2(rawolen, append_nibble_escape(&bw, state, usx_hcodes, usx_hcode_lens));
+        SAFE_APPEND_BITS2(rawolen, append_bits(&bw, 0xF8, 5));
+        SAFE_APPEND_BITS2(rawolen, encodeCount(&bw, bin_count));
         do {
-          SAFE_APPEND_BITS2(rawolen, ol = append_bits(out, olen, ol, in[l++], 8));
+          SAFE_APPEND_BITS2(rawolen, append_bits(&bw, in[l++], 8));
         } while (--bin_count);
+        USX_STAT_ADD(bw, USX_STAT_BINARY, 1);
         l--;
       }
     }
   }
 
+  SAFE_APPEND_BITS2(rawolen, ol = usx_bw_flush(&bw, 1));
+  if (bit_len)
+    *bit_len = ol;
+  if (plan && plan->pos_bits)
+    plan->pos_bits[len] = ol;
   if (need_full_term_codes) {
     const int orig_ol = ol;
-    SAFE_APPEND_BITS2(rawolen, ol = append_final_bits(out, olen, ol, state, is_all_upper, usx_hcodes, usx_hcode_lens));
+    SAFE_APPEND_BITS2(rawolen, ol = append_final_bits(&bw, state, is_all_upper, usx_hcodes, usx_hcode_lens));
+#if UNISHOX_STATS
+    usx_stat_string(&bw, len, ol);
+#endif
     return (ol / 8) * 4 + (((ol-orig_ol)/8) & 3);
   } else {
     const int rst = (ol + 7) / 8;
-    append_final_bits(out, rst, ol, state, is_all_upper, usx_hcodes, usx_hcode_lens);
+    bw.olen = rst;
+    append_final_bits(&bw, state, is_all_upper, usx_hcodes, usx_hcode_lens);
+#if UNISHOX_STATS
+    usx_stat_string(&bw, len, rst * 8);
+#endif
     return rst;
   }
 }
 
+int usx_compress_lines_bits(const char *in, int len, char *out, int olen, const struct unishox2_ctx *ctx, struct us_lnk_lst *prev_lines, const struct unishox2_line_index *line_idx, const struct unishox2_params *params, int *bit_len);
+
+/// Compresses in to out using the repeats chosen by usx_plan_repeats(), or those found at UNISHOX_LEVEL_MAX \n
+/// if that gives output no longer. The plan is first encoded without writing to find its length \n
+/// and is written over the output of UNISHOX_LEVEL_MAX only if shorter. \n
+/// Returns -1 if there is not enough memory
+int usx_compress_optimal(const char *in, int len, char *out, int olen, const struct unishox2_ctx *ctx, struct unishox2_stats *stats, int *bit_len) {
+  const struct unishox2_params max_params = {UNISHOX_LEVEL_MAX, 0, stats};
+  int *rep_len = (int *) malloc((len + 1) * 3 * sizeof(int));
+  if (rep_len == NULL)
+    return -1;
+  struct usx_plan plan = {rep_len, rep_len + len + 1, rep_len + (len + 1) * 2};
+  for (int l = 0; l <= len; l++)
+    plan.pos_bits[l] = -1;
+  struct usx_plan literals = {NULL, NULL, plan.pos_bits};
+  usx_compress_lines_impl(in, len, NULL, INT_MAX - 1, ctx, NULL, NULL, NULL, &usx_efforts[UNISHOX_LEVEL_FASTEST - 1], &literals, NULL, NULL);
+  int ret = -1;
+  if (usx_plan_repeats(in, len, plan.pos_bits, SW_CODE_LEN + ctx->usx_hcode_lens[USX_DICT], &plan)) {
+    plan.pos_bits = NULL;
+    const int plan_len = usx_compress_lines_impl(in, len, NULL, INT_MAX - 1, ctx, NULL, NULL, NULL, &usx_efforts[UNISHOX_LEVEL_MAX - 1], &plan, NULL, NULL);
+#if UNISHOX_STATS
+    struct unishox2_stats stats_before;
+    if (stats)
+      stats_before = *stats;
+#endif
+    ret = usx_compress_lines_bits(in, len, out, olen, ctx, NULL, NULL, &max_params, bit_len);
+    if (plan_len < ret) {
+#if UNISHOX_STATS
+      if (stats)
+        *stats = stats_before;
+#endif
+      ret = usx_compress_lines_impl(in, len, out, olen, ctx, NULL, NULL, NULL, &usx_efforts[UNISHOX_LEVEL_MAX - 1], &plan, stats, bit_len);
+    }
+  }
+  free(rep_len);
+  return ret;
+}
+
+/// Buffers allocated once for compressing many strings, so that they are not allocated for each
+struct usx_scratch {
+  struct usx_match_index mi;  ///< match index for the longest string, head being NULL if not allocated
+};
+
+/// Allocates the buffers needed for compressing strings of length upto max_len. \n
+/// Buffers that cannot be allocated are left NULL and get allocated for each string instead
+void usx_scratch_init(struct usx_scratch *scratch, int max_len) {
+  scratch->mi.head = NULL;
+  if (max_len >= USX_MATCH_INDEX_MIN_LEN && !usx_match_index_init(&scratch->mi, max_len))
+    scratch->mi.head = NULL;
+}
+
+/// Frees the buffers allocated by usx_scratch_init()
+void usx_scratch_free(struct usx_scratch *scratch) {
+  free(scratch->mi.head);
+}
+
+/// Same as usx_compress_lines_bits(), but using the buffers of scratch if not NULL, \n
+/// which should have been allocated for strings at least as long as in
+int usx_compress_lines_scratch(const char *in, int len, char *out, int olen, const struct unishox2_ctx *ctx, struct us_lnk_lst *prev_lines, const struct unishox2_line_index *line_idx, const struct unishox2_params *params, struct usx_scratch *scratch, int *bit_len) {
+  if (params && params->optimal && prev_lines == NULL && line_idx == NULL && ctx->usx_hcode_lens[USX_DICT] && olen >= 0) {
+    const int ret = usx_compress_optimal(in, len, out, olen, ctx, params->stats, bit_len);
+    if (ret >= 0)
+      return ret;
+  }
+  const struct usx_effort *effort = usx_get_effort(params);
+  struct usx_match_index mi;
+  struct usx_match_index *mip = NULL;
+  if ((UNISHOX_MATCH_INDEX || params || scratch) && prev_lines == NULL && ctx->usx_hcode_lens[USX_DICT] && effort->chain_depth >= 0
+        && len >= USX_MATCH_INDEX_MIN_LEN) {
+    if (scratch && scratch->mi.head) {
+      usx_match_index_reset(&scratch->mi);
+      mip = &scratch->mi;
+    } else if (usx_match_index_init(&mi, len))
+      mip = &mi;
+  }
+  const int ret = usx_compress_lines_impl(in, len, out, olen, ctx, prev_lines, line_idx, mip, effort, NULL, params ? params->stats : NULL, bit_len);
+  if (mip == &mi)
+    free(mi.head);
+  return ret;
+}
+
+/// Same as usx_compress_lines_with_len(), also giving the number of bits before the terminator in bit_len \n
+/// and spending the effort for the compression level in params (default if NULL)
+int usx_compress_lines_bits(const char *in, int len, char *out, int olen, const struct unishox2_ctx *ctx, struct us_lnk_lst *prev_lines, const struct unishox2_line_index *line_idx, const struct unishox2_params *params, int *bit_len) {
+  return usx_compress_lines_scratch(in, len, out, olen, ctx, prev_lines, line_idx, params, NULL, bit_len);
+}
+
+/// Compresses in to out, always honouring olen irrespective of UNISHOX_API_WITH_OUTPUT_LEN \n
+/// so that internal callers such as the batch engines can write into buffers of known size
+int usx_compress_lines_with_len(const char *in, int len, char *out, int olen, const struct unishox2_ctx *ctx, struct us_lnk_lst *prev_lines, const struct unishox2_line_index *line_idx) {
+  return usx_compress_lines_bits(in, len, out, olen, ctx, prev_lines, line_idx, NULL, NULL);
+}
+
+// Size query API function. See unishox2.h for documentation
+int unishox2_compressed_size(const char *in, int len, const struct unishox2_ctx *ctx, int *bit_len) {
+  return usx_compress_lines_bits(in, len, NULL, INT_MAX - 1, ctx, NULL, NULL, NULL, bit_len);
+}
+
+// Size query API function. See unishox2.h for documentation
+int unishox2_compressed_size_simple(const char *in, int len) {
+  struct unishox2_ctx ctx;
+  usx_set_ctx_params(&ctx, USX_HCODES_DFLT, USX_HCODE_LENS_DFLT, USX_FREQ_SEQ_DFLT, USX_TEMPLATES);
+  return unishox2_compressed_size(in, len, &ctx, NULL);
+}
+
+// Main API function. See unishox2.h for documentation
+int unishox2_compress_lines_ctx(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen), const struct unishox2_ctx *ctx, struct us_lnk_lst *prev_lines) {
+#if (UNISHOX_API_OUT_AND_LEN(0,1)) == 0
+  const int olen = INT_MAX - 1;
+#endif
+  return usx_compress_lines_with_len(in, len, out, olen, ctx, prev_lines, NULL);
+}
+
+// Line index API function. See unishox2.h for documentation
+int unishox2_compress_lines_with_index(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen), const struct unishox2_ctx *ctx, const struct unishox2_line_index *idx) {
+#if (UNISHOX_API_OUT_AND_LEN(0,1)) == 0
+  const int olen = INT_MAX - 1;
+#endif
+  return usx_compress_lines_with_len(in, len, out, olen, ctx, NULL, idx);
+}
+
+// Compression level API function. See unishox2.h for documentation
+int unishox2_compress_params(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen), const struct unishox2_ctx *ctx, struct us_lnk_lst *prev_lines, const struct unishox2_params *params) {
+#if (UNISHOX_API_OUT_AND_LEN(0,1)) == 0
+  const int olen = INT_MAX - 1;
+#endif
+  return usx_compress_lines_bits(in, len, out, olen, ctx, prev_lines, NULL, params, NULL);
+}
+
+// Main API function. See unishox2.h for documentation
+int unishox2_compress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen), const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[], const char *usx_freq_seq[], const char *usx_templates[], struct us_lnk_lst *prev_lines) {
+  struct unishox2_ctx ctx;
+  usx_set_ctx_params(&ctx, usx_hcodes, usx_hcode_lens, usx_freq_seq, usx_templates);
+  return unishox2_compress_lines_ctx(in, len, UNISHOX_API_OUT_AND_LEN(out, olen), &ctx, prev_lines);
+}
+
+// Main API function. See unishox2.h for documentation
+int unishox2_compress_ctx(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen), const struct unishox2_ctx *ctx) {
+  return unishox2_compress_lines_ctx(in, len, UNISHOX_API_OUT_AND_LEN(out, olen), ctx, NULL);
+}
+
 // Main API function. See unishox2.h for documentation
 int unishox2_compress(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen), const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[], const char *usx_freq_seq[], const char *usx_templates[]) {
   return unishox2_compress_lines(in, len, UNISHOX_API_OUT_AND_LEN(out, olen), usx_hcodes, usx_hcode_lens, usx_freq_seq, usx_templates, NULL);
@@ -860,39 +1793,119 @@ int unishox2_compress_simple(const char *in, int len, char *out) {
   return unishox2_compress_lines(in, len, UNISHOX_API_OUT_AND_LEN(out, INT_MAX - 1), USX_HCODES_DFLT, USX_HCODE_LENS_DFLT, USX_FREQ_SEQ_DFLT, USX_TEMPLATES, NULL);
 }
 
-// Reads one bit from in
-int readBit(const char *in, int bit_no) {
-   return in[bit_no >> 3] & (0x80 >> (bit_no % 8));
+/// Bit reader used by the decoder. Up to 64 bits of the input starting at \n
+/// a byte boundary are kept in a window so that successive codes are peeked \n
+/// from the window and the input is read again only when a code crosses its end
+struct usx_bit_reader {
+  const char *in; ///< input bitstream
+  int len;        ///< length of input in bits
+  int bit_no;     ///< position of the next bit to be read
+  int win_start;  ///< bit position of the MSB of win, -1 if win is not filled yet
+  uint64_t win;   ///< input bits starting at win_start, MSB aligned
+};
+
+/// Initializes the bit reader to read len bytes from in
+void usx_br_init(struct usx_bit_reader *br, const char *in, int len) {
+  br->in = in;
+  br->len = len << 3;
+  br->bit_no = 0;
+  br->win_start = -1;
+  br->win = 0;
+}
+
+/// Fills the window with 8 bytes starting from the byte at bit position pos. \n
+/// Bytes beyond the end of input are filled with 1s
+void usx_br_refill(struct usx_bit_reader *br, int pos) {
+  const int byte_pos = pos >> 3;
+  const int avail = (br->len >> 3) - byte_pos;
+  const uint8_t *src = (const uint8_t *) br->in + byte_pos;
+  uint64_t win = 0;
+  if (avail >= 8) {
+    for (int i = 0; i < 8; i++)
+      win = (win << 8) | src[i];
+  } else {
+    for (int i = 0; i < 8; i++)
+      win = (win << 8) | (i < avail ? src[i] : 0xFF);
+  }
+  br->win = win;
+  br->win_start = byte_pos << 3;
 }
 
-// Reads next 8 bits, if available
-int read8bitCode(const char *in, int len, int bit_no) {
-  int bit_pos = bit_no & 0x07;
-  int char_pos = bit_no >> 3;
-  len >>= 3;
-  uint8_t code = (((uint8_t)in[char_pos]) << bit_pos);
-  char_pos++;
-  if (char_pos < len) {
-    code |= ((uint8_t)in[char_pos]) >> (8 - bit_pos);
-  } else
-    code |= (0xFF >> (8 - bit_pos));
-  return code;
+/// Returns count (1 to 32) bits starting at bit position pos without consuming them. \n
+/// Bits beyond the end of input are returned as 1s
+uint32_t usx_br_peek_at(struct usx_bit_reader *br, int pos, int count) {
+  int off = pos - br->win_start;
+  if (br->win_start < 0 || off < 0 || off + count > 64) {
+    usx_br_refill(br, pos);
+    off = pos & 7;
+  }
+  return (uint32_t) ((br->win << off) >> (64 - count));
 }
 
+/// Returns next count (1 to 32) bits without consuming them
+uint32_t usx_br_peek(struct usx_bit_reader *br, int count) {
+  return usx_br_peek_at(br, br->bit_no, count);
+}
+
+/// Reads next 8 bits, if available
+int read8bitCode(struct usx_bit_reader *br) {
+  return (int) usx_br_peek(br, 8);
+}
+
+#if UNISHOX_DECODE_LOOKUP_TABLES
+
+/// Vertical decoder lookup table indexed by the next 8 bits read using read8bitCode() \n
+/// Same format as usx_vcode_lookup - 3 bits code len (one less), 5 bits vertical pos
+const uint8_t usx_vcode_lookup[256] = {
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20, 0x20,
+  0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41,
+  0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41, 0x41,
+  0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42,
+  0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42, 0x42,
+  0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63,
+  0x64, 0x64, 0x64, 0x64, 0x64, 0x64, 0x64, 0x64, 0x64, 0x64, 0x64, 0x64, 0x64, 0x64, 0x64, 0x64,
+  0x65, 0x65, 0x65, 0x65, 0x65, 0x65, 0x65, 0x65, 0x65, 0x65, 0x65, 0x65, 0x65, 0x65, 0x65, 0x65,
+  0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+  0x67, 0x67, 0x67, 0x67, 0x67, 0x67, 0x67, 0x67, 0x67, 0x67, 0x67, 0x67, 0x67, 0x67, 0x67, 0x67,
+  0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x88, 0x89, 0x89, 0x89, 0x89, 0x89, 0x89, 0x89, 0x89,
+  0xAA, 0xAA, 0xAA, 0xAA, 0xAB, 0xAB, 0xAB, 0xAB, 0xAC, 0xAC, 0xAC, 0xAC, 0xCD, 0xCD, 0xCE, 0xCE,
+  0xCF, 0xCF, 0xD0, 0xD0, 0xD1, 0xD1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA, 0xFB
+};
+
+/// Decodes the vertical code from the given bitstream at in \n
+/// using a single lookup of the next 8 bits in the 256 entry usx_vcode_lookup table. \n
+/// Returns the veritical code index or 99 if match could not be found. \n
+/// Also updates bit_no of the reader with how many ever bits used by the vertical code.
+int readVCodeIdx(struct usx_bit_reader *br) {
+  if (br->bit_no < br->len) {
+    uint8_t vcode = usx_vcode_lookup[read8bitCode(br)];
+    br->bit_no += ((vcode >> 5) + 1);
+    if (br->bit_no > br->len)
+      return 99;
+    return vcode & 0x1F;
+  }
+  return 99;
+}
+
+#else
+
 /// The list of veritical codes is split into 5 sections. Used by readVCodeIdx()
 #define SECTION_COUNT 5
 /// Used by readVCodeIdx() for finding the section under which the code read using read8bitCode() falls
-uint8_t usx_vsections[] = {0x7F, 0xBF, 0xDF, 0xEF, 0xFF};
+const uint8_t usx_vsections[] = {0x7F, 0xBF, 0xDF, 0xEF, 0xFF};
 /// Used by readVCodeIdx() for finding the section vertical position offset
-uint8_t usx_vsection_pos[] = {0, 4, 8, 12, 20};
+const uint8_t usx_vsection_pos[] = {0, 4, 8, 12, 20};
 /// Used by readVCodeIdx() for masking the code read by read8bitCode()
-uint8_t usx_vsection_mask[] = {0x7F, 0x3F, 0x1F, 0x0F, 0x0F};
+const uint8_t usx_vsection_mask[] = {0x7F, 0x3F, 0x1F, 0x0F, 0x0F};
 /// Used by readVCodeIdx() for shifting the code read by read8bitCode() to obtain the vpos
-uint8_t usx_vsection_shift[] = {5, 4, 3, 1, 0};
+const uint8_t usx_vsection_shift[] = {5, 4, 3, 1, 0};
 
 /// Vertical decoder lookup table - 3 bits code len, 5 bytes vertical pos
 /// code len is one less as 8 cannot be accommodated in 3 bits
-uint8_t usx_vcode_lookup[36] = {
+const uint8_t usx_vcode_lookup[36] = {
   (1 << 5) + 0,  (1 << 5) + 0,  (2 << 5) + 1,  (2 << 5) + 2,  // Section 1
   (3 << 5) + 3,  (3 << 5) + 4,  (3 << 5) + 5,  (3 << 5) + 6,  // Section 2
   (3 << 5) + 7,  (3 << 5) + 7,  (4 << 5) + 8,  (4 << 5) + 9,  // Section 3
@@ -910,16 +1923,16 @@ uint8_t usx_vcode_lookup[36] = {
 /// by splitting the list of vertical codes. \n
 /// Decoder is designed for using less memory, not speed. \n
 /// Returns the veritical code index or 99 if match could not be found. \n
-/// Also updates bit_no_p with how many ever bits used by the vertical code.
-int readVCodeIdx(const char *in, int len, int *bit_no_p) {
-  if (*bit_no_p < len) {
-    uint8_t code = read8bitCode(in, len, *bit_no_p);
+/// Also updates bit_no of the reader with how many ever bits used by the vertical code.
+int readVCodeIdx(struct usx_bit_reader *br) {
+  if (br->bit_no < br->len) {
+    uint8_t code = read8bitCode(br);
     int i = 0;
     do {
       if (code <= usx_vsections[i]) {
         uint8_t vcode = usx_vcode_lookup[usx_vsection_pos[i] + ((code & usx_vsection_mask[i]) >> usx_vsection_shift[i])];
-        (*bit_no_p) += ((vcode >> 5) + 1);
-        if (*bit_no_p > len)
+        br->bit_no += ((vcode >> 5) + 1);
+        if (br->bit_no > br->len)
           return 99;
         return vcode & 0x1F;
       }
@@ -928,21 +1941,54 @@ int readVCodeIdx(const char *in, int len, int *bit_no_p) {
   return 99;
 }
 
-/// Mask for retrieving each code to be decoded according to its length \n
-/// Same as usx_mask so redundant
-uint8_t len_masks[] = {0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE, 0xFF};
+#endif
+
+/// Mask for retrieving each code to be decoded according to its length
+const uint8_t len_masks[] = {0x80, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC, 0xFE, 0xFF};
+
+#if UNISHOX_DECODE_LOOKUP_TABLES
+/// Builds the horizontal code lookup table of the context indexed by the next 8 bits read using read8bitCode() \n
+/// Upper 4 bits are the code length and lower 4 bits the horizontal code index, 0xFF if no match
+void usx_build_hcode_lookup(struct unishox2_ctx *ctx) {
+  for (int code = 0; code < 256; code++) {
+    ctx->hcode_lookup[code] = 0xFF;
+    for (int code_pos = 0; code_pos < 5; code_pos++) {
+      uint8_t hlen = ctx->usx_hcode_lens[code_pos];
+      if (hlen && (code & len_masks[hlen - 1]) == ctx->usx_hcodes[code_pos]) {
+        ctx->hcode_lookup[code] = (hlen << 4) + code_pos;
+        break;
+      }
+    }
+  }
+  ctx->has_hcode_lookup = 1;
+}
+#endif
+
 /// Decodes the horizontal code from the given bitstream at in \n
-/// depending on the hcodes defined using usx_hcodes and usx_hcode_lens \n
+/// depending on the hcodes defined using usx_hcodes and usx_hcode_lens of the context \n
+/// If the context was built using unishox2_init_ctx() and UNISHOX_DECODE_LOOKUP_TABLES is set, \n
+/// a single lookup of the next 8 bits is used instead of trying each hcode. \n
 /// Returns the horizontal code index or 99 if match could not be found. \n
-/// Also updates bit_no_p with how many ever bits used by the horizontal code.
-int readHCodeIdx(const char *in, int len, int *bit_no_p, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[]) {
+/// Also updates bit_no of the reader with how many ever bits used by the horizontal code.
+int readHCodeIdx(struct usx_bit_reader *br, const struct unishox2_ctx *ctx) {
+  const uint8_t *usx_hcodes = ctx->usx_hcodes;
+  const uint8_t *usx_hcode_lens = ctx->usx_hcode_lens;
   if (!usx_hcode_lens[USX_ALPHA])
     return USX_ALPHA;
-  if (*bit_no_p < len) {
-    uint8_t code = read8bitCode(in, len, *bit_no_p);
+  if (br->bit_no < br->len) {
+    uint8_t code = read8bitCode(br);
+#if UNISHOX_DECODE_LOOKUP_TABLES
+    if (ctx->has_hcode_lookup) {
+      uint8_t hcode = ctx->hcode_lookup[code];
+      if (hcode == 0xFF)
+        return 99;
+      br->bit_no += (hcode >> 4);
+      return hcode & 0x0F;
+    }
+#endif
     for (int code_pos = 0; code_pos < 5; code_pos++) {
       if (usx_hcode_lens[code_pos] && (code & len_masks[usx_hcode_lens[code_pos] - 1]) == usx_hcodes[code_pos]) {
-        *bit_no_p += usx_hcode_lens[code_pos];
+        br->bit_no += usx_hcode_lens[code_pos];
         return code_pos;
       }
     }
@@ -950,76 +1996,128 @@ int readHCodeIdx(const char *in, int len, int *bit_no_p, const uint8_t usx_hcode
   return 99;
 }
 
-// TODO: Last value check.. Also len check in readBit
+// Builds the context for the given parameters. See unishox2.h for documentation
+void unishox2_init_ctx(struct unishox2_ctx *ctx, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[], const char *usx_freq_seq[], const char *usx_templates[]) {
+  usx_set_ctx_params(ctx, usx_hcodes, usx_hcode_lens, usx_freq_seq, usx_templates);
+#if UNISHOX_DECODE_LOOKUP_TABLES
+  usx_build_hcode_lookup(ctx);
+#endif
+#if UNISHOX_ENCODE_LOOKUP_TABLES
+  usx_build_emit_table(ctx);
+#endif
+}
+
+// Builds the context for the given parameters and sets. See unishox2.h for documentation
+int unishox2_init_ctx_sets(struct unishox2_ctx *ctx, const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[], const char *usx_freq_seq[], const char *usx_templates[], const uint8_t usx_sets[][28]) {
+  usx_set_ctx_params(ctx, usx_hcodes, usx_hcode_lens, usx_freq_seq, usx_templates);
+  const int ret = usx_compile_sets(ctx, usx_sets);
+  ctx->has_custom_sets = (ret == 0);
+#if UNISHOX_DECODE_LOOKUP_TABLES
+  usx_build_hcode_lookup(ctx);
+#endif
+#if UNISHOX_ENCODE_LOOKUP_TABLES
+  usx_build_emit_table(ctx);
+#endif
+  return ret;
+}
+
+/// Returns the number of leading 1 bits in code \n
+/// Uses the count leading zeros instruction of the compiler where available
+int usx_count_leading_ones(uint32_t code) {
+  code = ~code;
+  if (code == 0)
+    return 32;
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_clz(code);
+#elif defined(_MSC_VER)
+  unsigned long msb;
+  _BitScanReverse(&msb, code);
+  return 31 - (int) msb;
+#else
+  int count = 0;
+  while (!(code & 0x80000000)) {
+    code <<= 1;
+    count++;
+  }
+  return count;
+#endif
+}
+
 /// Returns the position of step code (0, 10, 110, etc.) encountered in the stream
-int getStepCodeIdx(const char *in, int len, int *bit_no_p, int limit) {
-  int idx = 0;
-  while (*bit_no_p < len && readBit(in, *bit_no_p)) {
-    idx++;
-    (*bit_no_p)++;
-    if (idx == limit)
-      return idx;
-  }
-  if (*bit_no_p >= len)
+int getStepCodeIdx(struct usx_bit_reader *br, int limit) {
+  const int avail = br->len - br->bit_no;
+  int idx = usx_count_leading_ones(usx_br_peek(br, 32));
+  if (idx > limit)
+    idx = limit;
+  const int step_len = idx + (idx < limit);
+  if (step_len > avail) {
+    br->bit_no = br->len;
     return 99;
-  (*bit_no_p)++;
+  }
+  br->bit_no += step_len;
   return idx;
 }
 
-/// Reads specified number of bits and builds the corresponding integer
-int32_t getNumFromBits(const char *in, int len, int bit_no, int count) {
-   int32_t ret = 0;
-   while (count-- && bit_no < len) {
-     ret += (readBit(in, bit_no) ? 1 << count : 0);
-     bit_no++;
-   }
-   return count < 0 ? ret : -1;
+/// Reads specified number of bits (upto 32) and builds the corresponding integer \n
+/// The bits are not consumed. Returns -1 if count bits are not available
+int32_t getNumFromBits(struct usx_bit_reader *br, int count) {
+  if (br->bit_no + count > br->len)
+    return -1;
+  return count ? (int32_t) usx_br_peek(br, count) : 0;
 }
 
-/// Decodes the count from the given bit stream at in. Also updates bit_no_p
-int32_t readCount(const char *in, int *bit_no_p, int len) {
-  int idx = getStepCodeIdx(in, len, bit_no_p, 4);
-  if (idx == 99)
-    return -1;
-  if (*bit_no_p + count_bit_lens[idx] - 1 >= len)
+/// Decodes the count from the given bit stream. Also updates bit_no of the reader \n
+/// The step code and the count that follows it are decoded from a single peek of 32 bits
+int32_t readCount(struct usx_bit_reader *br) {
+  const int avail = br->len - br->bit_no;
+  const uint32_t code = usx_br_peek(br, 32);
+  int idx = usx_count_leading_ones(code);
+  if (idx > 4)
+    idx = 4;
+  const int step_len = idx + (idx < 4);
+  const int bit_len = count_bit_lens[idx];
+  if (step_len + bit_len > avail)
     return -1;
-  int32_t count = getNumFromBits(in, len, *bit_no_p, count_bit_lens[idx]) + (idx ? count_adder[idx - 1] : 0);
-  (*bit_no_p) += count_bit_lens[idx];
-  return count;
+  br->bit_no += step_len + bit_len;
+  return (int32_t) ((code << step_len) >> (32 - bit_len)) + (idx ? count_adder[idx - 1] : 0);
 }
 
-/// Decodes the Unicode codepoint from the given bit stream at in. Also updates bit_no_p \n
+/// Decodes the Unicode codepoint from the given bit stream. Also updates bit_no of the reader \n
+/// The step code, sign and delta are decoded from a single peek of 32 bits \n
 /// When the step code is 5, reads the next step code to find out the special code.
-int32_t readUnicode(const char *in, int *bit_no_p, int len) {
-  int idx = getStepCodeIdx(in, len, bit_no_p, 5);
-  if (idx == 99)
+int32_t readUnicode(struct usx_bit_reader *br) {
+  const int avail = br->len - br->bit_no;
+  const uint32_t code = usx_br_peek(br, 32);
+  int idx = usx_count_leading_ones(code);
+  if (idx > 5)
+    idx = 5;
+  const int step_len = idx + (idx < 5);
+  if (step_len > avail)
     return 0x7FFFFF00 + 99;
   if (idx == 5) {
-    idx = getStepCodeIdx(in, len, bit_no_p, 4);
+    br->bit_no += step_len;
+    idx = getStepCodeIdx(br, 4);
     return 0x7FFFFF00 + idx;
   }
-  if (idx >= 0) {
-    int sign = (*bit_no_p < len ? readBit(in, *bit_no_p) : 0);
-    (*bit_no_p)++;
-    if (*bit_no_p + uni_bit_len[idx] - 1 >= len)
-      return 0x7FFFFF00 + 99;
-    int32_t count = getNumFromBits(in, len, *bit_no_p, uni_bit_len[idx]);
-    count += uni_adder[idx];
-    (*bit_no_p) += uni_bit_len[idx];
-    //printf("Sign: %d, Val:%d", sign, count);
-    return sign ? -count : count;
-  }
-  return 0;
+  const int bit_len = uni_bit_len[idx];
+  if (step_len + 1 + bit_len > avail)
+    return 0x7FFFFF00 + 99;
+  br->bit_no += step_len + 1 + bit_len;
+  const int sign = (code << step_len) >> 31;
+  int32_t count = (int32_t) ((code << (step_len + 1)) >> (32 - bit_len)) + uni_adder[idx];
+  //printf("Sign: %d, Val:%d", sign, count);
+  return sign ? -count : count;
 }
 
-/// Macro to ensure that the decoder does not append more than olen bytes to out
+/// Macro to ensure that the decoder does not append more than olen bytes to out. \n
+/// If out is NULL, the character is only counted
 #define DEC_OUTPUT_CHAR(out, olen, ol, c) do { \
   char *const obuf = (out); \
   const int oidx = (ol); \
   const int limit = (olen); \
   if (limit <= oidx) return limit + 1; \
   else if (oidx < 0) return 0; \
-  else obuf[oidx] = (c); \
+  else if (obuf) obuf[oidx] = (c); \
 } while (0)
 
 /// Macro to ensure that the decoder does not append more than olen bytes to out
@@ -1029,8 +2127,13 @@ int32_t readUnicode(const char *in, int *bit_no_p, int len) {
   if (newidx > limit) return limit + 1; \
 } while (0)
 
-/// Write given unicode code point to out as a UTF-8 sequence
+/// Write given unicode code point to out as a UTF-8 sequence. \n
+/// If out is NULL, only the length of the sequence is added to ol
 int writeUTF8(char *out, int olen, int ol, int uni) {
+  if (out == NULL) {
+    ol += (uni < (1 << 11) ? 2 : (uni < (1 << 16) ? 3 : 4));
+    return ol > olen ? olen + 1 : ol;
+  }
   if (uni < (1 << 11)) {
     DEC_OUTPUT_CHAR(out, olen, ol++, 0xC0 + (uni >> 6));
     DEC_OUTPUT_CHAR(out, olen, ol++, 0x80 + (uni & 0x3F));
@@ -1048,16 +2151,17 @@ int writeUTF8(char *out, int olen, int ol, int uni) {
   return ol;
 }
 
-/// Decode repeating sequence and appends to out
-int decodeRepeat(const char *in, int len, char *out, int olen, int ol, int *bit_no, struct us_lnk_lst *prev_lines) {
+/// Decode repeating sequence and appends to out. \n
+/// If out is NULL, only dict_len is added to ol
+int decodeRepeat(struct usx_bit_reader *br, char *out, int olen, int ol, struct us_lnk_lst *prev_lines) {
   if (prev_lines) {
-    int32_t dict_len = readCount(in, bit_no, len) + NICE_LEN;
+    int32_t dict_len = readCount(br) + NICE_LEN;
     if (dict_len < NICE_LEN)
       return -1;
-    int32_t dist = readCount(in, bit_no, len);
+    int32_t dist = readCount(br);
     if (dist < 0)
       return -1;
-    int32_t ctx = readCount(in, bit_no, len);
+    int32_t ctx = readCount(br);
     if (ctx < 0)
       return -1;
     struct us_lnk_lst *cur_line = prev_lines;
@@ -1067,16 +2171,17 @@ int decodeRepeat(const char *in, int len, char *out, int olen, int ol, int *bit_
     if (cur_line == NULL)
       return -1;
     if (left <= 0) return olen + 1;
-    if (dist >= strlen(cur_line->data))
+    if (dist >= (int32_t) strlen(cur_line->data))
       return -1;
-    memmove(out + ol, cur_line->data + dist, min_of(left, dict_len));
+    if (out)
+      memmove(out + ol, cur_line->data + dist, min_of(left, dict_len));
     if (left < dict_len) return olen + 1;
     ol += dict_len;
   } else {
-    int32_t dict_len = readCount(in, bit_no, len) + NICE_LEN;
+    int32_t dict_len = readCount(br) + NICE_LEN;
     if (dict_len < NICE_LEN)
       return -1;
-    int32_t dist = readCount(in, bit_no, len) + NICE_LEN - 1;
+    int32_t dist = readCount(br) + NICE_LEN - 1;
     if (dist < NICE_LEN - 1)
       return -1;
     const int32_t left = olen - ol;
@@ -1084,7 +2189,8 @@ int decodeRepeat(const char *in, int len, char *out, int olen, int ol, int *bit_
     if (left <= 0) return olen + 1;
     if (ol - dist < 0)
       return -1;
-    memmove(out + ol, out + ol - dist, min_of(left, dict_len));
+    if (out)
+      memmove(out + ol, out + ol - dist, min_of(left, dict_len));
     if (left < dict_len) return olen + 1;
     ol += dict_len;
   }
@@ -1100,32 +2206,34 @@ char getHexChar(int32_t nibble, int hex_type) {
   return 'A' + nibble - 10;
 }
 
-// Main API function. See unishox2.h for documentation
-int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen), const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[], const char *usx_freq_seq[], const char *usx_templates[], struct us_lnk_lst *prev_lines) {
+/// Decompresses in to out, always honouring olen irrespective of UNISHOX_API_WITH_OUTPUT_LEN. \n
+/// If out is NULL, the bitstream is only walked to find the length of the output
+int usx_decompress_lines_with_len(const char *in, int len, char *out, int olen, const struct unishox2_ctx *ctx, struct us_lnk_lst *prev_lines) {
 
+  const uint8_t *usx_hcode_lens = ctx->usx_hcode_lens;
+  const char **usx_freq_seq = ctx->usx_freq_seq;
+  const char **usx_templates = ctx->usx_templates;
+  const uint8_t (*sets)[28] = ctx->has_custom_sets ? (const uint8_t (*)[28]) ctx->usx_sets : usx_sets;
   int dstate;
-  int bit_no;
+  struct usx_bit_reader br;
   int h, v;
   uint8_t is_all_upper;
-#if (UNISHOX_API_OUT_AND_LEN(0,1)) == 0
-  const int olen = INT_MAX - 1;
-#endif
 
-  init_coder();
   int ol = 0;
-  bit_no = UNISHOX_MAGIC_BIT_LEN; // ignore the magic bit
+  usx_br_init(&br, in, len);
+  br.bit_no = UNISHOX_MAGIC_BIT_LEN; // ignore the magic bit
   dstate = h = USX_ALPHA;
   is_all_upper = 0;
 
   int prev_uni = 0;
 
   len <<= 3;
-  while (bit_no < len) {
-    int orig_bit_no = bit_no;
+  while (br.bit_no < len) {
+    int orig_bit_no = br.bit_no;
     if (dstate == USX_DELTA || h == USX_DELTA) {
       if (dstate != USX_DELTA)
         h = dstate;
-      int32_t delta = readUnicode(in, &bit_no, len);
+      int32_t delta = readUnicode(&br);
       if ((delta >> 8) == 0x7FFFFF) {
         int spl_code_idx = delta & 0x000000FF;
         if (spl_code_idx == 99)
@@ -1135,9 +2243,9 @@ int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(c
             DEC_OUTPUT_CHAR(out, olen, ol++, ' ');
             continue;
           case 1:
-            h = readHCodeIdx(in, len, &bit_no, usx_hcodes, usx_hcode_lens);
+            h = readHCodeIdx(&br, ctx);
             if (h == 99) {
-              bit_no = len;
+              br.bit_no = len;
               continue;
             }
             if (h == USX_DELTA || h == USX_ALPHA) {
@@ -1145,7 +2253,7 @@ int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(c
               continue;
             }
             if (h == USX_DICT) {
-              int rpt_ret = decodeRepeat(in, len, out, olen, ol, &bit_no, prev_lines);
+              int rpt_ret = decodeRepeat(&br, out, olen, ol, prev_lines);
               if (rpt_ret < 0)
                 return ol; // if we break here it will only break out of switch
               DEC_OUTPUT_CHARS(olen, ol = rpt_ret);
@@ -1174,38 +2282,38 @@ int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(c
       h = dstate;
     char c = 0;
     uint8_t is_upper = is_all_upper;
-    v = readVCodeIdx(in, len, &bit_no);
+    v = readVCodeIdx(&br);
     if (v == 99 || h == 99) {
-      bit_no = orig_bit_no;
+      br.bit_no = orig_bit_no;
       break;
     }
     if (v == 0 && h != USX_SYM) {
-      if (bit_no >= len)
+      if (br.bit_no >= len)
         break;
       if (h != USX_NUM || dstate != USX_DELTA) {
-        h = readHCodeIdx(in, len, &bit_no, usx_hcodes, usx_hcode_lens);
-        if (h == 99 || bit_no >= len) {
-          bit_no = orig_bit_no;
+        h = readHCodeIdx(&br, ctx);
+        if (h == 99 || br.bit_no >= len) {
+          br.bit_no = orig_bit_no;
           break;
         }
       }
       if (h == USX_ALPHA) {
          if (dstate == USX_ALPHA) {
-           if (!usx_hcode_lens[USX_ALPHA] && TERM_BYTE_PRESET_1 == (read8bitCode(in, len, bit_no - SW_CODE_LEN) & (0xFF << (8 - (is_all_upper ? TERM_BYTE_PRESET_1_LEN_UPPER : TERM_BYTE_PRESET_1_LEN_LOWER)))))
+           if (!usx_hcode_lens[USX_ALPHA] && TERM_BYTE_PRESET_1 == (usx_br_peek_at(&br, br.bit_no - SW_CODE_LEN, 8) & (0xFF << (8 - (is_all_upper ? TERM_BYTE_PRESET_1_LEN_UPPER : TERM_BYTE_PRESET_1_LEN_LOWER)))))
              break; // Terminator for preset 1
            if (is_all_upper) {
              is_upper = is_all_upper = 0;
              continue;
            }
-           v = readVCodeIdx(in, len, &bit_no);
+           v = readVCodeIdx(&br);
            if (v == 99) {
-             bit_no = orig_bit_no;
+             br.bit_no = orig_bit_no;
              break;
            }
            if (v == 0) {
-              h = readHCodeIdx(in, len, &bit_no, usx_hcodes, usx_hcode_lens);
+              h = readHCodeIdx(&br, ctx);
               if (h == 99) {
-                bit_no = orig_bit_no;
+                br.bit_no = orig_bit_no;
                 break;
               }
               if (h == USX_ALPHA) {
@@ -1220,7 +2328,7 @@ int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(c
          }
       } else
       if (h == USX_DICT) {
-        int rpt_ret = decodeRepeat(in, len, out, olen, ol, &bit_no, prev_lines);
+        int rpt_ret = decodeRepeat(&br, out, olen, ol, prev_lines);
         if (rpt_ret < 0)
           break;
         DEC_OUTPUT_CHARS(olen, ol = rpt_ret);
@@ -1233,26 +2341,26 @@ int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(c
         continue;
       } else {
         if (h != USX_NUM || dstate != USX_DELTA)
-          v = readVCodeIdx(in, len, &bit_no);
+          v = readVCodeIdx(&br);
         if (v == 99) {
-          bit_no = orig_bit_no;
+          br.bit_no = orig_bit_no;
           break;
         }
         if (h == USX_NUM && v == 0) {
-          int idx = getStepCodeIdx(in, len, &bit_no, 5);
+          int idx = getStepCodeIdx(&br, 5);
           if (idx == 99)
             break;
           if (idx == 0) {
-            idx = getStepCodeIdx(in, len, &bit_no, 4);
+            idx = getStepCodeIdx(&br, 4);
             if (idx >= 5)
               break;
-            int32_t rem = readCount(in, &bit_no, len);
+            int32_t rem = readCount(&br);
             if (rem < 0)
               break;
             if (usx_templates[idx] == NULL)
               break;
             size_t tlen = strlen(usx_templates[idx]);
-            if (rem > tlen)
+            if (rem > (int32_t) tlen)
               break;
             rem = tlen - rem;
             int eof = 0;
@@ -1260,31 +2368,31 @@ int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(c
               char c_t = usx_templates[idx][j];
               if (c_t == 'f' || c_t == 'r' || c_t == 't' || c_t == 'o' || c_t == 'F') {
                   char nibble_len = (c_t == 'f' || c_t == 'F' ? 4 : (c_t == 'r' ? 3 : (c_t == 't' ? 2 : 1)));
-                  const int32_t raw_char = getNumFromBits(in, len, bit_no, nibble_len);
+                  const int32_t raw_char = getNumFromBits(&br, nibble_len);
                   if (raw_char < 0) {
                       eof = 1;
                       break;
                   }
                   DEC_OUTPUT_CHAR(out, olen, ol++, getHexChar((char)raw_char,
                       c_t == 'f' ? USX_NIB_HEX_LOWER : USX_NIB_HEX_UPPER));
-                  bit_no += nibble_len;
+                  br.bit_no += nibble_len;
               } else
                 DEC_OUTPUT_CHAR(out, olen, ol++, c_t);
             }
             if (eof) break; // reach input eof
           } else
           if (idx == 5) {
-            int32_t bin_count = readCount(in, &bit_no, len);
+            int32_t bin_count = readCount(&br);
             if (bin_count < 0)
               break;
             if (bin_count == 0) // invalid encoding
               break;
             do {
-              const int32_t raw_char = getNumFromBits(in, len, bit_no, 8);
+              const int32_t raw_char = getNumFromBits(&br, 8);
               if (raw_char < 0)
                   break;
               DEC_OUTPUT_CHAR(out, olen, ol++, (char)raw_char);
-              bit_no += 8;
+              br.bit_no += 8;
             } while (--bin_count);
             if (bin_count > 0) break; // reach input eof
           } else {
@@ -1292,20 +2400,20 @@ int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(c
             if (idx == 2 || idx == 4)
               nibble_count = 32;
             else {
-              nibble_count = readCount(in, &bit_no, len);
+              nibble_count = readCount(&br);
               if (nibble_count < 0)
                 break;
               if (nibble_count == 0) // invalid encoding
                 break;
             }
             do {
-              int32_t nibble = getNumFromBits(in, len, bit_no, 4);
+              int32_t nibble = getNumFromBits(&br, 4);
               if (nibble < 0)
                   break;
               DEC_OUTPUT_CHAR(out, olen, ol++, getHexChar(nibble, idx < 3 ? USX_NIB_HEX_LOWER : USX_NIB_HEX_UPPER));
               if ((idx == 2 || idx == 4) && (nibble_count == 25 || nibble_count == 21 || nibble_count == 17 || nibble_count == 13))
                 DEC_OUTPUT_CHAR(out, olen, ol++, '-');
-              bit_no += 4;
+              br.bit_no += 4;
             } while (--nibble_count);
             if (nibble_count > 0) break; // reach input eof
           }
@@ -1320,26 +2428,27 @@ int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(c
       continue;
     }
     if (h < 3 && v < 28)
-      c = usx_sets[h][v];
-    if (c >= 'a' && c <= 'z') {
+      c = (char) sets[h][v];
+    if (c && h == USX_ALPHA && v > 1) {
       dstate = USX_ALPHA;
-      if (is_upper)
+      if (is_upper && ((c >= 'a' && c <= 'z') || ((uint8_t) c >= 0xE0 && (uint8_t) c != 0xF7 && (uint8_t) c != 0xFF)))
         c -= 32;
     } else {
       if (c >= '0' && c <= '9') {
-        dstate = USX_NUM;
+        if (h == USX_NUM)
+          dstate = USX_NUM;
       } else if (c == 0) {
         if (v == 8) {
           DEC_OUTPUT_CHAR(out, olen, ol++, '\r');
           DEC_OUTPUT_CHAR(out, olen, ol++, '\n');
         } else if (h == USX_NUM && v == 26) {
-          int32_t count = readCount(in, &bit_no, len);
+          int32_t count = readCount(&br);
           if (count < 0)
             break;
           count += 4;
           if (ol <= 0)
             return 0; // invalid encoding
-          char rpt_c = out[ol - 1];
+          char rpt_c = (out ? out[ol - 1] : 0);
           while (count--)
             DEC_OUTPUT_CHAR(out, olen, ol++, rpt_c);
         } else if (h == USX_SYM && v > 24) {
@@ -1347,7 +2456,8 @@ int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(c
           const int freqlen = (int)strlen(usx_freq_seq[v]);
           const int left = olen - ol;
           if (left <= 0) return olen + 1;
-          memcpy(out + ol, usx_freq_seq[v], min_of(left, freqlen));
+          if (out)
+            memcpy(out + ol, usx_freq_seq[v], min_of(left, freqlen));
           if (left < freqlen) return olen + 1;
           ol += freqlen;
         } else if (h == USX_NUM && v > 22 && v < 26) {
@@ -1355,7 +2465,8 @@ int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(c
           const int freqlen = (int)strlen(usx_freq_seq[v]);
           const int left = olen - ol;
           if (left <= 0) return olen + 1;
-          memcpy(out + ol, usx_freq_seq[v], min_of(left, freqlen));
+          if (out)
+            memcpy(out + ol, usx_freq_seq[v], min_of(left, freqlen));
           if (left < freqlen) return olen + 1;
           ol += freqlen;
         } else
@@ -1367,13 +2478,36 @@ int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(c
     }
     if (dstate == USX_DELTA)
       h = USX_DELTA;
-    DEC_OUTPUT_CHAR(out, olen, ol++, c);
+    if ((uint8_t) c >= 0x80)
+      DEC_OUTPUT_CHARS(olen, ol = writeUTF8(out, olen, ol, (uint8_t) c));
+    else
+      DEC_OUTPUT_CHAR(out, olen, ol++, c);
   }
 
   return ol;
 
 }
 
+// Main API function. See unishox2.h for documentation
+int unishox2_decompress_lines_ctx(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen), const struct unishox2_ctx *ctx, struct us_lnk_lst *prev_lines) {
+#if (UNISHOX_API_OUT_AND_LEN(0,1)) == 0
+  const int olen = INT_MAX - 1;
+#endif
+  return usx_decompress_lines_with_len(in, len, out, olen, ctx, prev_lines);
+}
+
+// Main API function. See unishox2.h for documentation
+int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen), const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[], const char *usx_freq_seq[], const char *usx_templates[], struct us_lnk_lst *prev_lines) {
+  struct unishox2_ctx ctx;
+  usx_set_ctx_params(&ctx, usx_hcodes, usx_hcode_lens, usx_freq_seq, usx_templates);
+  return unishox2_decompress_lines_ctx(in, len, UNISHOX_API_OUT_AND_LEN(out, olen), &ctx, prev_lines);
+}
+
+// Main API function. See unishox2.h for documentation
+int unishox2_decompress_ctx(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen), const struct unishox2_ctx *ctx) {
+  return unishox2_decompress_lines_ctx(in, len, UNISHOX_API_OUT_AND_LEN(out, olen), ctx, NULL);
+}
+
 // Main API function. See unishox2.h for documentation
 int unishox2_decompress(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen), const uint8_t usx_hcodes[], const uint8_t usx_hcode_lens[], const char *usx_freq_seq[], const char *usx_templates[]) {
   return unishox2_decompress_lines(in, len, UNISHOX_API_OUT_AND_LEN(out, olen), usx_hcodes, usx_hcode_lens, usx_freq_seq, usx_templates, NULL);
@@ -1383,3 +2517,681 @@ int unishox2_decompress(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *o
 int unishox2_decompress_simple(const char *in, int len, char *out) {
   return unishox2_decompress(in, len, UNISHOX_API_OUT_AND_LEN(out, INT_MAX - 1), USX_PSET_DFLT);
 }
+
+// Size query API function. See unishox2.h for documentation
+int unishox2_decompressed_size(const char *in, int len, const struct unishox2_ctx *ctx) {
+  return usx_decompress_lines_with_len(in, len, NULL, INT_MAX - 1, ctx, NULL);
+}
+
+// Size query API function. See unishox2.h for documentation
+int unishox2_decompressed_size_simple(const char *in, int len) {
+  struct unishox2_ctx ctx;
+  usx_set_ctx_params(&ctx, USX_HCODES_DFLT, USX_HCODE_LENS_DFLT, USX_FREQ_SEQ_DFLT, USX_TEMPLATES);
+  return unishox2_decompressed_size(in, len, &ctx);
+}
+
+/// Allocator used by unishox2_decompress_alloc() when none is given
+void *usx_default_alloc(size_t size, void *alloc_ctx) {
+  (void) alloc_ctx;
+  return malloc(size);
+}
+
+// Allocating API function. See unishox2.h for documentation
+char *unishox2_decompress_alloc(const char *in, int len, const struct unishox2_ctx *ctx,
+              void *(*alloc_fn)(size_t size, void *alloc_ctx), void *alloc_ctx, int *out_len) {
+  const int dlen = unishox2_decompressed_size(in, len, ctx);
+  if (alloc_fn == NULL)
+    alloc_fn = usx_default_alloc;
+  char *out = (char *) alloc_fn((size_t) dlen + 1, alloc_ctx);
+  if (out == NULL)
+    return NULL;
+  int ol = usx_decompress_lines_with_len(in, len, out, dlen, ctx, NULL);
+  if (ol > dlen)
+    ol = dlen;
+  out[ol] = '\0';
+  if (out_len)
+    *out_len = ol;
+  return out;
+}
+
+// Batch API function. See unishox2.h for documentation
+int unishox2_compress_batch(const char *in[], const int in_lens[], int count, UNISHOX_API_OUT_AND_LEN(char *out, int olen), int out_offsets[], const struct unishox2_ctx *ctx) {
+#if (UNISHOX_API_OUT_AND_LEN(0,1)) == 0
+  const int olen = INT_MAX - 1;
+#endif
+  int max_len = 0;
+  for (int i = 0; i < count; i++) {
+    if (max_len < in_lens[i])
+      max_len = in_lens[i];
+  }
+  struct usx_scratch scratch;
+  usx_scratch_init(&scratch, max_len);
+  int ol = 0;
+  for (int i = 0; i < count; i++) {
+    out_offsets[i] = ol;
+    const int left = olen - ol;
+    const int clen = usx_compress_lines_scratch(in[i], in_lens[i], out + ol, left, ctx, NULL, NULL, NULL, &scratch, NULL);
+    if (clen > left) {
+      ol = olen + 1;
+      break;
+    }
+    ol += clen;
+  }
+  usx_scratch_free(&scratch);
+  if (ol > olen)
+    return olen + 1;
+  out_offsets[count] = ol;
+  return ol;
+}
+
+// Batch API function. See unishox2.h for documentation
+int unishox2_decompress_batch(const char *in, const int in_offsets[], int count, UNISHOX_API_OUT_AND_LEN(char *out, int olen), int out_offsets[], const struct unishox2_ctx *ctx) {
+#if (UNISHOX_API_OUT_AND_LEN(0,1)) == 0
+  const int olen = INT_MAX - 1;
+#endif
+  int ol = 0;
+  for (int i = 0; i < count; i++) {
+    out_offsets[i] = ol;
+    const int left = olen - ol;
+    const int dlen = usx_decompress_lines_with_len(in + in_offsets[i], in_offsets[i + 1] - in_offsets[i], out + ol, left, ctx, NULL);
+    if (dlen > left)
+      return olen + 1;
+    ol += dlen;
+  }
+  out_offsets[count] = ol;
+  return ol;
+}
+
+/// Reads unsigned 32 bit little endian number
+static inline uint32_t usx_read_u32le(const unsigned char *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// String table API function. See unishox2.h for documentation
+int unishox2_table_open(struct unishox2_table *t, const void *data, size_t size) {
+  const unsigned char *d = (const unsigned char *) data;
+  memset(t, 0, sizeof(*t));
+  if (size < UNISHOX_TABLE_HEADER_LEN || memcmp(d, UNISHOX_TABLE_MAGIC, 4) != 0 || d[4] != UNISHOX_TABLE_VERSION)
+    return 0;
+  const uint32_t line_count = usx_read_u32le(d + 8);
+  const uint32_t max_len = usx_read_u32le(d + 12);
+  const uint32_t payload_len = usx_read_u32le(d + 16);
+  if (line_count >= INT_MAX / 4 || max_len >= INT_MAX)
+    return 0;
+  const size_t offsets_len = ((size_t) line_count + 1) * 4;
+  if (size - UNISHOX_TABLE_HEADER_LEN < offsets_len || size - UNISHOX_TABLE_HEADER_LEN - offsets_len < payload_len)
+    return 0;
+  t->offsets = d + UNISHOX_TABLE_HEADER_LEN;
+  t->payload = t->offsets + offsets_len;
+  if (usx_read_u32le(t->offsets + line_count * 4) != payload_len)
+    return 0;
+  t->line_count = (int) line_count;
+  t->max_len = (int) max_len;
+  t->preset = d[5];
+  t->payload_len = payload_len;
+  return 1;
+}
+
+// String table API function. See unishox2.h for documentation
+int unishox2_table_get(const struct unishox2_table *t, int i, UNISHOX_API_OUT_AND_LEN(char *out, int olen), const struct unishox2_ctx *ctx) {
+#if (UNISHOX_API_OUT_AND_LEN(0,1)) == 0
+  const int olen = t->max_len;
+#endif
+  if (i < 0 || i >= t->line_count)
+    return -1;
+  const uint32_t start = usx_read_u32le(t->offsets + i * 4);
+  const uint32_t end = usx_read_u32le(t->offsets + i * 4 + 4);
+  if (start > end || end > t->payload_len)
+    return -1;
+  return usx_decompress_lines_with_len((const char *) t->payload + start, (int) (end - start), out, olen, ctx, NULL);
+}
+
+#if UNISHOX_TABLE_MMAP
+
+// String table API function. See unishox2.h for documentation
+int unishox2_table_map(struct unishox2_table *t, const char *path) {
+  struct stat st;
+  memset(t, 0, sizeof(*t));
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &st) != 0 || st.st_size < UNISHOX_TABLE_HEADER_LEN) {
+    close(fd);
+    return 0;
+  }
+  void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+  if (!unishox2_table_open(t, map, (size_t) st.st_size)) {
+    munmap(map, (size_t) st.st_size);
+    return 0;
+  }
+  t->map = map;
+  t->map_len = (size_t) st.st_size;
+  return 1;
+}
+
+// String table API function. See unishox2.h for documentation
+void unishox2_table_unmap(struct unishox2_table *t) {
+  if (t->map != NULL)
+    munmap(t->map, t->map_len);
+  memset(t, 0, sizeof(*t));
+}
+
+#endif
+
+/// Parameter sets of the presets, in the order of their numbers. See unishox2_init_preset_ctx()
+static const struct usx_preset {
+  const uint8_t *hcodes;
+  const uint8_t *hcode_lens;
+  const char **freq_seq;
+  const char **templates;
+} usx_presets[UNISHOX_PRESET_COUNT] = {
+  {USX_PSET_DFLT}, {USX_PSET_ALPHA_ONLY}, {USX_PSET_ALPHA_NUM_ONLY}, {USX_PSET_ALPHA_NUM_SYM_ONLY},
+  {USX_PSET_ALPHA_NUM_SYM_ONLY_TXT}, {USX_PSET_FAVOR_ALPHA}, {USX_PSET_FAVOR_DICT}, {USX_PSET_FAVOR_SYM},
+  {USX_PSET_FAVOR_UMLAUT}, {USX_PSET_NO_DICT}, {USX_PSET_NO_UNI}, {USX_PSET_NO_UNI_FAVOR_TEXT},
+  {USX_PSET_URL}, {USX_PSET_JSON}, {USX_PSET_JSON_NO_UNI}, {USX_PSET_XML}, {USX_PSET_HTML}
+};
+
+// Preset API function. See unishox2.h for documentation
+void unishox2_init_preset_ctx(struct unishox2_ctx *ctx, int preset) {
+  const struct usx_preset *p = &usx_presets[(preset < 0 || preset >= UNISHOX_PRESET_COUNT) ? 0 : preset];
+  unishox2_init_ctx(ctx, p->hcodes, p->hcode_lens, p->freq_seq, p->templates);
+}
+
+/// Byte classes seen by the preset selector
+enum {USX_BC_LOWER = 0, USX_BC_UPPER, USX_BC_SPACE, USX_BC_DIGIT, USX_BC_NUM_SYM, USX_BC_SYM,
+      USX_BC_CTRL, USX_BC_UTF8_LEAD, USX_BC_UTF8_CONT, USX_BC_COUNT};
+
+/// Classes that some presets cannot encode, one of each of which excludes all of them
+#define USX_BC_RESTRICTED ((1u << USX_BC_SYM) | (1u << USX_BC_DIGIT) | (1u << USX_BC_UTF8_LEAD))
+
+/// Class of each byte value for the preset selector. USX_BC_NUM_SYM are the symbols of the USX_NUM set
+static const uint8_t usx_byte_classes[256] = {
+  6, 6, 6, 6, 6, 6, 6, 6, 6, 5, 5, 6, 6, 5, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6, 6,
+  2, 5, 5, 4, 4, 4, 5, 5, 4, 4, 5, 4, 4, 4, 4, 4, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 5, 5, 5, 4, 5, 5,
+  5, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 5, 5, 5, 5, 5,
+  5, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 5, 5, 5, 5, 6,
+  8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+  8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8, 8,
+  7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7
+};
+
+/// Set switched to before a byte, or USX_NUM_TEMP if none, and the state after it, \n
+/// for the states USX_ALPHA, USX_NUM and USX_DELTA of the selector, numbered 0 to 2
+#define USX_SELECT_MOVE(set, state) (((set) << 5) | ((state) << 3))
+#define USX_SELECT_MOVES(alpha, num, delta) ((uint32_t) (alpha) | ((uint32_t) (num) << 8) | ((uint32_t) (delta) << 16))
+#define USX_SELECT_NO_SWITCH USX_NUM_TEMP
+/// Moves of the selector for each byte class in each of its states. \n
+/// Upper case letters are counted as a switch to USX_ALPHA as they cost the same
+static const uint32_t usx_select_moves[USX_BC_COUNT] = {
+  USX_SELECT_MOVES(USX_SELECT_MOVE(USX_SELECT_NO_SWITCH, 0), USX_SELECT_MOVE(USX_ALPHA, 0), USX_SELECT_MOVE(USX_ALPHA, 0)),
+  USX_SELECT_MOVES(USX_SELECT_MOVE(USX_ALPHA, 0), USX_SELECT_MOVE(USX_ALPHA, 0), USX_SELECT_MOVE(USX_ALPHA, 0)),
+  USX_SELECT_MOVES(USX_SELECT_MOVE(USX_SELECT_NO_SWITCH, 0), USX_SELECT_MOVE(USX_SELECT_NO_SWITCH, 1), USX_SELECT_MOVE(USX_SELECT_NO_SWITCH, 2)),
+  USX_SELECT_MOVES(USX_SELECT_MOVE(USX_NUM, 1), USX_SELECT_MOVE(USX_SELECT_NO_SWITCH, 1), USX_SELECT_MOVE(USX_NUM, 1)),
+  USX_SELECT_MOVES(USX_SELECT_MOVE(USX_NUM, 0), USX_SELECT_MOVE(USX_SELECT_NO_SWITCH, 1), USX_SELECT_MOVE(USX_NUM, 2)),
+  USX_SELECT_MOVES(USX_SELECT_MOVE(USX_SYM, 0), USX_SELECT_MOVE(USX_SYM, 1), USX_SELECT_MOVE(USX_SYM, 2)),
+  USX_SELECT_MOVES(USX_SELECT_MOVE(USX_NUM, 0), USX_SELECT_MOVE(USX_NUM, 1), USX_SELECT_MOVE(USX_NUM, 2)),
+  USX_SELECT_MOVES(USX_SELECT_MOVE(USX_DELTA, 2), USX_SELECT_MOVE(USX_DELTA, 2), USX_SELECT_MOVE(USX_SELECT_NO_SWITCH, 2)),
+  USX_SELECT_MOVES(USX_SELECT_MOVE(USX_SELECT_NO_SWITCH, 0), USX_SELECT_MOVE(USX_SELECT_NO_SWITCH, 1), USX_SELECT_MOVE(USX_SELECT_NO_SWITCH, 2))
+};
+
+/// Switches are counted in 16 bit fields of one number, at these shifts for each set
+static const uint8_t usx_select_switch_shifts[USX_NUM_TEMP + 1] = {0, 16, 32, 0, 48, 0};
+static const uint64_t usx_select_switch_incs[USX_NUM_TEMP + 1] = {1, 1ULL << 16, 1ULL << 32, 0, 1ULL << 48, 0};
+
+/// Number of sets of frequent sequences told apart by the selector, which is more than the presets have. \n
+/// Each has 6 bits in the bitmaps of the sequences below
+#define USX_SELECT_SEQ_SETS 10
+/// Bit of sequence i of the given set of usx_select_seqs
+#define USX_SEQ_BIT(set, i) (1ULL << ((set) * 6 + (i)))
+
+/// Contexts of all the presets, including lookup tables, used by the auto API
+static struct unishox2_ctx usx_preset_ctxs[UNISHOX_PRESET_COUNT];
+/// Sets of frequent sequences of the presets, each once, in the order of the presets first having them
+static const char **usx_select_seqs[USX_SELECT_SEQ_SETS];
+/// Index in usx_select_seqs of the frequent sequences of each preset
+static uint8_t usx_preset_seq_sets[UNISHOX_PRESET_COUNT];
+/// Sequences of usx_select_seqs starting with each byte
+static uint64_t usx_select_seq_starts[256];
+/// Sequences of usx_select_seqs having each byte as the second
+static uint64_t usx_select_seq_seconds[256];
+#if UNISHOX_BATCH_THREADS
+static pthread_once_t usx_presets_once = PTHREAD_ONCE_INIT;
+#else
+static int usx_presets_built;
+#endif
+
+/// Builds usx_preset_ctxs and the tables above from the frequent sequences of usx_presets
+static void usx_build_presets(void) {
+  int set_count = 0;
+  for (int preset = 0; preset < UNISHOX_PRESET_COUNT; preset++) {
+    const char **freq_seq = usx_presets[preset].freq_seq;
+    unishox2_init_preset_ctx(&usx_preset_ctxs[preset], preset);
+    int set = 0;
+    while (set < set_count && usx_select_seqs[set] != freq_seq)
+      set++;
+    if (set == set_count && set_count < USX_SELECT_SEQ_SETS) {
+      usx_select_seqs[set_count++] = freq_seq;
+      for (int i = 0; i < 6; i++) {
+        if (freq_seq[i][0] && freq_seq[i][1]) {
+          usx_select_seq_starts[(uint8_t) freq_seq[i][0]] |= USX_SEQ_BIT(set, i);
+          usx_select_seq_seconds[(uint8_t) freq_seq[i][1]] |= USX_SEQ_BIT(set, i);
+        }
+      }
+    }
+    usx_preset_seq_sets[preset] = (uint8_t) (set < USX_SELECT_SEQ_SETS ? set : USX_SELECT_SEQ_SETS - 1);
+  }
+}
+
+/// Builds the contexts and tables of the presets on first use
+static void usx_init_presets(void) {
+#if UNISHOX_BATCH_THREADS
+  pthread_once(&usx_presets_once, usx_build_presets);
+#else
+  if (!usx_presets_built) {
+    usx_build_presets();
+    usx_presets_built = 1;
+  }
+#endif
+}
+
+/// Returns the context of the given preset
+static const struct unishox2_ctx *usx_preset_ctx(int preset) {
+  usx_init_presets();
+  return &usx_preset_ctxs[preset];
+}
+
+/// Bits a repeat costs besides its switch code, and that a character costs on average
+#define USX_SELECT_RPT_BITS 16
+#define USX_SELECT_CHAR_BITS 5
+/// Largest number of bits of the hash used by the selector to find repeats
+#define USX_SELECT_HASH_BITS 10
+/// Repeats are looked for only at every this many positions, which finds those at distances \n
+/// that are multiples of it, so what is found is counted that many times
+#define USX_SELECT_RPT_STRIDE 4
+/// Repeats are not looked for in shorter strings
+#define USX_SELECT_RPT_MIN_LEN USX_MATCH_INDEX_MIN_LEN
+/// Switches, frequent sequences and repeats are counted only in this many bytes at the beginning, \n
+/// which keeps the counts within the 16 bit fields of usx_select_switch_incs
+#define USX_SELECT_SAMPLE_LEN 1024
+
+// Preset API function. See unishox2.h for documentation
+int unishox2_select_preset(const char *in, int len) {
+  int seq_bytes[USX_SELECT_SEQ_SETS] = {0}, seq_syms[USX_SELECT_SEQ_SETS] = {0};
+  int seq_codes[USX_SELECT_SEQ_SETS][2] = {{0}};
+  usx_init_presets();
+  int rpt_count = 0, rpt_saved = 0;
+  uint64_t switch_counts = 0;
+  unsigned int seen = 0;
+  int state = 0; // shift of the moves of the current state in usx_select_moves
+  const int sample_len = len < USX_SELECT_SAMPLE_LEN ? len : USX_SELECT_SAMPLE_LEN;
+  for (int l = 0; l < sample_len; l++) {
+    const uint8_t cls = usx_byte_classes[(uint8_t) in[l]];
+    const uint8_t move = (uint8_t) (usx_select_moves[cls] >> state);
+    seen |= 1u << cls;
+    switch_counts += usx_select_switch_incs[move >> 5];
+    state = move & 0x18;
+  }
+  // sequences are looked for only where their first two bytes match, which is seldom
+  for (int l = 0; l + 1 < sample_len; l++) {
+    for (uint64_t seqs = usx_select_seq_starts[(uint8_t) in[l]] & usx_select_seq_seconds[(uint8_t) in[l + 1]]; seqs; seqs &= seqs - 1) {
+      const int bit = usx_ctz64(seqs);
+      const char *seq = usx_select_seqs[bit / 6][bit % 6];
+      int j = 2;
+      while (seq[j] && l + j < len && seq[j] == in[l + j])
+        j++;
+      if (seq[j] == 0) {
+        seq_bytes[bit / 6] += j;
+        while (j--)
+          seq_syms[bit / 6] += (usx_byte_classes[(uint8_t) seq[j]] == USX_BC_SYM);
+        seq_codes[bit / 6][bit % 6 >= 3]++;
+      }
+    }
+  }
+  // the rest is only classified to know which presets can encode it, until that is known
+  for (int l = sample_len; l < len && (seen & USX_BC_RESTRICTED) != USX_BC_RESTRICTED; l++)
+    seen |= 1u << usx_byte_classes[(uint8_t) in[l]];
+  // repeats found greedily through a small table of the last position of each hash
+  if (sample_len >= USX_SELECT_RPT_MIN_LEN) {
+    int head[1 << USX_SELECT_HASH_BITS];
+    int bits = 6;
+    while (bits < USX_SELECT_HASH_BITS && (sample_len >> bits) > 4)
+      bits++;
+    for (int i = 0; i < (1 << bits); i++)
+      head[i] = -1;
+    for (int l = 0; l + NICE_LEN <= sample_len; l += USX_SELECT_RPT_STRIDE) {
+      const int h = (int) (usx_nice_len_hash(in + l) >> (32 - bits));
+      const int from = head[h];
+      head[h] = l;
+      if (from >= 0 && memcmp(in + from, in + l, NICE_LEN) == 0) {
+        int m = NICE_LEN;
+        while (l + m < sample_len && in[from + m] == in[l + m])
+          m++;
+        if (m * USX_SELECT_CHAR_BITS > USX_SELECT_RPT_BITS + SW_CODE_LEN + 3) {
+          rpt_count += USX_SELECT_RPT_STRIDE;
+          rpt_saved += (m * USX_SELECT_CHAR_BITS - USX_SELECT_RPT_BITS - SW_CODE_LEN) * USX_SELECT_RPT_STRIDE;
+          l += m - m % USX_SELECT_RPT_STRIDE;
+        }
+      }
+    }
+  }
+  const int needs = ((seen & ((1u << USX_BC_SYM) | (1u << USX_BC_CTRL))) ? 1 << USX_SYM : 0)
+                  | ((seen & ((1u << USX_BC_DIGIT) | (1u << USX_BC_NUM_SYM))) ? 1 << USX_NUM : 0)
+                  | ((seen & ((1u << USX_BC_UTF8_LEAD) | (1u << USX_BC_UTF8_CONT))) ? 1 << USX_DELTA : 0);
+  // bits of each preset less what is the same for all of them, as a sum of counts times hcode lengths
+  int seq_const[USX_SELECT_SEQ_SETS], seq_sym[USX_SELECT_SEQ_SETS];
+  for (int set = 0; set < USX_SELECT_SEQ_SETS; set++) {
+    seq_const[set] = (seq_codes[set][0] + seq_codes[set][1]) * (SW_CODE_LEN + 8)
+                   - seq_bytes[set] * (USX_SELECT_CHAR_BITS - 1) - seq_syms[set] * SW_CODE_LEN;
+    seq_sym[set] = seq_codes[set][0] - seq_syms[set];
+  }
+  const int switches_alpha = (int) (switch_counts & 0xFFFF);
+  const int switches_sym = (int) ((switch_counts >> usx_select_switch_shifts[USX_SYM]) & 0xFFFF);
+  const int switches_num = (int) ((switch_counts >> usx_select_switch_shifts[USX_NUM]) & 0xFFFF);
+  const int switches_delta = (int) ((switch_counts >> usx_select_switch_shifts[USX_DELTA]) & 0xFFFF);
+  int best = 0;
+  int best_bits = INT_MAX;
+  for (int p = 0; p < UNISHOX_PRESET_COUNT; p++) {
+    const uint8_t *lens = usx_presets[p].hcode_lens;
+    // presets without a set cannot encode its characters
+    const int lacks = (lens[USX_SYM] ? 0 : 1 << USX_SYM) | (lens[USX_NUM] ? 0 : 1 << USX_NUM) | (lens[USX_DELTA] ? 0 : 1 << USX_DELTA);
+    if (lacks & needs)
+      continue;
+    const int set = usx_preset_seq_sets[p];
+    const int bits = switches_alpha * lens[USX_ALPHA] + (switches_sym + seq_sym[set]) * lens[USX_SYM]
+                   + (switches_num + seq_codes[set][1]) * lens[USX_NUM] + switches_delta * lens[USX_DELTA]
+                   + (lens[USX_DICT] ? rpt_count * lens[USX_DICT] : rpt_saved) + seq_const[set];
+    if (bits < best_bits) {
+      best_bits = bits;
+      best = p;
+    }
+  }
+  return best;
+}
+
+/// Strings shorter than this are compressed by unishox2_compress_auto() using preset 0 without sampling them
+#define USX_AUTO_SAMPLE_MIN_LEN 8
+
+// Preset API function. See unishox2.h for documentation
+int unishox2_compress_auto(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen)) {
+#if (UNISHOX_API_OUT_AND_LEN(0,1)) == 0
+  const int olen = INT_MAX - 1;
+#endif
+  if (olen < 1)
+    return olen + 1;
+  const int preset = (len < USX_AUTO_SAMPLE_MIN_LEN ? 0 : unishox2_select_preset(in, len));
+  out[0] = (char) preset;
+  const int clen = usx_compress_lines_with_len(in, len, out + 1, olen - 1, usx_preset_ctx(preset), NULL, NULL);
+  return clen > olen - 1 ? olen + 1 : clen + 1;
+}
+
+// Preset API function. See unishox2.h for documentation
+int unishox2_decompress_auto(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen)) {
+#if (UNISHOX_API_OUT_AND_LEN(0,1)) == 0
+  const int olen = INT_MAX - 1;
+#endif
+  if (len < 1 || (uint8_t) in[0] >= UNISHOX_PRESET_COUNT)
+    return -1;
+  return usx_decompress_lines_with_len(in + 1, len - 1, out, olen, usx_preset_ctx((uint8_t) in[0]), NULL);
+}
+
+#if UNISHOX_BATCH_THREADS
+
+/// A run of consecutive strings of a batch, the unit of work handed out to threads. \n
+/// After it is processed, its output lies at arena_pos in the arena of worker
+struct usx_mt_task {
+  int first;
+  int last;
+  int worker;
+  int arena_pos;
+};
+
+/// Range of task indices [head, tail) owned by a worker. \n
+/// The owner takes tasks from the head and idle workers steal from the tail
+struct usx_mt_deque {
+  pthread_mutex_t lock;
+  int head;
+  int tail;
+};
+
+struct usx_mt_engine;
+
+/// Per thread state including the arena into which it writes its output \n
+/// and the buffers it uses for compressing
+struct usx_mt_worker {
+  struct usx_mt_engine *eng;
+  int id;
+  char *arena;
+  int arena_len;
+  int arena_cap;
+  int failed;
+  struct usx_scratch scratch;
+};
+
+/// Shared state of one parallel batch call
+struct usx_mt_engine {
+  const struct unishox2_ctx *ctx;
+  const char **in;
+  const int *in_lens;
+  const char *cin;
+  const int *in_offsets;
+  int max_len;  ///< length of the longest input string when compressing, for sizing the scratch of workers
+  int (*code_one)(struct usx_mt_worker *w, int idx, char *out, int olen);
+  int *out_lens;
+  struct usx_mt_task *tasks;
+  struct usx_mt_deque *deques;
+  struct usx_mt_worker *workers;
+  int num_workers;
+};
+
+/// Compresses string idx of the batch into out
+int usx_mt_compress_one(struct usx_mt_worker *w, int idx, char *out, int olen) {
+  const struct usx_mt_engine *eng = w->eng;
+  return usx_compress_lines_scratch(eng->in[idx], eng->in_lens[idx], out, olen, eng->ctx, NULL, NULL, NULL, &w->scratch, NULL);
+}
+
+/// Decompresses string idx of the batch into out
+int usx_mt_decompress_one(struct usx_mt_worker *w, int idx, char *out, int olen) {
+  const struct usx_mt_engine *eng = w->eng;
+  const int start = eng->in_offsets[idx];
+  return usx_decompress_lines_with_len(eng->cin + start, eng->in_offsets[idx + 1] - start, out, olen, eng->ctx, NULL);
+}
+
+/// Takes the next task of the worker from its own deque, or steals one from another worker. \n
+/// Returns -1 when no task is left anywhere
+int usx_mt_next_task(struct usx_mt_engine *eng, int id) {
+  for (int i = 0; i < eng->num_workers; i++) {
+    const int victim = (id + i) % eng->num_workers;
+    struct usx_mt_deque *dq = &eng->deques[victim];
+    int task = -1;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head < dq->tail)
+      task = (victim == id ? dq->head++ : --dq->tail);
+    pthread_mutex_unlock(&dq->lock);
+    if (task >= 0)
+      return task;
+  }
+  return -1;
+}
+
+/// Processes the strings of a task into the arena of the worker, growing the arena when needed
+int usx_mt_run_task(struct usx_mt_worker *w, struct usx_mt_task *task) {
+  struct usx_mt_engine *eng = w->eng;
+  task->worker = w->id;
+  task->arena_pos = w->arena_len;
+  for (int i = task->first; i <= task->last; i++) {
+    int left = w->arena_cap - w->arena_len;
+    int olen = eng->code_one(w, i, w->arena + w->arena_len, left);
+    while (olen > left) {
+      if (w->arena_cap > INT_MAX / 2)
+        return 0;
+      char *arena = (char *) realloc(w->arena, w->arena_cap * 2);
+      if (arena == NULL)
+        return 0;
+      w->arena = arena;
+      w->arena_cap *= 2;
+      left = w->arena_cap - w->arena_len;
+      olen = eng->code_one(w, i, w->arena + w->arena_len, left);
+    }
+    eng->out_lens[i] = olen;
+    w->arena_len += olen;
+  }
+  return 1;
+}
+
+/// Thread function that keeps processing tasks until none are left
+void *usx_mt_worker_main(void *arg) {
+  struct usx_mt_worker *w = (struct usx_mt_worker *) arg;
+  int task;
+  while (!w->failed && (task = usx_mt_next_task(w->eng, w->id)) >= 0) {
+    if (!usx_mt_run_task(w, &w->eng->tasks[task]))
+      w->failed = 1;
+  }
+  return NULL;
+}
+
+/// Runs the batch over num_threads threads (the calling thread being one of them) \n
+/// and lays out the output in the same order as the single threaded batch functions. \n
+/// Returns -1 if resources could not be allocated, so that the caller can fall back to a single thread
+int usx_mt_run(struct usx_mt_engine *eng, int count, int in_total, char *out, int olen, int out_offsets[], int num_threads) {
+  // about 16 tasks per thread so that threads finishing early have something to steal
+  int task_size = count / (num_threads * 16);
+  if (task_size < 1)
+    task_size = 1;
+  const int task_count = (count + task_size - 1) / task_size;
+  if (num_threads > task_count)
+    num_threads = task_count;
+  eng->num_workers = num_threads;
+  eng->out_lens = (int *) malloc(count * sizeof(int));
+  eng->tasks = (struct usx_mt_task *) malloc(task_count * sizeof(struct usx_mt_task));
+  eng->deques = (struct usx_mt_deque *) malloc(num_threads * sizeof(struct usx_mt_deque));
+  eng->workers = (struct usx_mt_worker *) calloc(num_threads, sizeof(struct usx_mt_worker));
+  pthread_t *threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+  int ret = -1;
+  int started = 0;
+  int inited = 0;
+  if (eng->out_lens == NULL || eng->tasks == NULL || eng->deques == NULL || eng->workers == NULL || threads == NULL)
+    goto cleanup;
+  for (int i = 0; i < task_count; i++) {
+    eng->tasks[i].first = i * task_size;
+    eng->tasks[i].last = (i == task_count - 1 ? count - 1 : (i + 1) * task_size - 1);
+  }
+  // each worker starts with an equal share of consecutive tasks and an arena sized for its share
+  for (int i = 0; i < num_threads; i++) {
+    struct usx_mt_worker *w = &eng->workers[i];
+    w->eng = eng;
+    w->id = i;
+    w->arena_cap = in_total / num_threads + 64;
+    w->arena = (char *) malloc(w->arena_cap);
+    if (w->arena == NULL)
+      goto cleanup;
+    usx_scratch_init(&w->scratch, eng->max_len);
+    pthread_mutex_init(&eng->deques[i].lock, NULL);
+    eng->deques[i].head = (int) ((int64_t) task_count * i / num_threads);
+    eng->deques[i].tail = (int) ((int64_t) task_count * (i + 1) / num_threads);
+    inited++;
+  }
+  for (started = 1; started < num_threads; started++) {
+    if (pthread_create(&threads[started], NULL, usx_mt_worker_main, &eng->workers[started]))
+      break; // the remaining deques get stolen from by the running workers
+  }
+  usx_mt_worker_main(&eng->workers[0]);
+  for (int i = 1; i < started; i++)
+    pthread_join(threads[i], NULL);
+  for (int i = 0; i < num_threads; i++) {
+    if (eng->workers[i].failed)
+      goto cleanup;
+  }
+
+  // gather the arenas into out in the order of the input
+  int ol = 0;
+  for (int t = 0; t < task_count; t++) {
+    const struct usx_mt_task *task = &eng->tasks[t];
+    const char *src = eng->workers[task->worker].arena + task->arena_pos;
+    const int start = ol;
+    for (int i = task->first; i <= task->last; i++) {
+      out_offsets[i] = ol;
+      ol += eng->out_lens[i];
+    }
+    if (ol > olen || ol < start) {
+      ret = olen + 1;
+      goto cleanup;
+    }
+    memcpy(out + start, src, ol - start);
+  }
+  out_offsets[count] = ol;
+  ret = ol;
+
+cleanup:
+  for (int i = 0; i < inited; i++) {
+    free(eng->workers[i].arena);
+    usx_scratch_free(&eng->workers[i].scratch);
+    pthread_mutex_destroy(&eng->deques[i].lock);
+  }
+  free(threads);
+  free(eng->workers);
+  free(eng->deques);
+  free(eng->tasks);
+  free(eng->out_lens);
+  return ret;
+}
+
+/// Number of threads to use when 0 is passed for num_threads
+int usx_mt_default_threads(void) {
+  const long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int) n : 1;
+}
+
+// Batch API function. See unishox2.h for documentation
+int unishox2_compress_batch_mt(const char *in[], const int in_lens[], int count, UNISHOX_API_OUT_AND_LEN(char *out, int olen), int out_offsets[], const struct unishox2_ctx *ctx, int num_threads) {
+#if (UNISHOX_API_OUT_AND_LEN(0,1)) == 0
+  const int olen = INT_MAX - 1;
+#endif
+  if (num_threads <= 0)
+    num_threads = usx_mt_default_threads();
+  if (num_threads > 1 && count > 1) {
+    struct usx_mt_engine eng;
+    int64_t in_total = 0;
+    eng.max_len = 0;
+    for (int i = 0; i < count; i++) {
+      in_total += in_lens[i];
+      if (eng.max_len < in_lens[i])
+        eng.max_len = in_lens[i];
+    }
+    eng.ctx = ctx;
+    eng.in = in;
+    eng.in_lens = in_lens;
+    eng.code_one = usx_mt_compress_one;
+    const int ret = usx_mt_run(&eng, count, in_total > INT_MAX / 2 ? INT_MAX / 2 : (int) in_total, out, olen, out_offsets, num_threads);
+    if (ret >= 0)
+      return ret;
+  }
+  return unishox2_compress_batch(in, in_lens, count, UNISHOX_API_OUT_AND_LEN(out, olen), out_offsets, ctx);
+}
+
+// Batch API function. See unishox2.h for documentation
+int unishox2_decompress_batch_mt(const char *in, const int in_offsets[], int count, UNISHOX_API_OUT_AND_LEN(char *out, int olen), int out_offsets[], const struct unishox2_ctx *ctx, int num_threads) {
+#if (UNISHOX_API_OUT_AND_LEN(0,1)) == 0
+  const int olen = INT_MAX - 1;
+#endif
+  if (num_threads <= 0)
+    num_threads = usx_mt_default_threads();
+  if (num_threads > 1 && count > 1) {
+    struct usx_mt_engine eng;
+    const int64_t in_total = (int64_t) (in_offsets[count] - in_offsets[0]) * 2;
+    eng.ctx = ctx;
+    eng.max_len = 0;
+    eng.cin = in;
+    eng.in_offsets = in_offsets;
+    eng.code_one = usx_mt_decompress_one;
+    const int ret = usx_mt_run(&eng, count, in_total > INT_MAX / 2 ? INT_MAX / 2 : (int) in_total, out, olen, out_offsets, num_threads);
+    if (ret >= 0)
+      return ret;
+  }
+  return unishox2_decompress_batch(in, in_offsets, count, UNISHOX_API_OUT_AND_LEN(out, olen), out_offsets, ctx);
+}
+
+#endif
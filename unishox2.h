@@ -30,6 +30,8 @@
 #ifndef unishox2
 #define unishox2
 
+#include <stddef.h>
+
 #define UNISHOX_VERSION "2.0"   ///< Unicode spec version
 
 /**
@@ -67,6 +69,53 @@
 #else
 #  define UNISHOX_MAGIC_BIT_LEN 1
 #endif
+
+/// Set to 1 to decode vertical and horizontal codes with a single lookup in 256 entry tables. \n
+/// Faster, but uses more RAM, so disabled by default for Arduino and other small devices.
+#ifndef UNISHOX_DECODE_LOOKUP_TABLES
+#  define UNISHOX_DECODE_LOOKUP_TABLES 0
+#endif
+
+/// Set to 1 to encode each printable ASCII character with a single lookup of its code, \n
+/// including any switch code, for the current state. Uses 285 longs more per context.
+#ifndef UNISHOX_ENCODE_LOOKUP_TABLES
+#  define UNISHOX_ENCODE_LOOKUP_TABLES 0
+#endif
+
+/// Set to 1 for all API functions to find repeats within strings of 64 bytes or more using a hash chain index, \n
+/// which is allocated on the heap for each string and needs 4 bytes per input byte plus 16 KB. \n
+/// Otherwise only the batch functions and unishox2_compress_params() (given params) use the index \n
+/// and the other functions scan back from each position, which is slower for long strings \n
+/// but allocates no heap memory. The output is the same either way.
+#ifndef UNISHOX_MATCH_INDEX
+#  define UNISHOX_MATCH_INDEX 0
+#endif
+
+/// Maximum number of earlier positions tried for each repeat at UNISHOX_LEVEL_DEFAULT, 0 for no limit. \n
+/// With no limit the hash chain index finds the same repeats as the scan. A limit makes highly repetitive \n
+/// input compress faster, but the repeats found may be shorter.
+#ifndef UNISHOX_MATCH_CHAIN_DEPTH
+#  define UNISHOX_MATCH_CHAIN_DEPTH 0
+#endif
+
+/// Set to 1 to build unishox2_table_map() and unishox2_table_unmap(). \n
+/// Needs POSIX mmap(), so disabled by default.
+#ifndef UNISHOX_TABLE_MMAP
+#  define UNISHOX_TABLE_MMAP 0
+#endif
+
+/// Set to 1 to build unishox2_compress_batch_mt() and unishox2_decompress_batch_mt(). \n
+/// Needs POSIX threads (link with -pthread), so disabled by default.
+#ifndef UNISHOX_BATCH_THREADS
+#  define UNISHOX_BATCH_THREADS 0
+#endif
+
+/// Set to 1 to count how often each encoder path is taken and the bits it produces, \n
+/// into the struct unishox2_stats given in unishox2_params.stats to unishox2_compress_params(). \n
+/// Adds a counter update per path, so disabled by default.
+#ifndef UNISHOX_STATS
+#  define UNISHOX_STATS 0
+#endif
 /** @} */
 
 
@@ -125,6 +174,26 @@
 /// Length of each hcode for no Unicode characters
 #define USX_HCODE_LENS_NO_UNI (const unsigned char[]) {2, 2, 2, 2, 0}
 
+/// Default characters of the sets USX_ALPHA, USX_SYM and USX_NUM by vertical code, \n
+/// for comparing with or starting from when making sets for unishox2_init_ctx_sets()
+#define USX_SETS_DFLT (const unsigned char[][28]) { \
+  {  0, ' ', 'e', 't', 'a', 'o', 'i', 'n', 's', 'r', 'l', 'c', 'd', 'h', \
+   'u', 'p', 'm', 'b', 'g', 'w', 'f', 'y', 'v', 'k', 'q', 'j', 'x', 'z'}, \
+  {'"', '{', '}', '_', '<', '>', ':', '\n', 0, '[', ']', '\\', ';', '\'', \
+   '\t', '@', '*', '&', '?', '!', '^', '|', '\r', '~', '`', 0, 0, 0}, \
+  {  0, ',', '.', '0', '1', '9', '2', '5', '-', '/', '3', '4', '6', '7', \
+   '8', '(', ')', ' ', '=', '+', '$', '%', '#', 0, 0, 0, 0, 0}}
+
+/// Sets for French, German and Spanish text, having common accented small letters (Latin-1 code points) \n
+/// in place of the brackets and other symbols seldom found in such text, which are then escaped as binary
+#define USX_SETS_LATIN1 (const unsigned char[][28]) { \
+  {  0, ' ', 'e', 't', 'a', 'o', 'i', 'n', 's', 'r', 'l', 'c', 'd', 'h', \
+   'u', 'p', 'm', 'b', 'g', 'w', 'f', 'y', 'v', 'k', 'q', 'j', 'x', 'z'}, \
+  {'"', 0xE9, 0xE0, 0xE8, 0xF3, 0xED, ':', '\n', 0, 0xE1, 0xFC, 0xF6, ';', '\'', \
+   '\t', 0xFA, 0xF4, 0xDF, '?', '!', 0xE4, 0xF1, '\r', 0xE7, 0xEA, 0, 0, 0}, \
+  {  0, ',', '.', '0', '1', '9', '2', '5', '-', '/', '3', '4', '6', '7', \
+   '8', '(', ')', ' ', '=', '+', '$', '%', '#', 0, 0, 0, 0, 0}}
+
 extern const char * USX_FREQ_SEQ_DFLT[];
 extern const char * USX_FREQ_SEQ_TXT[];
 extern const char * USX_FREQ_SEQ_URL[];
@@ -173,6 +242,8 @@ extern const char * USX_TEMPLATES[];
 #define USX_PSET_XML USX_HCODES_DFLT, USX_HCODE_LENS_DFLT, USX_FREQ_SEQ_XML, USX_TEMPLATES
 /// Preset parameter set favouring HTML content
 #define USX_PSET_HTML USX_HCODES_DFLT, USX_HCODE_LENS_DFLT, USX_FREQ_SEQ_HTML, USX_TEMPLATES
+/// Number of presets above. They are numbered in the order they are defined, from 0 for USX_PSET_DFLT to 16 for USX_PSET_HTML
+#define UNISHOX_PRESET_COUNT 17
 /** @} */
 
 /**
@@ -184,6 +255,93 @@ struct us_lnk_lst {
   struct us_lnk_lst *previous;
 };
 
+/**
+ * This structure holds a parameter set and the lookup tables derived from it.
+ * It is built once using unishox2_init_ctx() and is only read by the *_ctx API functions,
+ * so the same context can be used by any number of threads at the same time.
+ */
+struct unishox2_ctx {
+  unsigned char usx_hcodes[5];         ///< Horizontal codes. See USX_HCODES_* macros
+  unsigned char usx_hcode_lens[5];     ///< Length of each element in usx_hcodes
+  const char **usx_freq_seq;           ///< Frequently occuring sequences. See USX_FREQ_SEQ_* macros
+  unsigned short usx_freq_seq_lens[6]; ///< Length of each frequent sequence, 0 if not present or its set is not used
+  unsigned char usx_freq_seq_starts[32]; ///< Bitmap of the bytes that start any of the frequent sequences
+  const char **usx_templates;          ///< Templates of frequently occuring patterns. See USX_TEMPLATES
+  unsigned short usx_template_lens[5]; ///< Length of each template, 0 if not present
+  unsigned short usx_template_min_lens[5]; ///< Number of leading characters of each template to be matched for using it
+  unsigned char usx_template_starts[32]; ///< Bitmap of the bytes that can start any of the templates
+  unsigned char has_custom_sets;       ///< Whether the sets below are used instead of the default sets
+  unsigned char usx_sets[3][28];       ///< Characters of the sets USX_ALPHA, USX_SYM and USX_NUM given to unishox2_init_ctx_sets()
+  unsigned char usx_code_94[94];       ///< Set and vertical code of each printable character from '!', 0xFF if not in usx_sets
+  unsigned char usx_code_latin1[128];  ///< Set and vertical code of each character from U+0080 to U+00FF, 0xFF if not in usx_sets
+#if UNISHOX_DECODE_LOOKUP_TABLES
+  unsigned char has_hcode_lookup;      ///< Whether hcode_lookup has been built
+  unsigned char hcode_lookup[256];     ///< Horizontal code (upper 4 bits length, lower 4 bits index) for the next 8 bits
+#endif
+#if UNISHOX_ENCODE_LOOKUP_TABLES
+  unsigned char has_emit_table;        ///< Whether emit_table has been built
+  unsigned long emit_table[3][95];     ///< Code bits << 8, length << 3 and next state for each of USX_ALPHA, USX_NUM, USX_DELTA and char - 32
+#endif
+};
+
+/**
+ * Position of NICE_LEN bytes within a line of a unishox2_line_index
+ */
+struct usx_line_entry {
+  int line;
+  int pos;
+  int prev;
+};
+
+/**
+ * Index of the lines compressed so far, used by unishox2_compress_lines_with_index() to find
+ * repeats in those lines without going through each of them.
+ * Built using unishox2_init_line_index() and unishox2_line_index_add() and freed using
+ * unishox2_free_line_index(). The fields are for internal use.
+ */
+struct unishox2_line_index {
+  const char **lines;
+  int *line_lens;
+  int line_count;
+  int line_cap;
+  int *longer_lines;
+  int longer_line_count;
+  int *head;
+  struct usx_line_entry *entries;
+  int entry_count;
+  int entry_cap;
+};
+
+/// Magic bytes at the beginning of a string table
+#define UNISHOX_TABLE_MAGIC "USXT"
+/// Version of the string table format
+#define UNISHOX_TABLE_VERSION 1
+/// Length of the string table header
+#define UNISHOX_TABLE_HEADER_LEN 20
+
+/**
+ * String table of independently compressed lines, for looking up any line without decompressing others.
+ * The table is laid out as follows, with all numbers being unsigned 32 bit little endian:
+ *
+ *   header:  UNISHOX_TABLE_MAGIC, version (1 byte), preset number (1 byte, 255 if custom), 2 bytes reserved,
+ *            line count, maximum line length, payload length
+ *   offsets: line count + 1 offsets of each compressed line in the payload
+ *   payload: compressed lines
+ *
+ * Opened using unishox2_table_open() on a buffer, or unishox2_table_map() on a file.
+ * The fields are for internal use, except line_count, max_len and preset.
+ */
+struct unishox2_table {
+  int line_count;
+  int max_len;
+  int preset;
+  const unsigned char *offsets;
+  const unsigned char *payload;
+  unsigned int payload_len;
+  void *map;
+  size_t map_len;
+};
+
 /**
  * This macro is for internal use, but builds upon the macro UNISHOX_API_WITH_OUTPUT_LEN
  * When the macro UNISHOX_API_WITH_OUTPUT_LEN is defined, the all the API functions
@@ -220,6 +378,20 @@ extern int unishox2_compress_simple(const char *in, int len, char *out);
  * @param[out] out  output buffer for ASCII / UTF-8 string - should be large enough
  */
 extern int unishox2_decompress_simple(const char *in, int len, char *out);
+/**
+ * Simple API for finding the length of the output of unishox2_compress_simple() without compressing
+ * @param[in] in    Input ASCII / UTF-8 string
+ * @param[in] len   length in bytes
+ * @return number of bytes unishox2_compress_simple() would write to out
+ */
+extern int unishox2_compressed_size_simple(const char *in, int len);
+/**
+ * Simple API for finding the length of the output of unishox2_decompress_simple() without decompressing
+ * @param[in] in    Input compressed bytes (output of unishox2_compress functions)
+ * @param[in] len   length of 'in' in bytes
+ * @return number of bytes unishox2_decompress_simple() would write to out
+ */
+extern int unishox2_decompressed_size_simple(const char *in, int len);
 /** 
  * Comprehensive API for compressing a string
  * 
@@ -296,4 +468,388 @@ extern int unishox2_decompress_lines(const char *in, int len, UNISHOX_API_OUT_AN
               struct us_lnk_lst *prev_lines);
 /** @} */
 
+/**
+ * @defgroup ctx_api Context API
+ * @brief Thread-safe API using a parameter set prepared beforehand
+ * @{
+ */
+/**
+ * Builds the context for the given parameter set
+ *
+ * Presets are available for the last four parameters so they can be passed as single parameter. \n
+ * See USX_PSET_* macros. Example call: \n
+ *    unishox2_init_ctx(&ctx, USX_PSET_ALPHA_ONLY);
+ *
+ * The hcodes are copied to the context, but usx_freq_seq and usx_templates are referenced, \n
+ * so they should outlive the context. Templates are scanned once here for their lengths and \n
+ * the characters they start with, so any set of 5 templates can be given at runtime without cost per call. \n
+ * Each template character 'f' or 'F' matches a hex digit, 'r' '0' to '7', 't' '0' to '3', 'o' '0' to '1', \n
+ * and any other character matches itself.
+ *
+ * @param[out] ctx           context to be built
+ * @param[in] usx_hcodes     Horizontal codes (array of bytes). See macro section for samples.
+ * @param[in] usx_hcode_lens Length of each element in usx_hcodes array
+ * @param[in] usx_freq_seq   Frequently occuring sequences. See USX_FREQ_SEQ_* macros for samples
+ * @param[in] usx_templates  Templates of frequently occuring patterns. See USX_TEMPLATES macro.
+ */
+extern void unishox2_init_ctx(struct unishox2_ctx *ctx, const unsigned char usx_hcodes[], const unsigned char usx_hcode_lens[],
+              const char *usx_freq_seq[], const char *usx_templates[]);
+/**
+ * Builds the context for the given parameter set, using the given characters in place of the default sets
+ *
+ * Example call: \n
+ *    unishox2_init_ctx_sets(&ctx, USX_PSET_DFLT, USX_SETS_LATIN1);
+ *
+ * The sets are copied to the context and the lookup tables of the encoder and decoder are derived from them here, \n
+ * so they are not built again on every call. As the vertical codes get longer with their position, \n
+ * the more frequent characters should come first in each set. The following positions are used by the format \n
+ * and should be as in USX_SETS_DFLT: USX_ALPHA 0 and 1 (space), USX_SYM 7, 8, 14, 22 and 25 to 27, \n
+ * USX_NUM 0, 17 (space) and 23 to 27. Other positions can have 0 (not used), printable ASCII characters \n
+ * other than space and upper case letters, or 0x80 to 0xFF for the Unicode characters U+0080 to U+00FF, \n
+ * each appearing only once. Upper case letters are encoded using their small letter if it is in USX_ALPHA. \n
+ * Characters not in the sets are escaped as binary or, if not ASCII, encoded as Unicode. \n
+ * The same sets are needed for decompressing.
+ *
+ * @param[out] ctx           context to be built
+ * @param[in] usx_hcodes     Horizontal codes (array of bytes). See macro section for samples.
+ * @param[in] usx_hcode_lens Length of each element in usx_hcodes array
+ * @param[in] usx_freq_seq   Frequently occuring sequences. See USX_FREQ_SEQ_* macros for samples
+ * @param[in] usx_templates  Templates of frequently occuring patterns. See USX_TEMPLATES macro.
+ * @param[in] usx_sets       Characters of the sets USX_ALPHA, USX_SYM and USX_NUM by vertical code. See USX_SETS_* macros
+ * @return 0, or -1 if the sets are not valid, in which case the context is built with the default sets
+ */
+extern int unishox2_init_ctx_sets(struct unishox2_ctx *ctx, const unsigned char usx_hcodes[], const unsigned char usx_hcode_lens[],
+              const char *usx_freq_seq[], const char *usx_templates[], const unsigned char usx_sets[][28]);
+/**
+ * Same as unishox2_compress(), but takes the parameter set from ctx
+ */
+extern int unishox2_compress_ctx(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen),
+              const struct unishox2_ctx *ctx);
+/**
+ * Same as unishox2_decompress(), but takes the parameter set from ctx
+ */
+extern int unishox2_decompress_ctx(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen),
+              const struct unishox2_ctx *ctx);
+/**
+ * Same as unishox2_compress_lines(), but takes the parameter set from ctx
+ */
+extern int unishox2_compress_lines_ctx(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen),
+              const struct unishox2_ctx *ctx, struct us_lnk_lst *prev_lines);
+/**
+ * Same as unishox2_decompress_lines(), but takes the parameter set from ctx
+ */
+extern int unishox2_decompress_lines_ctx(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen),
+              const struct unishox2_ctx *ctx, struct us_lnk_lst *prev_lines);
+/// Compression level that does not look for repeats, for the fastest compression
+#define UNISHOX_LEVEL_FASTEST 1
+/// Compression level used by the API functions that are not given unishox2_params
+#define UNISHOX_LEVEL_DEFAULT 6
+/// Compression level that searches all earlier positions for repeats and defers a repeat \n
+/// when a longer one starts at the next position
+#define UNISHOX_LEVEL_MAX 9
+/**
+ * Parameters of the encoder that trade speed for compression ratio.
+ *
+ * These do not change the format, so the output is decompressed as usual \n
+ * irrespective of the parameters used for compressing it.
+ */
+struct unishox2_params {
+  int level;   ///< UNISHOX_LEVEL_FASTEST to UNISHOX_LEVEL_MAX, or 0 for UNISHOX_LEVEL_DEFAULT
+  int optimal; ///< 1 for choosing repeats having the least total bits (much slower, for data compressed once), level is then ignored
+  struct unishox2_stats *stats; ///< counters to which the encoder paths taken are added, or NULL (used only with UNISHOX_STATS)
+};
+/**
+ * Same as unishox2_compress_lines_ctx(), but spends the effort given by the compression level in params
+ *
+ * Levels 2 to 5 limit the earlier positions and previous lines tried for each repeat \n
+ * and levels 7 to 9 try all of them even if UNISHOX_MATCH_CHAIN_DEPTH is set. \n
+ * With params NULL or level UNISHOX_LEVEL_DEFAULT the output is the same as that of unishox2_compress_lines_ctx().
+ *
+ * @param[in] in         Input ASCII / UTF-8 string
+ * @param[in] len        length in bytes
+ * @param[out] out       output buffer
+ * @param[in] olen       length of output buffer (only if UNISHOX_API_WITH_OUTPUT_LEN is set)
+ * @param[in] ctx        context built using unishox2_init_ctx()
+ * @param[in] prev_lines previous lines for finding repeats, or NULL
+ * @param[in] params     encoder parameters, or NULL for the defaults
+ * @return length of compressed data, or olen + 1 if it does not fit in out
+ */
+extern int unishox2_compress_params(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen),
+              const struct unishox2_ctx *ctx, struct us_lnk_lst *prev_lines, const struct unishox2_params *params);
+/**
+ * Finds the exact length of the output of unishox2_compress_ctx() without writing any output
+ *
+ * The encoder makes the same decisions as when compressing, but only counts the bits, \n
+ * so a buffer of exactly the returned size can be allocated before compressing.
+ *
+ * @param[in] in       Input ASCII / UTF-8 string
+ * @param[in] len      length in bytes
+ * @param[in] ctx      context built using unishox2_init_ctx()
+ * @param[out] bit_len if not NULL, set to the number of bits before the terminator and padding
+ * @return number of bytes unishox2_compress_ctx() would write to out
+ */
+extern int unishox2_compressed_size(const char *in, int len, const struct unishox2_ctx *ctx, int *bit_len);
+/**
+ * Finds the exact length of the output of unishox2_decompress_ctx() without writing any output
+ *
+ * The bitstream is walked as when decompressing, but repeats and characters are only counted.
+ *
+ * @param[in] in   Input compressed bytes (output of unishox2_compress functions)
+ * @param[in] len  length of 'in' in bytes
+ * @param[in] ctx  context built using unishox2_init_ctx()
+ * @return number of bytes unishox2_decompress_ctx() would write to out
+ */
+extern int unishox2_decompressed_size(const char *in, int len, const struct unishox2_ctx *ctx);
+/**
+ * Decompresses into a buffer of exactly the required size obtained from the given allocator
+ *
+ * The length is found using unishox2_decompressed_size() and alloc_fn is called once \n
+ * for that length + 1, so that the output can be terminated with a null character.
+ *
+ * @param[in] in        Input compressed bytes (output of unishox2_compress functions)
+ * @param[in] len       length of 'in' in bytes
+ * @param[in] ctx       context built using unishox2_init_ctx()
+ * @param[in] alloc_fn  allocator called with the size and alloc_ctx. If NULL, malloc() is used
+ * @param[in] alloc_ctx passed as is to alloc_fn, for example an arena
+ * @param[out] out_len  if not NULL, set to the length of the output excluding the null character
+ * @return null terminated output, to be released as appropriate for alloc_fn, or NULL if allocation failed
+ */
+extern char *unishox2_decompress_alloc(const char *in, int len, const struct unishox2_ctx *ctx,
+              void *(*alloc_fn)(size_t size, void *alloc_ctx), void *alloc_ctx, int *out_len);
+/**
+ * Compresses an array of strings into one contiguous output buffer
+ *
+ * The compressed form of in[i] is written at out + out_offsets[i] and \n
+ * out_offsets[count] is set to the total length, so the length of each \n
+ * compressed string is out_offsets[i + 1] - out_offsets[i]. \n
+ * The parameter set is taken from ctx so that it is prepared only once for the whole batch \n
+ * and the buffers used for finding repeats in longer strings are allocated once, for the longest string.
+ *
+ * @param[in] in           array of input ASCII / UTF-8 strings
+ * @param[in] in_lens      length of each string in bytes
+ * @param[in] count        number of strings
+ * @param[out] out         output buffer - should be large enough to hold all compressed strings
+ * @param[in] olen         length of 'out' buffer in bytes. Can be omitted if sufficient buffer is provided
+ * @param[out] out_offsets array of count + 1 offsets of each compressed string in out
+ * @param[in] ctx          context built using unishox2_init_ctx()
+ * @return total length of compressed output, or olen + 1 if it does not fit in out
+ */
+extern int unishox2_compress_batch(const char *in[], const int in_lens[], int count,
+              UNISHOX_API_OUT_AND_LEN(char *out, int olen), int out_offsets[], const struct unishox2_ctx *ctx);
+/**
+ * Decompresses an array of strings compressed using unishox2_compress_batch()
+ *
+ * @param[in] in           compressed strings (output of unishox2_compress_batch())
+ * @param[in] in_offsets   array of count + 1 offsets of each compressed string in 'in'
+ * @param[in] count        number of strings
+ * @param[out] out         output buffer - should be large enough to hold all decompressed strings
+ * @param[in] olen         length of 'out' buffer in bytes. Can be omitted if sufficient buffer is provided
+ * @param[out] out_offsets array of count + 1 offsets of each decompressed string in out
+ * @param[in] ctx          context built using unishox2_init_ctx() for the same parameter set
+ * @return total length of decompressed output, or olen + 1 if it does not fit in out
+ */
+extern int unishox2_decompress_batch(const char *in, const int in_offsets[], int count,
+              UNISHOX_API_OUT_AND_LEN(char *out, int olen), int out_offsets[], const struct unishox2_ctx *ctx);
+#if UNISHOX_BATCH_THREADS
+/**
+ * Same as unishox2_compress_batch(), but spreads the strings over num_threads threads
+ *
+ * The batch is split into runs of consecutive strings. Each thread starts with an equal share \n
+ * of runs and steals runs from other threads once it runs out, writing its output to its own buffer. \n
+ * The buffers are then copied to out in input order, so out and out_offsets are identical \n
+ * to those produced by unishox2_compress_batch(). \n
+ * Falls back to a single thread if threads or memory cannot be allocated.
+ *
+ * @param[in] num_threads  number of threads including the calling thread, 0 for number of online processors
+ * @return total length of compressed output, or olen + 1 if it does not fit in out
+ */
+extern int unishox2_compress_batch_mt(const char *in[], const int in_lens[], int count,
+              UNISHOX_API_OUT_AND_LEN(char *out, int olen), int out_offsets[], const struct unishox2_ctx *ctx, int num_threads);
+/**
+ * Same as unishox2_decompress_batch(), but spreads the strings over num_threads threads
+ *
+ * See unishox2_compress_batch_mt() for how the work is divided.
+ *
+ * @param[in] num_threads  number of threads including the calling thread, 0 for number of online processors
+ * @return total length of decompressed output, or olen + 1 if it does not fit in out
+ */
+extern int unishox2_decompress_batch_mt(const char *in, const int in_offsets[], int count,
+              UNISHOX_API_OUT_AND_LEN(char *out, int olen), int out_offsets[], const struct unishox2_ctx *ctx, int num_threads);
+#endif
+/** @} */
+
+/**
+ * @defgroup line_index_api Line Index API
+ * @brief Faster alternative to unishox2_compress_lines() for compressing many lines
+ * @{
+ */
+/**
+ * Initialises an empty line index
+ *
+ * @param[out] idx  index to initialise
+ * @return 1 if successful, 0 if memory could not be allocated
+ */
+extern int unishox2_init_line_index(struct unishox2_line_index *idx);
+/**
+ * Adds a line to the index, usually after compressing it using unishox2_compress_lines_with_index()
+ *
+ * Only the pointer to the line is kept, so it should not be changed or freed until the index is freed. \n
+ * The latest line added is at ctx 1 (the string being compressed being at ctx 0), \n
+ * so lines are to be added in the same order as in the us_lnk_lst passed to unishox2_decompress_lines().
+ *
+ * @param[in] idx   index built using unishox2_init_line_index()
+ * @param[in] line  line to add
+ * @param[in] len   length of line in bytes
+ * @return 1 if successful, 0 if memory could not be allocated
+ */
+extern int unishox2_line_index_add(struct unishox2_line_index *idx, const char *line, int len);
+/**
+ * Frees the memory used by the index
+ */
+extern void unishox2_free_line_index(struct unishox2_line_index *idx);
+/**
+ * Same as unishox2_compress_lines_ctx(), but finds repeats in the lines added to idx
+ *
+ * Output is the same as that of unishox2_compress_lines_ctx() with prev_lines having \n
+ * this string followed by the lines of idx from the latest, but each repeat is \n
+ * looked up in constant time instead of going through every position of every line. \n
+ * The output is decompressed using unishox2_decompress_lines() as usual.
+ *
+ * @param[in] idx  lines compressed so far
+ */
+extern int unishox2_compress_lines_with_index(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen),
+              const struct unishox2_ctx *ctx, const struct unishox2_line_index *idx);
+/** @} */
+
+/**
+ * @defgroup table_api String Table API
+ * @brief Random access to lines of a string table generated using test_unishox2 -gt
+ * @{
+ */
+/**
+ * Opens a string table from a buffer
+ *
+ * @param[out] t     table to initialise. Refers to data, which is not copied
+ * @param[in] data   string table
+ * @param[in] size   length of data in bytes
+ * @return 1 if successful, 0 if data is not a valid string table
+ */
+extern int unishox2_table_open(struct unishox2_table *t, const void *data, size_t size);
+/**
+ * Decompresses line i of the string table
+ *
+ * @param[in] t       table opened using unishox2_table_open() or unishox2_table_map()
+ * @param[in] i       line number starting from 0
+ * @param[out] out    output buffer - t->max_len bytes is sufficient
+ * @param[in] olen    length of 'out' buffer in bytes. Can be omitted if sufficient buffer is provided
+ * @param[in] ctx     context for the parameter set with which the table was generated (see t->preset)
+ * @return length of line, olen + 1 if it does not fit in out, or -1 if i is out of range or the table is corrupt
+ */
+extern int unishox2_table_get(const struct unishox2_table *t, int i, UNISHOX_API_OUT_AND_LEN(char *out, int olen),
+              const struct unishox2_ctx *ctx);
+#if UNISHOX_TABLE_MMAP
+/**
+ * Opens a string table file by mapping it to memory, so that only the pages of lines looked up are read
+ *
+ * @param[out] t     table to initialise
+ * @param[in] path   file name of string table
+ * @return 1 if successful, 0 if the file could not be mapped or is not a valid string table
+ */
+extern int unishox2_table_map(struct unishox2_table *t, const char *path);
+/**
+ * Unmaps a string table opened using unishox2_table_map()
+ */
+extern void unishox2_table_unmap(struct unishox2_table *t);
+#endif
+/** @} */
+
+/**
+ * @defgroup preset_api Preset Selection API
+ * @brief Presets by number, and automatic choice of preset recorded with the compressed string
+ * @{
+ */
+/**
+ * Builds the context for the given preset number (see UNISHOX_PRESET_COUNT). \n
+ * Numbers out of range give the default preset.
+ */
+extern void unishox2_init_preset_ctx(struct unishox2_ctx *ctx, int preset);
+/**
+ * Predicts which preset compresses the input to the least bits
+ *
+ * The first 1024 bytes are sampled to count the switches between sets each preset would need, \n
+ * along with the frequent sequences of each preset and a rough count of repeats. \n
+ * A preset is chosen only if it can encode all characters of the input, so all bytes are checked for that.
+ *
+ * @param[in] in     input string
+ * @param[in] len    length of input string
+ * @return preset number from 0 to UNISHOX_PRESET_COUNT - 1
+ */
+extern int unishox2_select_preset(const char *in, int len);
+/**
+ * Compresses using the preset chosen by unishox2_select_preset(), or preset 0 for strings shorter than 8 bytes. \n
+ * The output starts with one byte having the preset number, so that unishox2_decompress_auto() can use the same. \n
+ * The contexts of the presets are built on the first call of this or unishox2_decompress_auto() and kept for later calls. \n
+ * This is done only once even if called from several threads when UNISHOX_BATCH_THREADS is set, \n
+ * otherwise the first call should be made before starting other threads using them.
+ *
+ * @param[in] in      input string
+ * @param[in] len     length of input string
+ * @param[out] out    output buffer - should be one byte more than needed by unishox2_compress()
+ * @param[in] olen    length of 'out' buffer in bytes. Can be omitted if sufficient buffer is provided
+ * @return length of compressed data including the preset byte, or olen + 1 if it does not fit in out
+ */
+extern int unishox2_compress_auto(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen));
+/**
+ * Decompresses the output of unishox2_compress_auto() using the preset recorded in its first byte
+ *
+ * @param[in] in      compressed string
+ * @param[in] len     length of compressed string
+ * @param[out] out    output buffer
+ * @param[in] olen    length of 'out' buffer in bytes. Can be omitted if sufficient buffer is provided
+ * @return length of decompressed string, olen + 1 if it does not fit in out, or -1 if the preset number is invalid
+ */
+extern int unishox2_decompress_auto(const char *in, int len, UNISHOX_API_OUT_AND_LEN(char *out, int olen));
+/** @} */
+
+#if UNISHOX_STATS
+/**
+ * @defgroup stats_api Statistics API
+ * @brief Counts of encoder paths, to find out why some input compresses badly or slowly (needs UNISHOX_STATS)
+ * @{
+ */
+/// Encoder paths counted in unishox2_stats
+enum {
+  USX_STAT_LITERAL = 0, ///< ASCII characters, CR, LF and TAB, each coded on its own
+  USX_STAT_DICT,        ///< repeats of earlier text or previous lines
+  USX_STAT_REPEAT,      ///< runs of the same character
+  USX_STAT_UUID,        ///< UUIDs
+  USX_STAT_HEX,         ///< runs of hex digits
+  USX_STAT_TEMPLATE,    ///< matches of templates such as dates and phone numbers
+  USX_STAT_FREQ_SEQ,    ///< frequent sequences
+  USX_STAT_UPPER_RUN,   ///< switches into and out of all uppercase
+  USX_STAT_UNICODE,     ///< Unicode characters coded as delta from the previous one
+  USX_STAT_BINARY,      ///< escaped bytes that are not valid UTF-8
+  USX_STAT_COUNT
+};
+/**
+ * Encoder statistics added to by unishox2_compress_params() when given in unishox2_params
+ *
+ * The caller owns the counters and sets them to 0 before use, \n
+ * so each thread can count its own and add them up at the end. \n
+ * Size queries and the trial encodings of optimal parsing are not counted. \n
+ * Bits of a path include the switch codes written for it, so switch_bits overlaps with them. \n
+ * The rest of bits_out is the magic bits and terminator.
+ */
+struct unishox2_stats {
+  unsigned long calls;                   ///< number of strings compressed
+  unsigned long bytes_in;                ///< total length of the strings
+  unsigned long bits_out;                ///< total bits of the output, including padding
+  unsigned long hits[USX_STAT_COUNT];    ///< number of times each path was taken
+  unsigned long bits[USX_STAT_COUNT];    ///< bits written by each path
+  unsigned long switches;                ///< switch codes written by append_switch_code()
+  unsigned long switch_bits;             ///< bits of those switch codes
+};
+/** @} */
+#endif
+
 #endif